@@ -0,0 +1,97 @@
+/**
+ * Long-running capacity coverage service: the road graph of an area is loaded once and
+ * coverage requests are answered on a Unix domain socket (see src/service/coverage_service.h
+ * for the protocol).
+ *
+ * PREREQUISITE
+ * To have a precomputed graph in a directory, graph.flat or graph.dat and ch.dat, as
+ * generated by the ./test/pbf_to_contracted_graph.cpp script.
+ *
+ * COMPILE AND EXECUTE
+ *
+ * # Compile:
+ * g++ -Ilib/RoutingKit/include -Llib/RoutingKit/lib -std=c++11 -O3 ./app/coverage_service.cpp -o ./bin/coverage_service -lroutingkit -lprotobuf-lite -losmpbf -lz -lboost_serialization -pthread
+ * # (add -DCMS_INSTRUMENTATION to serve the metrics and trace requests, see src/utils/instrumentation.h)
+ *
+ * # Add needed shared libraries to the environment variable LD_LIBRARY_PATH:
+ * export LD_LIBRARY_PATH=$LD_LIBRARY_PATH:./lib/RoutingKit/lib:/usr/local/lib64:/usr/local/lib
+ *
+ * # Launch the service: <graph directory> [socket path] [worker count, 0 = all cores]
+ * ./bin/coverage_service ./data/backup/andorra /tmp/cms_coverage.sock 0
+ *
+ * # Query it, e.g. with socat:
+ * echo "coverage 1 300 12 857 42.5063,1.5218" | socat - UNIX-CONNECT:/tmp/cms_coverage.sock
+ * echo "coverage 2 300 metric=night 12 857" | socat - UNIX-CONNECT:/tmp/cms_coverage.sock
+ * echo "update 3 way:6166082=closed way:24915502=x3" | socat - UNIX-CONNECT:/tmp/cms_coverage.sock
+ * echo "stats" | socat - UNIX-CONNECT:/tmp/cms_coverage.sock
+ */
+
+#include <csignal>
+#include "../src/service/coverage_service.h"
+
+cms::GraphCH graph;
+cms::CoverageService* service = nullptr;
+
+void stop_service(int)
+{
+    if (service != nullptr)
+        service->request_stop();
+}
+
+int main(int argc, char*argv[])
+{
+    try{
+
+        if (argc < 2) {
+            std::cerr << "Usage: " << argv[0] << " <graph directory> [socket path] [worker count]" << std::endl;
+            return 1;
+        }
+
+        std::string path_to_data_files = std::string(argv[1]);
+        std::string socket_path = (argc > 2) ? std::string(argv[2]) : "/tmp/cms_coverage.sock";
+
+        cms::CoverageService::Options options;
+        if (argc > 3)
+            options.worker_count = std::stoul(argv[3]);
+
+        cout_message("*** Start loading data in memory ***");
+
+        long long start_time = RoutingKit::get_micro_time();
+
+        // A flat graph file holds both the graph and its contracted form
+        std::ifstream flat_file(path_to_data_files + "/graph.flat");
+        bool has_flat_file = flat_file.good();
+        flat_file.close();
+
+        if (has_flat_file) {
+            graph.load_from_flat_file(path_to_data_files + "/graph.flat");
+        } else {
+            graph.load_from_binary(path_to_data_files + "/graph.dat");
+            graph.load_contraction_hierarchy(path_to_data_files + "/ch.dat");
+            std::ifstream cch_file(path_to_data_files + "/cch.dat");
+            if (cch_file.good())
+                graph.load_customizable_contraction_hierarchy(path_to_data_files + "/cch.dat");
+        }
+
+        cout_message("*** Loading completed in " + microseconds_to_readable_time_cout(RoutingKit::get_micro_time() - start_time) + " ***");
+
+        // Road closures and congestion are applied live to the default metric
+        cms::LiveMetric live_metric(graph);
+
+        cms::CoverageService coverage_service(graph, options);
+        coverage_service.attach_live_metric(live_metric);
+        service = &coverage_service;
+        std::signal(SIGINT, stop_service);
+        std::signal(SIGTERM, stop_service);
+
+        coverage_service.serve(socket_path);
+
+        service = nullptr;
+
+    }catch(std::exception&err){
+        std::cerr << "Stopped on exception : " << err.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
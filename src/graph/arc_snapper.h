@@ -0,0 +1,371 @@
+#pragma once
+
+#include <routingkit/osm_graph_builder.h>
+#include <routingkit/constants.h>
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <numeric>
+#include <thread>
+#include <stdexcept>
+
+#include "../utils/const_array.h"
+
+namespace cms {
+
+	/**
+	 * Position of a GPS fix on the road graph.
+	 */
+	struct SnappedPosition {
+		unsigned arc;		// RoutingKit::invalid_id when no arc is within the search radius
+		float offset;		// share of the arc length before the position, in [0, 1]
+		float distance;		// meters between the fix and the arc
+
+		SnappedPosition() : arc(RoutingKit::invalid_id), offset(0), distance(std::numeric_limits<float>::infinity()) {}
+
+		bool is_valid() const { return arc != RoutingKit::invalid_id; }
+	};
+
+	/**
+	 * The <code>ArcSnapper</code> class maps latitude, longitude fixes to the nearest arc of a
+	 * road graph, following the arc geometry (modelling nodes).
+	 *
+	 * Coordinates are projected once on a local plane in meters and the segments of the arcs
+	 * are bucketed in a uniform grid. The segments of a cell are stored contiguously as
+	 * structures of arrays, so that the point to segment distances of a cell are computed by
+	 * tight loops the compiler vectorizes. A fix visits the rings of cells around it until no
+	 * unvisited segment can be closer than the best one.
+	 *
+	 * The two arcs of a two-way road share their geometry: only one of them is indexed and
+	 * get_twin_arc gives the other one.
+	 */
+	class ArcSnapper {
+	  public:
+
+		ArcSnapper() : origin_latitude(0), origin_longitude(0), meters_per_latitude_degree(0), meters_per_longitude_degree(0),
+			cell_size(0), column_count(0), row_count(0) {}
+
+		/**
+		 * Index the arcs of graph, tail being the tail node of each arc.
+		 *
+		 * @param graph A RoutingKit::OSMRoutingGraph or a Graph, whose columns are read
+		 * through the RoutingKit names (first_out, head, latitude, ...).
+		 * @param cell_size Side of a grid cell in meters, 0 to derive it from the length of
+		 * the road segments.
+		 */
+		template<class RoutingGraph>
+		void build(const RoutingGraph& graph, ConstArray<unsigned> tail, float cell_size = 0) {
+
+			unsigned arc_count = graph.head.size();
+			bool has_geometry = graph.first_modelling_node.size() == arc_count + 1;
+
+			// Local equirectangular projection around the south west corner of the graph
+			float min_latitude = std::numeric_limits<float>::max(), max_latitude = std::numeric_limits<float>::lowest();
+			float min_longitude = std::numeric_limits<float>::max(), max_longitude = std::numeric_limits<float>::lowest();
+			for(unsigned x = 0; x < graph.latitude.size(); ++x){
+				min_latitude = std::min(min_latitude, graph.latitude[x]);
+				max_latitude = std::max(max_latitude, graph.latitude[x]);
+				min_longitude = std::min(min_longitude, graph.longitude[x]);
+				max_longitude = std::max(max_longitude, graph.longitude[x]);
+			}
+			for(unsigned i = 0; i < graph.modelling_node_latitude.size(); ++i){
+				min_latitude = std::min(min_latitude, graph.modelling_node_latitude[i]);
+				max_latitude = std::max(max_latitude, graph.modelling_node_latitude[i]);
+				min_longitude = std::min(min_longitude, graph.modelling_node_longitude[i]);
+				max_longitude = std::max(max_longitude, graph.modelling_node_longitude[i]);
+			}
+			if(graph.latitude.empty())
+				min_latitude = max_latitude = min_longitude = max_longitude = 0;
+
+			origin_latitude = min_latitude;
+			origin_longitude = min_longitude;
+			meters_per_latitude_degree = 6371000.0 * M_PI / 180.0;
+			meters_per_longitude_degree = meters_per_latitude_degree * std::cos((min_latitude + max_latitude) / 2 * M_PI / 180.0);
+
+			// Twin arcs: same way, same extremities, opposite direction
+			twin_arc.assign(arc_count, RoutingKit::invalid_id);
+			for(unsigned a = 0; a < arc_count; ++a){
+				unsigned from = tail[a], to = graph.head[a];
+				for(unsigned b = graph.first_out[to]; b < graph.first_out[to+1]; ++b){
+					if(graph.head[b] == from && graph.way[b] == graph.way[a] && graph.is_arc_antiparallel_to_way[b] != graph.is_arc_antiparallel_to_way[a]){
+						twin_arc[a] = b;
+						break;
+					}
+				}
+			}
+
+			// Segments of the indexed arcs, in arc order
+			std::vector<float> segment_x, segment_y;		// start point, end point is the next point of the arc
+			segment_arc.clear();
+			segment_start_length.clear();
+			segment_length.clear();
+			arc_length.assign(arc_count, 0);
+			std::vector<float> point_x, point_y;
+			std::vector<float> segment_end_x, segment_end_y;
+			for(unsigned a = 0; a < arc_count; ++a){
+				if(graph.is_arc_antiparallel_to_way[a] && twin_arc[a] != RoutingKit::invalid_id)
+					continue;
+
+				point_x.clear();
+				point_y.clear();
+				add_point(graph.latitude[tail[a]], graph.longitude[tail[a]], point_x, point_y);
+				if(has_geometry){
+					for(unsigned i = graph.first_modelling_node[a]; i < graph.first_modelling_node[a+1]; ++i)
+						add_point(graph.modelling_node_latitude[i], graph.modelling_node_longitude[i], point_x, point_y);
+				}
+				add_point(graph.latitude[graph.head[a]], graph.longitude[graph.head[a]], point_x, point_y);
+
+				float length = 0;
+				for(unsigned i = 0; i + 1 < point_x.size(); ++i){
+					float l = std::hypot(point_x[i+1] - point_x[i], point_y[i+1] - point_y[i]);
+					segment_x.push_back(point_x[i]);
+					segment_y.push_back(point_y[i]);
+					segment_end_x.push_back(point_x[i+1]);
+					segment_end_y.push_back(point_y[i+1]);
+					segment_arc.push_back(a);
+					segment_start_length.push_back(length);
+					segment_length.push_back(l);
+					length += l;
+				}
+				arc_length[a] = length;
+			}
+			unsigned segment_count = segment_arc.size();
+
+			// Grid dimensions
+			float width = (max_longitude - min_longitude) * meters_per_longitude_degree;
+			float height = (max_latitude - min_latitude) * meters_per_latitude_degree;
+			if(cell_size <= 0){
+				// A few segments per cell on the roads, the empty cells of the sparse areas being
+				// bounded to 16 per segment
+				double total_length = std::accumulate(segment_length.begin(), segment_length.end(), 0.0);
+				cell_size = std::min(1000.0f, std::max(25.0f, (float)(2.5 * total_length / std::max(1u, segment_count))));
+				cell_size = std::max(cell_size, std::sqrt(width * height / (16.0f * std::max(1u, segment_count))));
+			}
+			this->cell_size = cell_size;
+			column_count = (unsigned)(width / cell_size) + 1;
+			row_count = (unsigned)(height / cell_size) + 1;
+			if((uint64_t)column_count * row_count > std::numeric_limits<unsigned>::max() / 2)
+				throw std::runtime_error("Too many cells in the arc snapping grid, increase the cell size");
+
+			// Bucket each segment in every cell its bounding box overlaps
+			cell_first.assign((size_t)column_count * row_count + 1, 0);
+			for(int pass = 0; pass < 2; ++pass){
+				std::vector<unsigned> next_slot;
+				if(pass == 1){
+					for(size_t c = 0; c + 1 < cell_first.size(); ++c)
+						cell_first[c + 1] += cell_first[c];
+					next_slot.assign(cell_first.begin(), cell_first.end() - 1);
+					unsigned slot_count = cell_first.back();
+					slot_data.resize((size_t)slot_count * slot_field_count);
+					slot_segment.resize(slot_count);
+				}
+				for(unsigned s = 0; s < segment_count; ++s){
+					unsigned first_column = get_column(std::min(segment_x[s], segment_end_x[s]));
+					unsigned last_column = get_column(std::max(segment_x[s], segment_end_x[s]));
+					unsigned first_row = get_row(std::min(segment_y[s], segment_end_y[s]));
+					unsigned last_row = get_row(std::max(segment_y[s], segment_end_y[s]));
+					for(unsigned row = first_row; row <= last_row; ++row){
+						for(unsigned column = first_column; column <= last_column; ++column){
+							size_t cell = (size_t)row * column_count + column;
+							if(pass == 0){
+								++cell_first[cell + 1];
+								continue;
+							}
+							unsigned slot = next_slot[cell]++;
+							unsigned slot_in_cell = slot - cell_first[cell];
+							unsigned cell_slot_count = cell_first[cell + 1] - cell_first[cell];
+							float* field = &slot_data[(size_t)cell_first[cell] * slot_field_count + slot_in_cell];
+							float dx = segment_end_x[s] - segment_x[s], dy = segment_end_y[s] - segment_y[s];
+							float squared_length = dx * dx + dy * dy;
+							field[0 * cell_slot_count] = segment_x[s];
+							field[1 * cell_slot_count] = segment_y[s];
+							field[2 * cell_slot_count] = dx;
+							field[3 * cell_slot_count] = dy;
+							field[4 * cell_slot_count] = squared_length > 0 ? 1 / squared_length : 0;
+							slot_segment[slot] = s;
+						}
+					}
+				}
+			}
+		}
+
+		bool is_built() const {
+			return !cell_first.empty();
+		}
+
+		void clear() {
+			*this = ArcSnapper();
+		}
+
+		/**
+		 * Arc running along the same road as arc in the opposite direction,
+		 * RoutingKit::invalid_id for a one-way road.
+		 */
+		unsigned get_twin_arc(unsigned arc) const {
+			return twin_arc[arc];
+		}
+
+		/**
+		 * Nearest arc of a fix within max_distance meters.
+		 */
+		SnappedPosition snap(float latitude, float longitude, float max_distance = 100) const {
+			SnappedPosition position;
+			if(!is_built())
+				throw std::runtime_error("The arc snapper is not built");
+
+			float x = (longitude - origin_longitude) * meters_per_longitude_degree;
+			float y = (latitude - origin_latitude) * meters_per_latitude_degree;
+			long long center_column = (long long)std::floor(x / cell_size);
+			long long center_row = (long long)std::floor(y / cell_size);
+
+			float best_squared_distance = max_distance * max_distance;
+			unsigned best_slot = RoutingKit::invalid_id;
+			float best_t = 0;
+
+			// Distance from the fix to the sides of its cell, the cells of ring r are at least
+			// (r - 1) * cell_size + edge_distance away from it
+			float edge_distance = std::min(std::min(x - center_column * cell_size, (center_column + 1) * cell_size - x), std::min(y - center_row * cell_size, (center_row + 1) * cell_size - y));
+
+			long long last_ring = (long long)(max_distance / cell_size) + 1;
+			long long grid_ring = std::max(std::max(center_column, (long long)column_count - 1 - center_column), std::max(center_row, (long long)row_count - 1 - center_row));
+			last_ring = std::min(last_ring, grid_ring);
+			for(long long ring = 0; ring <= last_ring; ++ring){
+				if(ring > 0 && best_slot != RoutingKit::invalid_id){
+					float ring_distance = (ring - 1) * cell_size + edge_distance;
+					if(ring_distance * ring_distance >= best_squared_distance)
+						break;
+				}
+				for(long long row = center_row - ring; row <= center_row + ring; ++row){
+					if(row < 0 || row >= row_count)
+						continue;
+					bool is_ring_row = (row == center_row - ring || row == center_row + ring);
+					long long column_step = is_ring_row ? 1 : 2 * ring;
+					for(long long column = center_column - ring; column <= center_column + ring; column += std::max(1LL, column_step)){
+						if(column < 0 || column >= column_count)
+							continue;
+						size_t cell = (size_t)row * column_count + column;
+						scan_cell(cell_first[cell], cell_first[cell + 1], x, y, best_squared_distance, best_slot, best_t);
+					}
+				}
+			}
+
+			if(best_slot == RoutingKit::invalid_id)
+				return position;
+
+			unsigned s = slot_segment[best_slot];
+			unsigned a = segment_arc[s];
+			position.arc = a;
+			position.offset = arc_length[a] > 0 ? std::min(1.0f, (segment_start_length[s] + best_t * segment_length[s]) / arc_length[a]) : 0;
+			position.distance = std::sqrt(best_squared_distance);
+			return position;
+		}
+
+		/**
+		 * Snap a batch of fixes, positions[i] being the position of latitude[i], longitude[i].
+		 *
+		 * @param thread_count Threads sharing the batch, 0 to use all the available cores.
+		 */
+		void snap(const std::vector<float>& latitude, const std::vector<float>& longitude, std::vector<SnappedPosition>& positions, float max_distance = 100, unsigned thread_count = 1) const {
+			if(latitude.size() != longitude.size())
+				throw std::runtime_error("The latitude and longitude vectors of the fixes differ in size");
+			unsigned fix_count = latitude.size();
+			positions.resize(fix_count);
+
+			if(thread_count == 0)
+				thread_count = std::max(1u, std::thread::hardware_concurrency());
+			// A thread is not worth starting for less than a thousand fixes
+			thread_count = std::max(1u, std::min(thread_count, fix_count / 1024));
+
+			auto snap_range = [&](unsigned begin, unsigned end){
+				for(unsigned i = begin; i < end; ++i)
+					positions[i] = snap(latitude[i], longitude[i], max_distance);
+			};
+			if(thread_count == 1){
+				snap_range(0, fix_count);
+				return;
+			}
+			std::vector<std::thread> workers;
+			for(unsigned t = 0; t < thread_count; ++t)
+				workers.emplace_back(snap_range, (uint64_t)fix_count * t / thread_count, (uint64_t)fix_count * (t + 1) / thread_count);
+			for(auto& worker : workers)
+				worker.join();
+		}
+
+	  private:
+		// Segments scanned per step of the distance kernel
+		static const unsigned block_size = 16;
+
+		float origin_latitude, origin_longitude;
+		float meters_per_latitude_degree, meters_per_longitude_degree;
+		float cell_size;
+		unsigned column_count, row_count;
+
+		std::vector<unsigned> twin_arc;
+		std::vector<float> arc_length;
+
+		std::vector<unsigned> segment_arc;
+		std::vector<float> segment_start_length;	// length of the arc before the segment
+		std::vector<float> segment_length;
+
+		// Segments of cell c are the slots cell_first[c]..cell_first[c+1]. The fields of the
+		// slots of a cell are stored together, field after field: start x, start y, dx, dy
+		// and inverse squared length of the segment
+		static const unsigned slot_field_count = 5;
+		std::vector<unsigned> cell_first;
+		std::vector<float> slot_data;
+		std::vector<unsigned> slot_segment;
+
+		void add_point(float latitude, float longitude, std::vector<float>& x, std::vector<float>& y) const {
+			x.push_back((longitude - origin_longitude) * meters_per_longitude_degree);
+			y.push_back((latitude - origin_latitude) * meters_per_latitude_degree);
+		}
+
+		unsigned get_column(float x) const {
+			return std::min(column_count - 1, (unsigned)std::max(0.0f, x / cell_size));
+		}
+
+		unsigned get_row(float y) const {
+			return std::min(row_count - 1, (unsigned)std::max(0.0f, y / cell_size));
+		}
+
+		/**
+		 * Keep the closest of the slots [begin, end) to (x, y) if closer than the best one.
+		 */
+		void scan_cell(unsigned begin, unsigned end, float x, float y, float& best_squared_distance, unsigned& best_slot, float& best_t) const {
+			float squared_distance[block_size];
+			float t[block_size];
+			unsigned cell_slot_count = end - begin;
+			const float* field = slot_data.data() + (size_t)begin * slot_field_count;
+			for(unsigned block = begin; block < end; block += block_size){
+				unsigned count = std::min(block_size, end - block);
+				unsigned i0 = block - begin;
+				const float* sx = field + i0;
+				const float* sy = field + cell_slot_count + i0;
+				const float* dx = field + 2 * cell_slot_count + i0;
+				const float* dy = field + 3 * cell_slot_count + i0;
+				const float* inverse_squared_length = field + 4 * cell_slot_count + i0;
+				// Branch free point to segment distances, vectorized by the compiler
+				for(unsigned i = 0; i < count; ++i){
+					float px = x - sx[i];
+					float py = y - sy[i];
+					float ti = (px * dx[i] + py * dy[i]) * inverse_squared_length[i];
+					ti = ti < 0 ? 0 : (ti > 1 ? 1 : ti);
+					float ex = px - ti * dx[i];
+					float ey = py - ti * dy[i];
+					squared_distance[i] = ex * ex + ey * ey;
+					t[i] = ti;
+				}
+				for(unsigned i = 0; i < count; ++i){
+					if(squared_distance[i] < best_squared_distance || (squared_distance[i] == best_squared_distance && best_slot == RoutingKit::invalid_id)){
+						best_squared_distance = squared_distance[i];
+						best_slot = block + i;
+						best_t = t[i];
+					}
+				}
+			}
+		}
+	};
+
+}
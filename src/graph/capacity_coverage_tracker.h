@@ -0,0 +1,185 @@
+#pragma once
+
+#include "graph.h"
+
+#include <unordered_map>
+#include <vector>
+#include <stdexcept>
+
+namespace cms {
+
+	/**
+	 * The <code>CapacityCoverageTracker</code> class keeps the capacity coverage of a GraphCH
+	 * up to date while units are added, moved or removed one at a time.
+	 *
+	 * Each unit keeps the set of nodes it reaches under the threshold. A change subtracts the
+	 * old reach from graph.capacity_coverage_node, adds the new one, and only recomputes
+	 * graph.capacity_coverage_way for the arcs incident to the nodes whose count changed.
+	 * A refresh therefore costs the isochrones of the changed units, not the whole fleet.
+	 *
+	 * The tracker owns the coverage vectors of the graph: calling capacity_coverage on the
+	 * same graph afterwards makes the tracker state stale.
+	 */
+	class CapacityCoverageTracker {
+	  public:
+
+		/**
+		 * @param threshold Time in seconds under which a unit covers a node.
+		 */
+		explicit CapacityCoverageTracker(GraphCH& graph, unsigned threshold = 300)
+			: graph(graph), threshold(threshold * 1000),
+			  query(graph.first_out, graph.head, graph.travel_time)
+		{
+			graph.capacity_coverage_node.assign(graph.node_count, 0);
+			graph.capacity_coverage_way.assign(graph.arc_count, 0);
+
+			// Arcs entering each node, to update the ways on both sides of a changed node
+			in_first_out.assign(graph.node_count + 1, 0);
+			for(unsigned a = 0; a < graph.arc_count; ++a)
+				++in_first_out[graph.head[a] + 1];
+			for(unsigned x = 0; x < graph.node_count; ++x)
+				in_first_out[x + 1] += in_first_out[x];
+			in_arc.resize(graph.arc_count);
+			std::vector<unsigned> next_in = in_first_out;
+			for(unsigned a = 0; a < graph.arc_count; ++a)
+				in_arc[next_in[graph.head[a]]++] = a;
+
+			is_node_changed.assign(graph.node_count, false);
+		}
+
+		/**
+		 * Position a new unit on the given node.
+		 */
+		void add_unit(unsigned unit_id, unsigned node) {
+			if(units.count(unit_id))
+				throw std::runtime_error("Unit " + std::to_string(unit_id) + " is already tracked");
+			check_node(node);
+			Unit& unit = units[unit_id];
+			unit.node = node;
+			add_reach(unit);
+			update_changed_ways();
+		}
+
+		/**
+		 * Move an already tracked unit to the given node.
+		 */
+		void move_unit(unsigned unit_id, unsigned node) {
+			Unit& unit = get_unit(unit_id);
+			check_node(node);
+			if(unit.node == node)
+				return;
+			subtract_reach(unit);
+			unit.node = node;
+			add_reach(unit);
+			update_changed_ways();
+		}
+
+		/**
+		 * Stop tracking a unit and withdraw its coverage.
+		 */
+		void remove_unit(unsigned unit_id) {
+			Unit& unit = get_unit(unit_id);
+			subtract_reach(unit);
+			units.erase(unit_id);
+			update_changed_ways();
+		}
+
+		/**
+		 * Change the time threshold (in seconds), every unit reach is recomputed.
+		 */
+		void set_threshold(unsigned new_threshold) {
+			threshold = new_threshold * 1000;
+			std::fill(graph.capacity_coverage_node.begin(), graph.capacity_coverage_node.end(), 0);
+			std::fill(graph.capacity_coverage_way.begin(), graph.capacity_coverage_way.end(), 0);
+			for(auto& unit : units){
+				unit.second.reach.clear();
+				add_reach(unit.second);
+			}
+			update_changed_ways();
+		}
+
+		bool has_unit(unsigned unit_id) const {
+			return units.count(unit_id) != 0;
+		}
+
+		unsigned get_unit_count() const {
+			return units.size();
+		}
+
+	  private:
+		struct Unit {
+			unsigned node;
+			std::vector<unsigned> reach; // nodes reached under the threshold
+		};
+
+		GraphCH& graph;
+		unsigned threshold;
+		IsochroneQuery query;
+		std::unordered_map<unsigned, Unit> units;
+
+		std::vector<unsigned> in_first_out;
+		std::vector<unsigned> in_arc;
+
+		std::vector<bool> is_node_changed;
+		std::vector<unsigned> changed_nodes;
+
+		Unit& get_unit(unsigned unit_id) {
+			auto it = units.find(unit_id);
+			if(it == units.end())
+				throw std::runtime_error("Unit " + std::to_string(unit_id) + " is not tracked");
+			return it->second;
+		}
+
+		void check_node(unsigned node) const {
+			if(node >= graph.node_count)
+				throw std::runtime_error("Invalid unit node " + std::to_string(node));
+		}
+
+		void mark_changed(unsigned node) {
+			if(!is_node_changed[node]){
+				is_node_changed[node] = true;
+				changed_nodes.push_back(node);
+			}
+		}
+
+		void add_reach(Unit& unit) {
+			query.reset().add_source(unit.node).run(threshold);
+			unit.reach = query.get_reached_nodes();
+			for(unsigned x : unit.reach){
+				graph.capacity_coverage_node[x]++;
+				mark_changed(x);
+			}
+		}
+
+		void subtract_reach(Unit& unit) {
+			for(unsigned x : unit.reach){
+				graph.capacity_coverage_node[x]--;
+				mark_changed(x);
+			}
+			unit.reach.clear();
+		}
+
+		/**
+		 * Recompute the ways of the arcs incident to the nodes changed since the last call,
+		 * with the same rule as GraphCH::capacity_coverage.
+		 */
+		void update_changed_ways() {
+			ConstArray<unsigned> first_out = graph.first_out;
+			ConstArray<unsigned> head = graph.head;
+			const std::vector<unsigned>& coverage_node = graph.capacity_coverage_node;
+			std::vector<unsigned>& coverage_way = graph.capacity_coverage_way;
+
+			for(unsigned x : changed_nodes){
+				for(unsigned a = first_out[x]; a < first_out[x+1]; ++a)
+					coverage_way[a] = (coverage_node[head[a]] + coverage_node[x]) / 2;
+				for(unsigned i = in_first_out[x]; i < in_first_out[x+1]; ++i){
+					unsigned a = in_arc[i];
+					coverage_way[a] = (coverage_node[x] + coverage_node[graph.tail[a]]) / 2;
+				}
+				is_node_changed[x] = false;
+			}
+			changed_nodes.clear();
+		}
+	};
+
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include "graph.h"
+
+#include <vector>
+#include <limits>
+#include <stdexcept>
+#include <algorithm>
+
+namespace cms {
+
+	/**
+	 * The <code>CoverageHistogram</code> class makes the capacity coverage of a fleet
+	 * available for any time threshold after a single search pass.
+	 *
+	 * compute() searches every unit once up to max_threshold and stores, for each reached
+	 * node, the buckets of bucket_width seconds in which units arrive along with the number
+	 * of units arrived by the end of each of them. Only the buckets where a unit arrives are
+	 * stored, so the histograms take no more room than the arrivals themselves, and the
+	 * coverage of a node for a threshold is a binary search among its buckets:
+	 * capacity_coverage(threshold) needs no graph search.
+	 *
+	 * Thresholds are rounded down to a multiple of bucket_width (exact for thresholds that are
+	 * multiples of it); thresholds above max_threshold are rejected.
+	 */
+	class CoverageHistogram {
+	  public:
+
+		// Units counted per node, limits the fleet size
+		typedef uint16_t Counter;
+		// Index of a bucket, limits the number of buckets
+		typedef uint16_t Bucket;
+
+		/**
+		 * @param bucket_width Width of a bucket in seconds.
+		 * @param max_threshold Largest threshold in seconds that can be answered.
+		 */
+		explicit CoverageHistogram(GraphCH& graph, unsigned bucket_width = 60, unsigned max_threshold = 1800)
+			: graph(graph), bucket_width(bucket_width), bucket_count(0),
+			  query(graph.first_out, graph.head, graph.travel_time)
+		{
+			if(bucket_width == 0)
+				throw std::runtime_error("The bucket width of a coverage histogram can not be null");
+			bucket_count = (max_threshold + bucket_width - 1) / bucket_width;
+			if(bucket_count > std::numeric_limits<Bucket>::max())
+				throw std::runtime_error("Too many buckets for a coverage histogram, widen them");
+		}
+
+		/**
+		 * Search every unit of source_list up to max_threshold and build the histograms.
+		 */
+		void compute(const std::vector<unsigned>& source_list) {
+
+			if(source_list.size() > std::numeric_limits<Counter>::max())
+				throw std::runtime_error("Too many units for the coverage histogram counters");
+
+			long long start_time = RoutingKit::get_micro_time();
+
+			unsigned node_count = graph.node_count;
+			unsigned bucket_width_ms = bucket_width * 1000;
+
+			// Arrivals as node * bucket_count + bucket, grouped by node then bucket
+			std::vector<uint64_t> arrival;
+			for(unsigned s : source_list){
+				query.reset().add_source(s).run(bucket_count * bucket_width_ms);
+				for(unsigned x : query.get_reached_nodes())
+					arrival.push_back((uint64_t)x * bucket_count + query.get_distance(x) / bucket_width_ms);
+			}
+			std::sort(arrival.begin(), arrival.end());
+
+			// One entry per node and bucket with arrivals, counting the units arrived so far
+			first_entry.assign(node_count + 1, 0);
+			entry_bucket.clear();
+			entry_count.clear();
+			for(size_t i = 0; i < arrival.size(); ){
+				unsigned x = arrival[i] / bucket_count;
+				Counter count = 0;
+				while(i < arrival.size() && arrival[i] / bucket_count == x){
+					uint64_t key = arrival[i];
+					for(; i < arrival.size() && arrival[i] == key; ++i)
+						++count;
+					entry_bucket.push_back(key % bucket_count);
+					entry_count.push_back(count);
+				}
+				first_entry[x + 1] = entry_bucket.size();
+			}
+			for(unsigned x = 0; x < node_count; ++x)
+				first_entry[x + 1] = std::max(first_entry[x + 1], first_entry[x]);
+
+			cout_message("Coverage histograms of " + std::to_string(source_list.size()) + " units over " + std::to_string(bucket_count) + " buckets of " + std::to_string(bucket_width) + " seconds computed in " + microseconds_to_readable_time_cout(RoutingKit::get_micro_time() - start_time) + " (" + std::to_string(entry_bucket.size()) + " entries)");
+		}
+
+		/**
+		 * Number of units reaching the node under threshold seconds.
+		 */
+		unsigned get_node_coverage(unsigned node, unsigned threshold) const {
+			return get_node_coverage_under_bucket(node, get_bucket(threshold));
+		}
+
+		/**
+		 * Fill graph.capacity_coverage_node and graph.capacity_coverage_way for the given
+		 * threshold in seconds, as GraphCH::capacity_coverage would.
+		 *
+		 * @prerequisite compute should have been executed first.
+		 */
+		void capacity_coverage(unsigned threshold) {
+			unsigned node_count = graph.node_count;
+			unsigned b = get_bucket(threshold);
+
+			graph.capacity_coverage_node.resize(node_count);
+			graph.capacity_coverage_way.resize(graph.arc_count);
+
+			for(unsigned x = 0; x < node_count; ++x)
+				graph.capacity_coverage_node[x] = get_node_coverage_under_bucket(x, b);
+			graph.compute_capacity_coverage_way();
+		}
+
+		unsigned get_bucket_width() const {
+			return bucket_width;
+		}
+
+		unsigned get_max_threshold() const {
+			return bucket_count * bucket_width;
+		}
+
+	  private:
+		GraphCH& graph;
+		unsigned bucket_width;
+		unsigned bucket_count;
+		IsochroneQuery query;
+
+		// Entries of node x: [first_entry[x], first_entry[x+1]), by increasing bucket, each
+		// with the number of units arrived by the end of its bucket
+		std::vector<unsigned> first_entry;
+		std::vector<Bucket> entry_bucket;
+		std::vector<Counter> entry_count;
+
+		// Number of complete buckets under threshold seconds
+		unsigned get_bucket(unsigned threshold) const {
+			if(first_entry.empty())
+				throw std::runtime_error("Coverage histograms have not been computed");
+			if(threshold > get_max_threshold())
+				throw std::runtime_error("Threshold of " + std::to_string(threshold) + " seconds above the " + std::to_string(get_max_threshold()) + " seconds of the coverage histograms");
+			return threshold / bucket_width;
+		}
+
+		// Units arrived in the first b buckets
+		unsigned get_node_coverage_under_bucket(unsigned node, unsigned b) const {
+			const Bucket* first = entry_bucket.data() + first_entry[node];
+			const Bucket* last = entry_bucket.data() + first_entry[node+1];
+			const Bucket* next = std::lower_bound(first, last, b);
+			return next == first ? 0 : entry_count[next - entry_bucket.data() - 1];
+		}
+	};
+
+}
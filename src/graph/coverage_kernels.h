@@ -0,0 +1,254 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CMS_COVERAGE_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+namespace cms {
+
+	/**
+	 * SIMD kernels of the capacity coverage loops that touch every node or every arc:
+	 *  - accumulate_lanes_below: count, for each node of a PHAST sweep, the lanes under the
+	 *    threshold and add them to the node counter,
+	 *  - add_counters: add per-thread counters to the node coverage,
+	 *  - aggregate_arc_coverage: average the coverage of the two extremities of every arc.
+	 *
+	 * The counters are templated on their type so that the per-thread counters take one
+	 * byte per node for up to 255 units, two for up to 65535 (see get_counter_width), which
+	 * divides the memory traffic of the accumulation and of the merge accordingly.
+	 *
+	 * The instruction set is chosen at runtime, AVX-512 or AVX2 when the processor supports
+	 * them and scalar code otherwise, whatever the compilation flags. The environment
+	 * variable CMS_INSTRUCTION_SET (scalar, avx2 or avx512) caps the choice, e.g. to compare
+	 * the kernels.
+	 */
+	namespace coverage_kernels {
+
+		enum InstructionSet { scalar_instructions, avx2_instructions, avx512_instructions };
+
+		inline InstructionSet detect_instruction_set() {
+			InstructionSet supported = scalar_instructions;
+#ifdef CMS_COVERAGE_KERNELS_X86
+			__builtin_cpu_init();
+			if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("popcnt"))
+				supported = avx512_instructions;
+			else if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+				supported = avx2_instructions;
+#endif
+			const char* requested = getenv("CMS_INSTRUCTION_SET");
+			if(requested != nullptr){
+				if(strcmp(requested, "scalar") == 0)
+					supported = scalar_instructions;
+				else if(strcmp(requested, "avx2") == 0 && supported > avx2_instructions)
+					supported = avx2_instructions;
+			}
+			return supported;
+		}
+
+		inline InstructionSet get_instruction_set() {
+			static const InstructionSet instruction_set = detect_instruction_set();
+			return instruction_set;
+		}
+
+		inline const char* get_instruction_set_name() {
+			static const char* names[] = {"scalar", "avx2", "avx512"};
+			return names[get_instruction_set()];
+		}
+
+		/**
+		 * Bytes per counter able to count up to max_count units: 1, 2 or 4.
+		 */
+		inline unsigned get_counter_width(uint64_t max_count) {
+			return max_count <= 0xFF ? 1 : (max_count <= 0xFFFF ? 2 : 4);
+		}
+
+		// Scalar kernels
+
+		template<unsigned lane_count, class Counter>
+		void accumulate_lanes_below_scalar(const unsigned* distance, unsigned node_count, unsigned threshold, Counter* counter) {
+			for(unsigned r = 0; r < node_count; ++r){
+				const unsigned* d = distance + (size_t)r * lane_count;
+				unsigned count = 0;
+				for(unsigned l = 0; l < lane_count; ++l)
+					count += d[l] < threshold;
+				counter[r] += count;
+			}
+		}
+
+		template<class Counter>
+		void add_counters_scalar(const Counter* from, unsigned count, unsigned* to) {
+			for(unsigned i = 0; i < count; ++i)
+				to[i] += from[i];
+		}
+
+		inline void aggregate_arc_coverage_scalar(const unsigned* node_coverage, const unsigned* head, const unsigned* tail, unsigned arc_count, unsigned* arc_coverage) {
+			for(unsigned a = 0; a < arc_count; ++a)
+				arc_coverage[a] = (node_coverage[head[a]] + node_coverage[tail[a]]) / 2;
+		}
+
+#ifdef CMS_COVERAGE_KERNELS_X86
+
+		// AVX2 kernels, distances and thresholds being below 2^31 the signed comparisons hold
+
+		template<unsigned lane_count, class Counter>
+		__attribute__((target("avx2,popcnt")))
+		void accumulate_lanes_below_avx2(const unsigned* distance, unsigned node_count, unsigned threshold, Counter* counter) {
+			const __m256i limit = _mm256_set1_epi32((int)threshold);
+			for(unsigned r = 0; r < node_count; ++r){
+				const unsigned* d = distance + (size_t)r * lane_count;
+				unsigned count = 0;
+				for(unsigned l = 0; l + 8 <= lane_count; l += 8){
+					__m256i below = _mm256_cmpgt_epi32(limit, _mm256_loadu_si256((const __m256i*)(d + l)));
+					count += _mm_popcnt_u32(_mm256_movemask_ps(_mm256_castsi256_ps(below)));
+				}
+				for(unsigned l = lane_count / 8 * 8; l < lane_count; ++l)
+					count += d[l] < threshold;
+				counter[r] += count;
+			}
+		}
+
+		__attribute__((target("avx2"))) inline __m256i load_widened_avx2(const uint8_t* from) {
+			return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)from));
+		}
+		__attribute__((target("avx2"))) inline __m256i load_widened_avx2(const uint16_t* from) {
+			return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)from));
+		}
+		__attribute__((target("avx2"))) inline __m256i load_widened_avx2(const unsigned* from) {
+			return _mm256_loadu_si256((const __m256i*)from);
+		}
+
+		template<class Counter>
+		__attribute__((target("avx2")))
+		void add_counters_avx2(const Counter* from, unsigned count, unsigned* to) {
+			unsigned i = 0;
+			for(; i + 8 <= count; i += 8){
+				__m256i sum = _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(to + i)), load_widened_avx2(from + i));
+				_mm256_storeu_si256((__m256i*)(to + i), sum);
+			}
+			add_counters_scalar(from + i, count - i, to + i);
+		}
+
+		__attribute__((target("avx2")))
+		inline void aggregate_arc_coverage_avx2(const unsigned* node_coverage, const unsigned* head, const unsigned* tail, unsigned arc_count, unsigned* arc_coverage) {
+			const int* coverage = (const int*)node_coverage;
+			unsigned a = 0;
+			for(; a + 8 <= arc_count; a += 8){
+				__m256i head_coverage = _mm256_i32gather_epi32(coverage, _mm256_loadu_si256((const __m256i*)(head + a)), 4);
+				__m256i tail_coverage = _mm256_i32gather_epi32(coverage, _mm256_loadu_si256((const __m256i*)(tail + a)), 4);
+				_mm256_storeu_si256((__m256i*)(arc_coverage + a), _mm256_srli_epi32(_mm256_add_epi32(head_coverage, tail_coverage), 1));
+			}
+			aggregate_arc_coverage_scalar(node_coverage, head + a, tail + a, arc_count - a, arc_coverage + a);
+		}
+
+		// AVX-512 kernels, the undefined vectors of the GCC intrinsics trigger false
+		// -Wmaybe-uninitialized warnings once inlined
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+		template<unsigned lane_count, class Counter>
+		__attribute__((target("avx512f,avx512bw,popcnt")))
+		void accumulate_lanes_below_avx512(const unsigned* distance, unsigned node_count, unsigned threshold, Counter* counter) {
+			const __m512i limit = _mm512_set1_epi32((int)threshold);
+			for(unsigned r = 0; r < node_count; ++r){
+				const unsigned* d = distance + (size_t)r * lane_count;
+				unsigned count = 0;
+				for(unsigned l = 0; l + 16 <= lane_count; l += 16)
+					count += _mm_popcnt_u32(_mm512_cmplt_epu32_mask(_mm512_loadu_si512((const void*)(d + l)), limit));
+				for(unsigned l = lane_count / 16 * 16; l < lane_count; ++l)
+					count += d[l] < threshold;
+				counter[r] += count;
+			}
+		}
+
+		__attribute__((target("avx512f"))) inline __m512i load_widened_avx512(const uint8_t* from) {
+			return _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)from));
+		}
+		__attribute__((target("avx512f"))) inline __m512i load_widened_avx512(const uint16_t* from) {
+			return _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)from));
+		}
+		__attribute__((target("avx512f"))) inline __m512i load_widened_avx512(const unsigned* from) {
+			return _mm512_loadu_si512((const void*)from);
+		}
+
+		template<class Counter>
+		__attribute__((target("avx512f")))
+		void add_counters_avx512(const Counter* from, unsigned count, unsigned* to) {
+			unsigned i = 0;
+			for(; i + 16 <= count; i += 16){
+				__m512i sum = _mm512_add_epi32(_mm512_loadu_si512((const void*)(to + i)), load_widened_avx512(from + i));
+				_mm512_storeu_si512((void*)(to + i), sum);
+			}
+			add_counters_scalar(from + i, count - i, to + i);
+		}
+
+		__attribute__((target("avx512f")))
+		inline void aggregate_arc_coverage_avx512(const unsigned* node_coverage, const unsigned* head, const unsigned* tail, unsigned arc_count, unsigned* arc_coverage) {
+			unsigned a = 0;
+			for(; a + 16 <= arc_count; a += 16){
+				__m512i head_coverage = _mm512_i32gather_epi32(_mm512_loadu_si512((const void*)(head + a)), (const void*)node_coverage, 4);
+				__m512i tail_coverage = _mm512_i32gather_epi32(_mm512_loadu_si512((const void*)(tail + a)), (const void*)node_coverage, 4);
+				_mm512_storeu_si512((void*)(arc_coverage + a), _mm512_srli_epi32(_mm512_add_epi32(head_coverage, tail_coverage), 1));
+			}
+			aggregate_arc_coverage_scalar(node_coverage, head + a, tail + a, arc_count - a, arc_coverage + a);
+		}
+
+#pragma GCC diagnostic pop
+
+#endif
+
+		// Dispatched kernels
+
+		/**
+		 * Add to counter[r] the number of the lane_count distances of rank r, as laid out by
+		 * PHASTQuery, strictly under threshold (below 2^31), for every rank r < node_count.
+		 */
+		template<unsigned lane_count, class Counter>
+		void accumulate_lanes_below(const unsigned* distance, unsigned node_count, unsigned threshold, Counter* counter) {
+#ifdef CMS_COVERAGE_KERNELS_X86
+			if(get_instruction_set() == avx512_instructions)
+				return accumulate_lanes_below_avx512<lane_count>(distance, node_count, threshold, counter);
+			if(get_instruction_set() == avx2_instructions)
+				return accumulate_lanes_below_avx2<lane_count>(distance, node_count, threshold, counter);
+#endif
+			accumulate_lanes_below_scalar<lane_count>(distance, node_count, threshold, counter);
+		}
+
+		/**
+		 * to[i] += from[i] for every i < count.
+		 */
+		template<class Counter>
+		void add_counters(const Counter* from, unsigned count, unsigned* to) {
+#ifdef CMS_COVERAGE_KERNELS_X86
+			if(get_instruction_set() == avx512_instructions)
+				return add_counters_avx512(from, count, to);
+			if(get_instruction_set() == avx2_instructions)
+				return add_counters_avx2(from, count, to);
+#endif
+			add_counters_scalar(from, count, to);
+		}
+
+		/**
+		 * arc_coverage[a] = (node_coverage[head[a]] + node_coverage[tail[a]]) / 2, the node
+		 * indexes being below 2^31.
+		 */
+		inline void aggregate_arc_coverage(const unsigned* node_coverage, const unsigned* head, const unsigned* tail, unsigned arc_count, unsigned* arc_coverage) {
+#ifdef CMS_COVERAGE_KERNELS_X86
+			if(get_instruction_set() == avx512_instructions)
+				return aggregate_arc_coverage_avx512(node_coverage, head, tail, arc_count, arc_coverage);
+			if(get_instruction_set() == avx2_instructions)
+				return aggregate_arc_coverage_avx2(node_coverage, head, tail, arc_count, arc_coverage);
+#endif
+			aggregate_arc_coverage_scalar(node_coverage, head, tail, arc_count, arc_coverage);
+		}
+
+	}
+
+}
@@ -0,0 +1,282 @@
+#pragma once
+
+#include "graph.h"
+
+#include <vector>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <limits>
+#include <stdexcept>
+
+namespace cms {
+
+	/**
+	 * The <code>CoverageScenarios</code> class evaluates many fleet configurations, called
+	 * scenarios, drawn from a shared pool of candidate positions (e.g. random units out of
+	 * service, or alternative station assignments).
+	 *
+	 * The reach of each distinct position is searched once and cached. The coverage of a
+	 * scenario is then the sum of the cached reaches of its positions, and only the nodes
+	 * and arcs those reaches touch are visited. The per scenario cost therefore does not
+	 * depend on the size of the graph and involves no graph search.
+	 *
+	 * The arcs get the same coverage rule as GraphCH::capacity_coverage. Over all the
+	 * scenarios, each arc gets:
+	 *  - coverage_mean: the mean number of units covering it,
+	 *  - coverage_min: the worst case number of units covering it,
+	 *  - probability_below: the share of the scenarios covering it with fewer than k units.
+	 */
+	class CoverageScenarios {
+	  public:
+
+		// Results per arc, indexed like GraphCH::capacity_coverage_way
+		std::vector<float> coverage_mean;
+		std::vector<unsigned> coverage_min;
+		std::vector<float> probability_below;
+
+		/**
+		 * @param threshold Time in seconds under which a unit covers a node.
+		 * @param thread_count Threads caching the reaches and evaluating the scenarios,
+		 * 0 to use all the available cores.
+		 * @param metric Id of the metric whose travel times are used (see Graph::get_metric_id).
+		 */
+		explicit CoverageScenarios(GraphCH& graph, unsigned threshold = 300, unsigned thread_count = 0, unsigned metric = 0)
+			: graph(graph), travel_time(graph.get_metric_travel_time(metric)), threshold(threshold * 1000), thread_count(thread_count)
+		{
+			if(this->thread_count == 0)
+				this->thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+			// Arcs entering each node, to update the arcs on both sides of a covered node
+			in_first_out.assign(graph.node_count + 1, 0);
+			for(unsigned a = 0; a < graph.arc_count; ++a)
+				++in_first_out[graph.head[a] + 1];
+			for(unsigned x = 0; x < graph.node_count; ++x)
+				in_first_out[x + 1] += in_first_out[x];
+			in_arc.resize(graph.arc_count);
+			std::vector<unsigned> next_in = in_first_out;
+			for(unsigned a = 0; a < graph.arc_count; ++a)
+				in_arc[next_in[graph.head[a]]++] = a;
+		}
+
+		/**
+		 * Search and cache the reach of every distinct node of candidate_positions. Scenarios
+		 * refer to the positions by their index in candidate_positions.
+		 */
+		void set_candidate_positions(const std::vector<unsigned>& candidate_positions) {
+
+			long long start_time = RoutingKit::get_micro_time();
+
+			// A node listed several times is searched once
+			std::vector<unsigned> distinct_nodes = candidate_positions;
+			std::sort(distinct_nodes.begin(), distinct_nodes.end());
+			distinct_nodes.erase(std::unique(distinct_nodes.begin(), distinct_nodes.end()), distinct_nodes.end());
+			for(unsigned node : distinct_nodes){
+				if(node >= graph.node_count)
+					throw std::runtime_error("Invalid candidate position node " + std::to_string(node));
+			}
+
+			std::vector< std::vector<unsigned> > distinct_reach(distinct_nodes.size());
+			std::atomic<unsigned> next_node(0);
+			run_workers(std::min(thread_count, std::max(1u, (unsigned)distinct_nodes.size())), [&](unsigned){
+				IsochroneQuery query(graph.first_out, graph.head, travel_time);
+				for(unsigned i = next_node++; i < distinct_nodes.size(); i = next_node++){
+					query.reset().add_source(distinct_nodes[i]).run(threshold);
+					distinct_reach[i] = query.get_reached_nodes();
+				}
+			});
+
+			// Flatten the reaches, one range per distinct node
+			reach_first.assign(1, 0);
+			reach_node.clear();
+			for(const std::vector<unsigned>& reach : distinct_reach){
+				reach_node.insert(reach_node.end(), reach.begin(), reach.end());
+				reach_first.push_back(reach_node.size());
+			}
+
+			position_reach.resize(candidate_positions.size());
+			for(unsigned p = 0; p < candidate_positions.size(); ++p)
+				position_reach[p] = std::lower_bound(distinct_nodes.begin(), distinct_nodes.end(), candidate_positions[p]) - distinct_nodes.begin();
+
+			cout_message("Reaches of " + std::to_string(distinct_nodes.size()) + " distinct candidate positions (" + std::to_string(reach_node.size()) + " reached nodes) cached in " + microseconds_to_readable_time_cout(RoutingKit::get_micro_time() - start_time));
+		}
+
+		/**
+		 * Evaluate the scenarios and fill coverage_mean, coverage_min and probability_below.
+		 *
+		 * @param scenarios Each scenario lists the indexes in the candidate positions of its
+		 * units, an index listed twice stands for two units at the same position.
+		 * @param k Coverage level of probability_below.
+		 * @prerequisite set_candidate_positions should have been called first.
+		 */
+		void evaluate(const std::vector< std::vector<unsigned> >& scenarios, unsigned k = 1) {
+
+			if(scenarios.empty())
+				throw std::runtime_error("No scenario to evaluate");
+			for(const std::vector<unsigned>& scenario : scenarios){
+				for(unsigned p : scenario){
+					if(p >= position_reach.size())
+						throw std::runtime_error("Invalid candidate position index " + std::to_string(p));
+				}
+			}
+
+			long long start_time = RoutingKit::get_micro_time();
+
+			unsigned worker_count = std::min(thread_count, (unsigned)scenarios.size());
+			std::vector<Accumulator> accumulators(worker_count);
+			std::atomic<unsigned> next_scenario(0);
+
+			run_workers(worker_count, [&](unsigned t){
+				Accumulator& accumulator = accumulators[t];
+				accumulator.init(graph.arc_count);
+				Workspace workspace(graph.node_count, graph.arc_count);
+				for(unsigned s = next_scenario++; s < scenarios.size(); s = next_scenario++)
+					accumulate_scenario(scenarios[s], k, workspace, accumulator);
+			});
+
+			// Merge the per-thread statistics
+			Accumulator& total = accumulators[0];
+			for(unsigned t = 1; t < worker_count; ++t){
+				for(unsigned a = 0; a < graph.arc_count; ++a){
+					total.sum[a] += accumulators[t].sum[a];
+					total.covered_count[a] += accumulators[t].covered_count[a];
+					total.at_least_k_count[a] += accumulators[t].at_least_k_count[a];
+					total.min_covered[a] = std::min(total.min_covered[a], accumulators[t].min_covered[a]);
+				}
+			}
+
+			// An arc left uncovered by some scenario has a null minimum and is counted
+			// below k, unless k is null
+			unsigned scenario_count = scenarios.size();
+			coverage_mean.resize(graph.arc_count);
+			coverage_min.resize(graph.arc_count);
+			probability_below.resize(graph.arc_count);
+			for(unsigned a = 0; a < graph.arc_count; ++a){
+				coverage_mean[a] = (float)((double)total.sum[a] / scenario_count);
+				coverage_min[a] = total.covered_count[a] < scenario_count ? 0 : total.min_covered[a];
+				unsigned at_least_k = (k == 0) ? scenario_count : total.at_least_k_count[a];
+				probability_below[a] = (float)(scenario_count - at_least_k) / scenario_count;
+			}
+
+			long long elapsed_time = RoutingKit::get_micro_time() - start_time;
+			cout_message(std::to_string(scenario_count) + " scenarios evaluated in " + microseconds_to_readable_time_cout(elapsed_time) + " (" + std::to_string((long long)(scenario_count * 60e6 / std::max(1LL, elapsed_time))) + " scenarios per minute)");
+		}
+
+		/**
+		 * Draw scenario_count scenarios where each of the position_count candidate positions
+		 * holds an available unit with probability availability.
+		 */
+		static std::vector< std::vector<unsigned> > draw_availability_scenarios(unsigned position_count, unsigned scenario_count, double availability, unsigned seed = 0) {
+			std::mt19937 generator(seed);
+			std::bernoulli_distribution is_available(availability);
+			std::vector< std::vector<unsigned> > scenarios(scenario_count);
+			for(std::vector<unsigned>& scenario : scenarios){
+				for(unsigned p = 0; p < position_count; ++p){
+					if(is_available(generator))
+						scenario.push_back(p);
+				}
+			}
+			return scenarios;
+		}
+
+	  private:
+		// Scenario statistics of the arcs covered at least once
+		struct Accumulator {
+			std::vector<uint64_t> sum;
+			std::vector<unsigned> covered_count;		// scenarios covering the arc
+			std::vector<unsigned> at_least_k_count;
+			std::vector<unsigned> min_covered;		// minimum over the scenarios covering the arc
+
+			void init(unsigned arc_count) {
+				sum.assign(arc_count, 0);
+				covered_count.assign(arc_count, 0);
+				at_least_k_count.assign(arc_count, 0);
+				min_covered.assign(arc_count, std::numeric_limits<unsigned>::max());
+			}
+		};
+
+		// Node counters of the scenario in progress, cleared after each scenario
+		struct Workspace {
+			std::vector<unsigned> node_coverage;
+			std::vector<unsigned> touched_nodes;
+			std::vector<bool> is_arc_done;
+			std::vector<unsigned> done_arcs;
+
+			Workspace(unsigned node_count, unsigned arc_count) : node_coverage(node_count, 0), is_arc_done(arc_count, false) {}
+		};
+
+		GraphCH& graph;
+		ConstArray<unsigned> travel_time;
+		unsigned threshold;
+		unsigned thread_count;
+
+		std::vector<unsigned> in_first_out;
+		std::vector<unsigned> in_arc;
+
+		// Cached reaches: nodes reached from distinct node i are reach_node[reach_first[i]..reach_first[i+1]]
+		std::vector<uint64_t> reach_first;
+		std::vector<unsigned> reach_node;
+		std::vector<unsigned> position_reach;	// distinct node index of each candidate position
+
+		template<class Work>
+		static void run_workers(unsigned worker_count, const Work& work) {
+			if(worker_count <= 1){
+				work(0);
+				return;
+			}
+			std::vector<std::thread> workers;
+			for(unsigned t = 0; t < worker_count; ++t)
+				workers.emplace_back([&work, t]{ work(t); });
+			for(auto& worker : workers)
+				worker.join();
+		}
+
+		void accumulate_scenario(const std::vector<unsigned>& scenario, unsigned k, Workspace& workspace, Accumulator& accumulator) const {
+			ConstArray<unsigned> first_out = graph.first_out;
+			ConstArray<unsigned> head = graph.head;
+			std::vector<unsigned>& node_coverage = workspace.node_coverage;
+
+			for(unsigned p : scenario){
+				unsigned r = position_reach[p];
+				for(uint64_t i = reach_first[r]; i < reach_first[r+1]; ++i){
+					unsigned x = reach_node[i];
+					if(node_coverage[x]++ == 0)
+						workspace.touched_nodes.push_back(x);
+				}
+			}
+
+			// Only the arcs incident to a covered node can be covered
+			auto accumulate_arc = [&](unsigned a, unsigned tail_coverage, unsigned head_coverage){
+				if(workspace.is_arc_done[a])
+					return;
+				workspace.is_arc_done[a] = true;
+				workspace.done_arcs.push_back(a);
+				unsigned coverage = (tail_coverage + head_coverage) / 2;
+				if(coverage == 0)
+					return;
+				accumulator.sum[a] += coverage;
+				accumulator.covered_count[a]++;
+				accumulator.min_covered[a] = std::min(accumulator.min_covered[a], coverage);
+				if(coverage >= k)
+					accumulator.at_least_k_count[a]++;
+			};
+
+			for(unsigned x : workspace.touched_nodes){
+				for(unsigned a = first_out[x]; a < first_out[x+1]; ++a)
+					accumulate_arc(a, node_coverage[x], node_coverage[head[a]]);
+				for(unsigned i = in_first_out[x]; i < in_first_out[x+1]; ++i){
+					unsigned a = in_arc[i];
+					accumulate_arc(a, node_coverage[graph.tail[a]], node_coverage[x]);
+				}
+			}
+
+			for(unsigned x : workspace.touched_nodes)
+				node_coverage[x] = 0;
+			workspace.touched_nodes.clear();
+			for(unsigned a : workspace.done_arcs)
+				workspace.is_arc_done[a] = false;
+			workspace.done_arcs.clear();
+		}
+	};
+
+}
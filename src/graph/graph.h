@@ -1,3 +1,5 @@
+#pragma once
+
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/serialization/vector.hpp>
@@ -5,23 +7,27 @@
 #include <boost/serialization/unordered_map.hpp>
 #include <boost/serialization/complex.hpp>  
 #include <boost/serialization/bitset.hpp>   
+#include <boost/serialization/version.hpp>
 #include <boost/utility/binary.hpp>
 
 #include <routingkit/geo_position_to_node.h>
 #include <routingkit/osm_profile.h>
 #include <routingkit/contraction_hierarchy.h>
+#include <routingkit/customizable_contraction_hierarchy.h>
+#include <routingkit/nested_dissection.h>
 #include <routingkit/osm_graph_builder.h>
 #include <routingkit/vector_io.h>
 #include <routingkit/timer.h>
 #include <routingkit/tag_map.h>
 #include <routingkit/id_mapper.h>
 #include <routingkit/bit_vector.h>
+#include <routingkit/permutation.h>
 
 #include "../../lib/rapidjson/include/rapidjson/writer.h"
 #include "../../lib/rapidjson/include/rapidjson/stringbuffer.h"
 
 #include <sstream>
-#include <bits/stdc++.h> // std::unordered_multimap
+#include <bits/stdc++.h>
 #include <iostream>
 #include <fstream>
 #include <iterator>
@@ -29,9 +35,24 @@
 #include <vector>
 #include <numeric>      // std::iota
 #include <unordered_map>
+#include <thread>
+#include <memory>
+#include <atomic>
 
 #include "../osmpbfreader/osmpbfreader.h"
 #include "../utils/utils.h"
+#include "../utils/ordered_chunk_writer.h"
+#include "../utils/instrumentation.h"
+#include "../utils/const_array.h"
+#include "../utils/copy_on_write_array.h"
+#include "graph_file.h"
+#include "pbf_ingest.h"
+#include "phast.h"
+#include "coverage_kernels.h"
+#include "isochrone.h"
+#include "nearest_units.h"
+#include "arc_snapper.h"
+#include "node_order.h"
  
 namespace cms {
 
@@ -40,8 +61,8 @@ namespace cms {
         unsigned way_idx;
         unsigned weight = 0; // either :
         unsigned geo_distance = 0;
-        // unsigned response_capacity = 0;  // number of units able to be on under the defined time limit
-        // unsigned immediate_response = 0; // time in seconds for a first unit arrival
+        unsigned response_capacity = 0;  // number of units able to be on under the defined time limit
+        unsigned immediate_response = 0; // time in seconds for a first unit arrival
         std::string geometry;
     };
 
@@ -54,120 +75,113 @@ namespace cms {
 		// Routing graph structure defined by the RoutingKit
 		RoutingKit::OSMRoutingGraph rk_graph;
 		/**
-		 * Set references/alias for RoutingKit::OSMRoutingGraph struct parameters to allow
-		 * calls from a third-party script just with "graph.way" and not "graph.rk_graph.way"
-		 * But in here we will keep rk_graph.way
-		 */
-		std::vector<unsigned>& first_out 				= rk_graph.first_out; 
-		std::vector<unsigned>& head 					= rk_graph.head;
-		std::vector<unsigned>& way 						= rk_graph.way;
-		std::vector<unsigned>& geo_distance 			= rk_graph.geo_distance;
-		std::vector<float>& latitude 					= rk_graph.latitude;
-		std::vector<float>& longitude 					= rk_graph.longitude;
+		 * Read-only node and arc columns, which also allow calls from a third-party script
+		 * just with "graph.way" and not "graph.rk_graph.way". They view the vectors of
+		 * rk_graph and of the graph or, for a graph loaded by load_from_flat_file, the
+		 * sections of the mapped file, those vectors being left empty: the columns are
+		 * always read through these views.
+		 */
+		ConstArray<unsigned> first_out;
+		ConstArray<unsigned> head;
+		ConstArray<unsigned> way;
+		ConstArray<unsigned> geo_distance;
+		ConstArray<float> latitude;
+		ConstArray<float> longitude;
 		std::vector<bool>& is_arc_antiparallel_to_way 	= rk_graph.is_arc_antiparallel_to_way;
 		std::vector<unsigned>& forbidden_turn_from_arc 	= rk_graph.forbidden_turn_from_arc;
 		std::vector<unsigned>& forbidden_turn_to_arc 	= rk_graph.forbidden_turn_to_arc;
-		//std::vector<unsigned>& first_modelling_node 	= rk_graph.first_modelling_node;
-		//std::vector<float>& modelling_node_latitude 	= rk_graph.modelling_node_latitude;
-		//std::vector<float>& modelling_node_longitude 	= rk_graph.modelling_node_longitude;
+		// Geometry of each arc: the points strictly between tail[a] and head[a] are
+		// modelling_node_latitude/longitude[first_modelling_node[a]..first_modelling_node[a+1])
+		ConstArray<unsigned> first_modelling_node;
+		ConstArray<float> modelling_node_latitude;
+		ConstArray<float> modelling_node_longitude;
 		// Other non OSMRoutingGraph parameters retrieve from the RoutingKit 
-		std::vector<uint32_t>travel_time;
+		ConstArray<uint32_t> travel_time;
 		std::vector<uint32_t>way_speed;
 		std::vector<std::string>way_name;
 		std::vector<uint64_t>way_osmid;
 		std::vector<unsigned>node_order;												
-		std::vector<unsigned>tail;	
+		ConstArray<unsigned> tail;
 		unsigned node_count;																										
 		unsigned arc_count;															
 
+		// Node and arc ids of the graph before renumber_nodes, by current id; empty while the
+		// graph keeps its load order. Saved with the graph so that the ids used outside of
+		// it (requests, files) stay valid, see get_node_of_external_id
+		std::vector<unsigned> external_node_id;
+		std::vector<unsigned> external_arc_id;
+
+		// Named metrics sharing the graph topology. Metric 0, "default", is travel_time; the
+		// arc travel times of metric m >= 1 are get_metric_travel_time(m)
+		std::vector<std::string> metric_name;
+
 		// To retrieve OSM parameters not accessible with RoutingKit we pass by another script
 	    osmpbfreader::Routing opr_graph; 										
-	    // OSM node, Node object:<number of units passing by, lat, lon>
-		std::unordered_map<uint64_t, osmpbfreader::Node>& opr_nodes = opr_graph.nodes;
+	    // OSM nodes of the highway ways, sorted by id with fixed-point lat, lon
+		osmpbfreader::NodeStore& opr_nodes = opr_graph.nodes;
 		const std::vector< std::pair<uint64_t, uint64_t> >& opr_edges = opr_graph.edges();	
 	    std::vector< std::vector<uint64_t> >& opr_ways_idx = opr_graph.ways; 				
 	   	std::vector<uint64_t>& ways_osm = opr_graph.ways_osm;
 
-	    std::unordered_map<uint64_t, uint64_t> osmwayid_to_idx;
+	    // OSM way id to its index in ways_osm
+	    osmpbfreader::IdIndex osmwayid_to_idx;
+
+	    // Flattened geometry of the OSM ways: the points of the way of index i (see osmwayid_to_idx)
+	    // are way_point_latitude/way_point_longitude[first_way_point[i]..first_way_point[i+1])
+	    ConstArray<unsigned> first_way_point;
+	    ConstArray<double> way_point_latitude;
+	    ConstArray<double> way_point_longitude;
+
+	    virtual ~Graph() {}
 
 	    /**
 		 * Load a backup file from in a Graph instance the backup previously backup file
 		 *
 		 * @param graph Graph instance in which graph properties will be loaded.
 		 * @param pbf_file .osm.pbf file from where to load graph properties.
+		 * @param thread_count Threads decoding the .osm.pbf blobs, 0 uses every core.
+		 * @param node_memory_budget Bytes of memory for the node coordinates while reading the
+		 * file, the remaining nodes being spilled to node_swap_directory. 0 keeps them in memory.
+		 * @param node_swap_directory Directory of the temporary node files.
 		 */
-		void load_from_pbf(std::string pbf_file)
+		void load_from_pbf(std::string pbf_file, unsigned thread_count = 0, uint64_t node_memory_budget = 0, const std::string& node_swap_directory = "/tmp")
 	    {
 
+			CMS_SCOPED_TIMER("graph.load_from_pbf_microseconds");
 			long long start_time = RoutingKit::get_micro_time();
 
-			auto mapping = RoutingKit::load_osm_id_mapping_from_pbf(
-				pbf_file,
-				nullptr,
-				[&](uint64_t osm_way_id, const RoutingKit::TagMap&tags){
-					return is_osm_way_used_by_cars(osm_way_id, tags, cout_message);
-				},
-				cout_message,
-				false // all_modelling_nodes_are_routing_nodes
-			);
-
-			unsigned routing_way_count = mapping.is_routing_way.population_count();
-			this->way_speed.resize(routing_way_count);
-			this->way_name.resize(routing_way_count);
-			this->way_osmid.resize(routing_way_count);
-
-			this->rk_graph = RoutingKit::load_osm_routing_graph_from_pbf(
-				pbf_file,
-				mapping,
-				[&](uint64_t osm_way_id, unsigned routing_way_id, const RoutingKit::TagMap&way_tags){
-					this->way_speed[routing_way_id] = get_osm_way_speed(osm_way_id, way_tags, cout_message);
-					this->way_name[routing_way_id] = get_osm_way_name(osm_way_id, way_tags, cout_message);
-					this->way_osmid[routing_way_id] = osm_way_id;
-					return get_osm_car_direction_category(osm_way_id, way_tags, cout_message);
-				},
-				nullptr,
-				cout_message, 
-				false, // file_is_ordered_even_though_file_header_says_that_it_is_unordered
-				/****
-				 * OSMRoadGeometry::uncompressed permet de charger les données des paramètres suivants :
-				 *	- first_modelling_node
-				 *  - modelling_node_latitude 
-				 *  - modelling_node_longitude 
-				 *****/
-				RoutingKit::OSMRoadGeometry::none // OSMRoadGeometry geometry_to_be_extracted
-			);
+			// Un seul décodage du fichier PBF alimente à la fois le graphe RoutingKit et opr_graph
+			PBFIngest ingest;
+			if(node_memory_budget > 0)
+				ingest.use_disk_for_nodes(node_swap_directory, node_memory_budget);
+			ingest.run(pbf_file, this->opr_graph, thread_count);
+			this->opr_graph.keep_highway_nodes();
+
+			clear_columns();
+			this->rk_graph = std::move(ingest.graph);
+			this->way_speed = std::move(ingest.way_speed);
+			this->way_name = std::move(ingest.way_name);
+			this->way_osmid = std::move(ingest.way_osmid);
 
 			this->arc_count  = this->rk_graph.arc_count();
-			this->travel_time = this->geo_distance;
-			// Calcul des temps de parcours des ways en secondes à la limite de vitesse
-			for(unsigned a=0; a<this->arc_count; ++a){
-				this->travel_time[a] *= 3600; // 18000;
-				this->travel_time[a] /= this->way_speed[this->way[a]];
-				//travel_time[a] /= 5;
-			}
-			this->tail = RoutingKit::invert_inverse_vector(this->first_out);
+			this->tail_data = RoutingKit::invert_inverse_vector(this->rk_graph.first_out);
+			bind_columns();
+			this->travel_time_data = compute_travel_time(this->way_speed);
+			bind_columns();
 
 			this->node_count = this->rk_graph.node_count();
+			clear_external_ids();
 
-			long long end_time = RoutingKit::get_micro_time();
-
-			cout_message("Graph loading for RoutingKit took " +  microseconds_to_readable_time_cout(end_time - start_time) + " microseconds.");
-
-			start_time = RoutingKit::get_micro_time();
+		    // Index renvoyant l'index d'un way pour son identifiant OSM
+		    // osmwayid_to_idx[ways_osm[99]] = 99;
+		    this->osmwayid_to_idx.build(this->opr_graph.ways_osm);
 
-			osmpbfreader::read_osm_pbf(pbf_file, this->opr_graph);
-		   
-		    // Création d'un vecteur renvoyant le way pour un index donné
-		    // map_osmid_to_idx[ways_osm[99]] = 99;
-		    for (uint64_t i = 0; i < this->opr_graph.ways_osm.size(); i++){
-		        this->osmwayid_to_idx[this->opr_graph.ways_osm[i]] = i;
-		    }
+		    build_way_geometry();
+		    arc_snapper.clear();
 
-			// PBFreader();		
+			long long end_time = RoutingKit::get_micro_time();
 
-			end_time = RoutingKit::get_micro_time();
-			
-			cout_message("Graph loading for osmpbfreader took " +  microseconds_to_readable_time_cout(end_time - start_time) + " microseconds.");
+			cout_message("Graph loading took " +  microseconds_to_readable_time_cout(end_time - start_time) + " microseconds.");
 
 	    	cout_message("Graph full properties loaded!");
 
@@ -181,20 +195,88 @@ namespace cms {
 		 */
 	    void load_from_binary(std::string filename)
 	    {
+	        CMS_SCOPED_TIMER("graph.load_from_binary_microseconds");
+	        clear_columns();
 	        // create and open an archive for input
 	        std::ifstream ifs(filename, std::ios::binary);
 	        boost::archive::text_iarchive ia(ifs);
 	        // read class state from archive
 	        ia >> *this;
 	        // archive and stream closed when destructors are called
+
+	        build_way_geometry();
+	        arc_snapper.clear();
 	    }	
 
+	    /**
+		 * Flatten the OSM ways polylines of opr_graph in first_way_point, way_point_latitude
+		 * and way_point_longitude. The nodes missing from the extract, referenced by the ways
+		 * crossing its border, are left out of the polylines.
+		 */
+	    void build_way_geometry()
+	    {
+	    	first_way_point_data.assign(1, 0);
+	    	way_point_latitude_data.clear();
+	    	way_point_longitude_data.clear();
+	    	for (const std::vector<uint64_t>& refs : opr_graph.ways){
+	    		for (uint64_t ref : refs){
+	    			uint64_t node = opr_graph.nodes.find(ref);
+	    			if (node == osmpbfreader::invalid_index)
+	    				continue;
+	    			way_point_latitude_data.push_back(opr_graph.nodes.latitude(node));
+	    			way_point_longitude_data.push_back(opr_graph.nodes.longitude(node));
+	    		}
+	    		first_way_point_data.push_back(way_point_latitude_data.size());
+	    	}
+	    	bind_columns();
+	    }
+
+	    /**
+		 * Write the graph in the flat graph file format (see graph_file.h), which is loaded
+		 * by load_from_flat_file without any parsing.
+		 */
+	    void save_graph_to_a_flat_file(std::string filename, const std::string& destination_folder)
+	    {
+	    	GraphFileWriter writer;
+	    	write_flat_file_sections(writer);
+	    	writer.write(destination_folder + '/' + filename);
+
+	    	cout_message("Graph saved at: " + destination_folder + '/' + filename);
+	    }
+
+	    /**
+		 * Load a graph saved by save_graph_to_a_flat_file. The file stays mapped as long as
+		 * the graph uses it: the node and arc columns, the geometry and the metrics are views
+		 * into the mapping, only the per way and per turn data is copied. The OSM level nodes
+		 * and ways of opr_graph are not part of the format, their geometry being available
+		 * through the flattened way geometry. The customizable contraction hierarchy is only
+		 * built from its stored order when first needed.
+		 */
+	    void load_from_flat_file(std::string filename)
+	    {
+	    	CMS_SCOPED_TIMER("graph.load_from_flat_file_microseconds");
+	    	long long start_time = RoutingKit::get_micro_time();
+
+	    	std::unique_ptr<GraphFileView> file(new GraphFileView(filename));
+	    	try{
+	    		read_flat_file_sections(*file);
+	    	}catch(...){
+	    		// The columns may view the file, which is released
+	    		clear_columns();
+	    		throw;
+	    	}
+	    	graph_file = std::move(file);
+
+	    	cout_message("Graph loaded from " + filename + " in " + microseconds_to_readable_time_cout(RoutingKit::get_micro_time() - start_time));
+	    }
+
 	    /**
 		 * Export in a file the given simple property of the Graph
 		 */
-		template<class T>
-		void export_routing_graph_element(std::string file, std::vector<T>& graph_property)
+		template<class Column>
+		void export_routing_graph_element(std::string file, const Column& graph_property)
 		{
+			typedef typename Column::value_type T;
 		    std::ofstream output_file(file);
 		    std::ostream_iterator<T> output_iterator(output_file, "\n");
 		    std::copy(graph_property.begin(), graph_property.end(), output_iterator);	
@@ -207,18 +289,18 @@ namespace cms {
 	    {
 
 			/*** Properties from RoutingKit ***/
-			export_routing_graph_element(destination_folder + "first_out.csv", rk_graph.first_out);
-			export_routing_graph_element(destination_folder + "head.csv", rk_graph.head);
-			export_routing_graph_element(destination_folder + "way.csv", rk_graph.way);
-			export_routing_graph_element(destination_folder + "geo_distance.csv", rk_graph.geo_distance);
-			export_routing_graph_element(destination_folder + "latitude.csv", rk_graph.latitude);
-			export_routing_graph_element(destination_folder + "longitude.csv", rk_graph.longitude);
+			export_routing_graph_element(destination_folder + "first_out.csv", first_out);
+			export_routing_graph_element(destination_folder + "head.csv", head);
+			export_routing_graph_element(destination_folder + "way.csv", way);
+			export_routing_graph_element(destination_folder + "geo_distance.csv", geo_distance);
+			export_routing_graph_element(destination_folder + "latitude.csv", latitude);
+			export_routing_graph_element(destination_folder + "longitude.csv", longitude);
 			export_routing_graph_element(destination_folder + "is_arc_antiparallel_to_way.csv", rk_graph.is_arc_antiparallel_to_way);
 			export_routing_graph_element(destination_folder + "forbidden_turn_from_arc.csv", rk_graph.forbidden_turn_from_arc);
 			export_routing_graph_element(destination_folder + "forbidden_turn_to_arc.csv", rk_graph.forbidden_turn_to_arc);
-			//export_routing_graph_element(destination_folder + "first_modelling_node.csv", rk_graph.first_modelling_node);
-			//export_routing_graph_element(destination_folder + "modelling_node_latitude.csv", rk_graph.modelling_node_latitude);
-			//export_routing_graph_element(destination_folder + "modelling_node_longitude.csv", rk_graph.modelling_node_longitude);
+			export_routing_graph_element(destination_folder + "first_modelling_node.csv", first_modelling_node);
+			export_routing_graph_element(destination_folder + "modelling_node_latitude.csv", modelling_node_latitude);
+			export_routing_graph_element(destination_folder + "modelling_node_longitude.csv", modelling_node_longitude);
 			export_routing_graph_element(destination_folder + "travel_time.csv", travel_time);
 			export_routing_graph_element(destination_folder + "way_speed.csv", way_speed);
 			export_routing_graph_element(destination_folder + "way_name.csv", way_name);
@@ -253,20 +335,66 @@ namespace cms {
 			ar & rk_graph.is_arc_antiparallel_to_way;
 			ar & rk_graph.forbidden_turn_from_arc;
 			ar & rk_graph.forbidden_turn_to_arc;
-			//ar & rk_graph.first_modelling_node;
-			//ar & rk_graph.modelling_node_latitude;
-			//ar & rk_graph.modelling_node_longitude;
-			ar & travel_time;
+			ar & travel_time_data;
 			ar & way_speed;
 			ar & way_name;
 			ar & way_osmid;
 			ar & node_count;										
 			ar & arc_count;
-			ar & tail;			
-	      	ar & opr_graph.nodes; 
-	      	ar & opr_graph.ways;   
-	      	ar & opr_graph.ways_osm;
-	      	ar & osmwayid_to_idx;
+			ar & tail_data;
+	      	if(version >= 2){
+	      		// Compact node store, osmwayid_to_idx is rebuilt from ways_osm
+	      		ar & opr_graph.nodes;
+	      		ar & opr_graph.ways;
+	      		ar & opr_graph.ways_osm;
+	      	}else{
+	      		// Hash maps of the archives older than version 2
+	      		std::unordered_map<uint64_t, osmpbfreader::Node> legacy_nodes;
+	      		std::unordered_map<uint64_t, uint64_t> legacy_osmwayid_to_idx;
+	      		ar & legacy_nodes;
+	      		ar & opr_graph.ways;
+	      		ar & opr_graph.ways_osm;
+	      		ar & legacy_osmwayid_to_idx;
+	      		opr_graph.nodes.clear();
+	      		for (const auto& node : legacy_nodes)
+	      			opr_graph.nodes.add(node.first, node.second.lon_m, node.second.lat_m);
+	      		opr_graph.keep_highway_nodes();
+	      	}
+	      	if(Archive::is_loading::value)
+	      		osmwayid_to_idx.build(opr_graph.ways_osm);
+	      	// Arc geometry, appended in version 1 of the archive
+	      	if(version >= 1){
+				ar & rk_graph.first_modelling_node;
+				ar & rk_graph.modelling_node_latitude;
+				ar & rk_graph.modelling_node_longitude;
+	      	}
+	      	// Named metrics, appended in version 3
+	      	if(version >= 3){
+	      		ar & metric_name;
+	      		ar & metric_travel_time;
+	      	}else if(Archive::is_loading::value){
+	      		metric_name.clear();
+	      		metric_travel_time.clear();
+	      	}
+	      	// Ids before renumbering, appended in version 4
+	      	if(version >= 4){
+	      		ar & external_node_id;
+	      		ar & external_arc_id;
+	      	}else if(Archive::is_loading::value){
+	      		external_node_id.clear();
+	      		external_arc_id.clear();
+	      	}
+	      	if(Archive::is_loading::value)
+	      		build_external_id_index();
+	    }
+
+	    /**
+		 * Whether the per-arc geometry (first_modelling_node...) has been loaded, graphs
+		 * saved before it was extracted only have the whole OSM way geometry.
+		 */
+	    bool has_arc_geometry() const
+	    {
+	    	return first_modelling_node.size() == arc_count + 1;
 	    }
 
 	    /**
@@ -274,6 +402,8 @@ namespace cms {
 		 */
 	    void save_graph_to_a_binary_file(std::string filename, const std::string& destination_folder)
 	    {
+	    	// The archive is written from the vectors of the graph
+	    	copy_mapped_columns();
 
 	    	// Create an output archive
 	      	std::ofstream ofs(destination_folder +'/'+filename, std::ios::binary);
@@ -296,14 +426,14 @@ namespace cms {
 		{
 
 	        std::string nodes_json_string = "[";
-	        for(size_t i = 0; i < opr_graph.ways[way_idx].size(); i++){
+	        for(unsigned i = first_way_point[way_idx]; i < first_way_point[way_idx+1]; i++){
 
 	            nodes_json_string += "[";
-	            nodes_json_string += std::to_string(opr_graph.nodes[opr_graph.ways[way_idx][i]].lat_m);
+	            nodes_json_string += std::to_string(way_point_latitude[i]);
 	            nodes_json_string += ",";
-	            nodes_json_string += std::to_string(opr_graph.nodes[opr_graph.ways[way_idx][i]].lon_m);
+	            nodes_json_string += std::to_string(way_point_longitude[i]);
 	            nodes_json_string += "]";
-	            if(i < opr_graph.ways[way_idx].size() - 1)
+	            if(i < first_way_point[way_idx+1] - 1)
 	                nodes_json_string += ",";
 	        }
 	        nodes_json_string += "]";
@@ -330,6 +460,514 @@ namespace cms {
 
 		}
 
+	    /**
+		 * Travel time in milliseconds of every arc at the given speed of its way, in km/h.
+		 */
+		std::vector<unsigned> compute_travel_time(const std::vector<uint32_t>& speed_of_way) const
+		{
+			if(speed_of_way.size() != this->way_speed.size())
+				throw std::runtime_error("A speed is needed for each of the " + std::to_string(this->way_speed.size()) + " ways");
+			std::vector<unsigned> arc_travel_time = this->geo_distance.to_vector();
+			// Calcul des temps de parcours des ways en secondes à la limite de vitesse
+			for(unsigned a=0; a<this->arc_count; ++a){
+				arc_travel_time[a] *= 3600;
+				arc_travel_time[a] /= std::max(1u, speed_of_way[this->way[a]]);
+			}
+			return arc_travel_time;
+		}
+
+	    /**
+		 * Add a named metric, or replace the weights of another one, e.g. the travel
+		 * times of a rush hour, night or emergency vehicle speed profile. A metric only adds
+		 * its arc weight column to the graph.
+		 *
+		 * @param arc_travel_time Travel time in milliseconds of each arc.
+		 * @return Id of the metric, to pick it at query time.
+		 */
+		virtual unsigned set_metric(const std::string& name, std::vector<unsigned> arc_travel_time)
+		{
+			if(arc_travel_time.size() != this->arc_count)
+				throw std::runtime_error("Metric " + name + " has " + std::to_string(arc_travel_time.size()) + " arc weights instead of " + std::to_string(this->arc_count));
+			if(name == "default")
+				throw std::runtime_error("The default metric is travel_time and can not be replaced");
+			auto it = std::find(metric_name.begin(), metric_name.end(), name);
+			if(it != metric_name.end()){
+				unsigned m = it - metric_name.begin();
+				metric_travel_time[m] = std::move(arc_travel_time);
+				metric_weight[m] = metric_travel_time[m];
+				return m + 1;
+			}
+			metric_name.push_back(name);
+			metric_travel_time.push_back(std::move(arc_travel_time));
+			metric_weight.push_back(metric_travel_time.back());
+			return metric_name.size();
+		}
+
+		unsigned get_metric_count() const
+		{
+			return metric_name.size() + 1;
+		}
+
+	    /**
+		 * Id of the metric called name, an exception is thrown for an unknown name.
+		 */
+		unsigned get_metric_id(const std::string& name) const
+		{
+			if(name == "default")
+				return 0;
+			auto it = std::find(metric_name.begin(), metric_name.end(), name);
+			if(it == metric_name.end())
+				throw std::runtime_error("Unknown metric " + name);
+			return it - metric_name.begin() + 1;
+		}
+
+		std::string get_metric_name(unsigned metric) const
+		{
+			return metric == 0 ? "default" : metric_name.at(metric - 1);
+		}
+
+	    /**
+		 * Arc travel times in milliseconds of a metric.
+		 */
+		ConstArray<unsigned> get_metric_travel_time(unsigned metric) const
+		{
+			if(metric >= get_metric_count())
+				throw std::runtime_error("Unknown metric " + std::to_string(metric));
+			return metric == 0 ? this->travel_time : metric_weight[metric - 1];
+		}
+
+	    /**
+		 * Map GPS fixes to their nearest arc and offset along it, positions[i] being the
+		 * position of latitude[i], longitude[i]. A fix farther than max_distance meters from
+		 * every arc gets an invalid position.
+		 *
+		 * @param thread_count Threads sharing the fixes, 0 to use all the available cores.
+		 */
+		void snap_positions(const std::vector<float>& latitude, const std::vector<float>& longitude, std::vector<SnappedPosition>& positions, float max_distance = 100, unsigned thread_count = 0)
+		{
+			build_arc_snapper();
+			arc_snapper.snap(latitude, longitude, positions, max_distance, thread_count);
+		}
+
+	    /**
+		 * Build the index of snap_positions and snap_position, unless it is already built.
+		 */
+		void build_arc_snapper()
+		{
+			if(arc_snapper.is_built())
+				return;
+			long long start_time = RoutingKit::get_micro_time();
+			arc_snapper.build(*this, this->tail);
+			cout_message("Arc snapping index built in " + microseconds_to_readable_time_cout(RoutingKit::get_micro_time() - start_time));
+		}
+
+	    /**
+		 * Same as snap_positions for a single fix, safe to call from several threads.
+		 *
+		 * @prerequisite build_arc_snapper or snap_positions should have been executed first.
+		 */
+		SnappedPosition snap_position(float latitude, float longitude, float max_distance = 100) const
+		{
+			if(!arc_snapper.is_built())
+				throw std::runtime_error("The arc snapping index has not been built");
+			return arc_snapper.snap(latitude, longitude, max_distance);
+		}
+
+	    /**
+		 * Seed query with a unit standing at position: the head of the arc is reached after
+		 * the remaining travel time along the arc and, on a two-way road, the tail after the
+		 * travel time back to it.
+		 *
+		 * @param metric Metric the query is bound to.
+		 * @prerequisite position should come from snap_positions on this graph.
+		 */
+		void add_snapped_source(IsochroneQuery& query, const SnappedPosition& position, unsigned metric = 0) const
+		{
+			add_snapped_source(query, position, get_metric_travel_time(metric));
+		}
+
+	    /**
+		 * Same as add_snapped_source for a query bound to arc_travel_time, e.g. the weights of
+		 * a LiveMetric snapshot.
+		 */
+		void add_snapped_source(IsochroneQuery& query, const SnappedPosition& position, ConstArray<unsigned> arc_travel_time) const
+		{
+			add_snapped_source_weighted(query, position, arc_travel_time);
+		}
+
+		void add_snapped_source(IsochroneQuery& query, const SnappedPosition& position, const CopyOnWriteArray<unsigned>& arc_travel_time) const
+		{
+			add_snapped_source_weighted(query, position, arc_travel_time);
+		}
+
+	    /**
+		 * Same as add_snapped_source for a NearestUnitsQuery, the sources being those of unit.
+		 */
+		void add_snapped_source(NearestUnitsQuery& query, unsigned unit, const SnappedPosition& position, unsigned metric = 0) const
+		{
+			if(!position.is_valid())
+				return;
+			ConstArray<unsigned> arc_travel_time = get_metric_travel_time(metric);
+			unsigned a = position.arc;
+			query.add_source(this->head[a], unit, (unsigned)std::lround(arc_travel_time[a] * (1 - position.offset)));
+			unsigned twin = arc_snapper.get_twin_arc(a);
+			if(twin != RoutingKit::invalid_id)
+				query.add_source(this->tail[a], unit, (unsigned)std::lround(arc_travel_time[twin] * position.offset));
+		}
+
+	    /**
+		 * Renumber the nodes so that order[i] becomes node i, and the arcs so that they stay
+		 * grouped by tail, sorted by head within a tail. Every node and arc column (coordinates,
+		 * forward star, travel times, metrics, ways, geometry, forbidden turns) is permuted
+		 * accordingly, and the ids before renumbering are kept in external_node_id and
+		 * external_arc_id.
+		 *
+		 * Numbering neighbour nodes close to each other (see renumber_nodes_along_hilbert_curve)
+		 * keeps the columns read by a search in a few cache lines.
+		 */
+		virtual void renumber_nodes(const std::vector<unsigned>& order)
+		{
+			if(order.size() != this->node_count)
+				throw std::runtime_error("The node order has " + std::to_string(order.size()) + " nodes instead of " + std::to_string(this->node_count));
+
+			long long start_time = RoutingKit::get_micro_time();
+
+			// The columns are permuted in the vectors of the graph, the views bound again at the end
+			copy_mapped_columns();
+			bool has_geometry = has_arc_geometry();
+
+			std::vector<unsigned> new_node_id = RoutingKit::invert_permutation(order);
+
+			// Arcs grouped by new tail, then by new head
+			std::vector<unsigned> arc_order(this->arc_count);
+			for(unsigned a = 0; a < this->arc_count; ++a)
+				arc_order[a] = a;
+			std::sort(arc_order.begin(), arc_order.end(), [&](unsigned a, unsigned b){
+				unsigned tail_a = new_node_id[this->tail_data[a]], tail_b = new_node_id[this->tail_data[b]];
+				if(tail_a != tail_b)
+					return tail_a < tail_b;
+				unsigned head_a = new_node_id[this->rk_graph.head[a]], head_b = new_node_id[this->rk_graph.head[b]];
+				return head_a != head_b ? head_a < head_b : a < b;
+			});
+			std::vector<unsigned> new_arc_id = RoutingKit::invert_permutation(arc_order);
+
+			// Node columns
+			this->rk_graph.latitude = RoutingKit::apply_permutation(order, this->rk_graph.latitude);
+			this->rk_graph.longitude = RoutingKit::apply_permutation(order, this->rk_graph.longitude);
+
+			// Forward star
+			std::vector<unsigned> new_tail(this->arc_count), new_head(this->arc_count);
+			for(unsigned a = 0; a < this->arc_count; ++a){
+				new_tail[a] = new_node_id[this->tail_data[arc_order[a]]];
+				new_head[a] = new_node_id[this->rk_graph.head[arc_order[a]]];
+			}
+			this->tail_data.swap(new_tail);
+			this->rk_graph.head.swap(new_head);
+			this->rk_graph.first_out = RoutingKit::invert_vector(this->tail_data, this->node_count);
+
+			// Arc columns
+			this->rk_graph.way = RoutingKit::apply_permutation(arc_order, this->rk_graph.way);
+			this->rk_graph.geo_distance = RoutingKit::apply_permutation(arc_order, this->rk_graph.geo_distance);
+			this->travel_time_data = RoutingKit::apply_permutation(arc_order, this->travel_time_data);
+			for(std::vector<unsigned>& metric : metric_travel_time)
+				metric = RoutingKit::apply_permutation(arc_order, metric);
+			std::vector<bool> is_antiparallel(this->arc_count);
+			for(unsigned a = 0; a < this->arc_count; ++a)
+				is_antiparallel[a] = this->rk_graph.is_arc_antiparallel_to_way[arc_order[a]];
+			this->rk_graph.is_arc_antiparallel_to_way.swap(is_antiparallel);
+
+			// Arc geometry
+			if(has_geometry){
+				std::vector<unsigned> first_modelling_node(this->arc_count + 1, 0);
+				std::vector<float> modelling_node_latitude, modelling_node_longitude;
+				modelling_node_latitude.reserve(this->rk_graph.modelling_node_latitude.size());
+				modelling_node_longitude.reserve(this->rk_graph.modelling_node_longitude.size());
+				for(unsigned a = 0; a < this->arc_count; ++a){
+					unsigned old_arc = arc_order[a];
+					for(unsigned i = this->rk_graph.first_modelling_node[old_arc]; i < this->rk_graph.first_modelling_node[old_arc + 1]; ++i){
+						modelling_node_latitude.push_back(this->rk_graph.modelling_node_latitude[i]);
+						modelling_node_longitude.push_back(this->rk_graph.modelling_node_longitude[i]);
+					}
+					first_modelling_node[a + 1] = modelling_node_latitude.size();
+				}
+				this->rk_graph.first_modelling_node.swap(first_modelling_node);
+				this->rk_graph.modelling_node_latitude.swap(modelling_node_latitude);
+				this->rk_graph.modelling_node_longitude.swap(modelling_node_longitude);
+			}
+
+			// Forbidden turns, sorted by from arc as RoutingKit expects
+			std::vector< std::pair<unsigned, unsigned> > turns(this->rk_graph.forbidden_turn_from_arc.size());
+			for(unsigned t = 0; t < turns.size(); ++t)
+				turns[t] = std::make_pair(new_arc_id[this->rk_graph.forbidden_turn_from_arc[t]], new_arc_id[this->rk_graph.forbidden_turn_to_arc[t]]);
+			std::sort(turns.begin(), turns.end());
+			for(unsigned t = 0; t < turns.size(); ++t){
+				this->rk_graph.forbidden_turn_from_arc[t] = turns[t].first;
+				this->rk_graph.forbidden_turn_to_arc[t] = turns[t].second;
+			}
+
+			// Ids before this renumbering, and before the previous ones
+			if(external_node_id.empty()){
+				external_node_id = order;
+				external_arc_id = arc_order;
+			}else{
+				external_node_id = RoutingKit::apply_permutation(order, external_node_id);
+				external_arc_id = RoutingKit::apply_permutation(arc_order, external_arc_id);
+			}
+			build_external_id_index();
+
+			bind_columns();
+			arc_snapper.clear();
+			node_order.clear();
+
+			cout_message("Nodes and arcs renumbered in " + microseconds_to_readable_time_cout(RoutingKit::get_micro_time() - start_time));
+		}
+
+	    /**
+		 * Renumber the nodes along a Hilbert curve over their coordinates, so that nodes close
+		 * on the map get close ids.
+		 */
+		void renumber_nodes_along_hilbert_curve()
+		{
+			renumber_nodes(compute_hilbert_curve_node_order(this->latitude, this->longitude));
+		}
+
+	    /**
+		 * Current id of the node of id external_id before renumbering (or of the same id for a
+		 * graph never renumbered), RoutingKit::invalid_id if there is none.
+		 */
+		unsigned get_node_of_external_id(unsigned external_id) const
+		{
+			if(node_of_external_id.empty())
+				return external_id < this->node_count ? external_id : RoutingKit::invalid_id;
+			return external_id < node_of_external_id.size() ? node_of_external_id[external_id] : RoutingKit::invalid_id;
+		}
+
+		unsigned get_arc_of_external_id(unsigned external_id) const
+		{
+			if(arc_of_external_id.empty())
+				return external_id < this->arc_count ? external_id : RoutingKit::invalid_id;
+			return external_id < arc_of_external_id.size() ? arc_of_external_id[external_id] : RoutingKit::invalid_id;
+		}
+
+		unsigned get_external_node_id(unsigned node) const
+		{
+			return external_node_id.empty() ? node : external_node_id[node];
+		}
+
+		unsigned get_external_arc_id(unsigned arc) const
+		{
+			return external_arc_id.empty() ? arc : external_arc_id[arc];
+		}
+
+	  protected:
+
+		// add_snapped_source on the weights of a ConstArray or a CopyOnWriteArray
+		template<class Column>
+		void add_snapped_source_weighted(IsochroneQuery& query, const SnappedPosition& position, const Column& arc_travel_time) const
+		{
+			if(!position.is_valid())
+				return;
+			unsigned a = position.arc;
+			query.add_source(this->head[a], (unsigned)std::lround(arc_travel_time[a] * (1 - position.offset)));
+			unsigned twin = arc_snapper.get_twin_arc(a);
+			if(twin != RoutingKit::invalid_id)
+				query.add_source(this->tail[a], (unsigned)std::lround(arc_travel_time[twin] * position.offset));
+		}
+
+		// Inverses of external_node_id and external_arc_id
+		std::vector<unsigned> node_of_external_id;
+		std::vector<unsigned> arc_of_external_id;
+
+		void clear_external_ids()
+		{
+			external_node_id.clear();
+			external_arc_id.clear();
+			node_of_external_id.clear();
+			arc_of_external_id.clear();
+		}
+
+		void build_external_id_index()
+		{
+			node_of_external_id = external_node_id.empty() ? std::vector<unsigned>() : RoutingKit::invert_permutation(external_node_id);
+			arc_of_external_id = external_arc_id.empty() ? std::vector<unsigned>() : RoutingKit::invert_permutation(external_arc_id);
+		}
+
+	    /**
+		 * Sections of the flat graph file, extended by derived classes.
+		 */
+	    virtual void write_flat_file_sections(GraphFileWriter& writer)
+	    {
+	    	writer.add_scalar("node_count", node_count);
+	    	writer.add_scalar("arc_count", arc_count);
+	    	writer.add("first_out", first_out);
+	    	writer.add("head", head);
+	    	writer.add("tail", tail);
+	    	writer.add("way", way);
+	    	writer.add("geo_distance", geo_distance);
+	    	writer.add("travel_time", travel_time);
+	    	writer.add("latitude", latitude);
+	    	writer.add("longitude", longitude);
+	    	writer.add("is_arc_antiparallel_to_way", rk_graph.is_arc_antiparallel_to_way);
+	    	writer.add("forbidden_turn_from_arc", rk_graph.forbidden_turn_from_arc);
+	    	writer.add("forbidden_turn_to_arc", rk_graph.forbidden_turn_to_arc);
+	    	writer.add("way_speed", way_speed);
+	    	writer.add("way_name", way_name);
+	    	writer.add("way_osmid", way_osmid);
+	    	writer.add("ways_osm", opr_graph.ways_osm);
+	    	writer.add("first_way_point", first_way_point);
+	    	writer.add("way_point_latitude", way_point_latitude);
+	    	writer.add("way_point_longitude", way_point_longitude);
+	    	writer.add("first_modelling_node", first_modelling_node);
+	    	writer.add("modelling_node_latitude", modelling_node_latitude);
+	    	writer.add("modelling_node_longitude", modelling_node_longitude);
+	    	// Named metrics, a weight column each
+	    	writer.add_scalar("metric_count", metric_name.size());
+	    	writer.add("metric_name", metric_name);
+	    	for(unsigned m = 0; m < metric_name.size(); ++m)
+	    		writer.add("metric_travel_time." + std::to_string(m), metric_weight[m]);
+	    	if(!external_node_id.empty()){
+	    		writer.add("external_node_id", external_node_id);
+	    		writer.add("external_arc_id", external_arc_id);
+	    	}
+	    }
+
+	    /**
+		 * Point the columns at the sections of view, which must stay mapped as long as the
+		 * graph uses them; the per way and per turn data is copied.
+		 */
+	    virtual void read_flat_file_sections(const GraphFileView& view)
+	    {
+	    	clear_columns();
+	    	node_count = view.get_scalar("node_count");
+	    	arc_count = view.get_scalar("arc_count");
+	    	first_out = view.get<unsigned>("first_out");
+	    	head = view.get<unsigned>("head");
+	    	tail = view.get<unsigned>("tail");
+	    	way = view.get<unsigned>("way");
+	    	geo_distance = view.get<unsigned>("geo_distance");
+	    	travel_time = view.get<uint32_t>("travel_time");
+	    	latitude = view.get<float>("latitude");
+	    	longitude = view.get<float>("longitude");
+	    	view.copy("is_arc_antiparallel_to_way", rk_graph.is_arc_antiparallel_to_way);
+	    	view.copy("forbidden_turn_from_arc", rk_graph.forbidden_turn_from_arc);
+	    	view.copy("forbidden_turn_to_arc", rk_graph.forbidden_turn_to_arc);
+	    	view.copy("way_speed", way_speed);
+	    	view.copy("way_name", way_name);
+	    	view.copy("way_osmid", way_osmid);
+	    	view.copy("ways_osm", opr_graph.ways_osm);
+	    	first_way_point = view.get<unsigned>("first_way_point");
+	    	way_point_latitude = view.get<double>("way_point_latitude");
+	    	way_point_longitude = view.get<double>("way_point_longitude");
+	    	if(view.has("first_modelling_node")){
+	    		first_modelling_node = view.get<unsigned>("first_modelling_node");
+	    		modelling_node_latitude = view.get<float>("modelling_node_latitude");
+	    		modelling_node_longitude = view.get<float>("modelling_node_longitude");
+	    	}
+
+	    	if(view.has("metric_count")){
+	    		view.copy("metric_name", metric_name);
+	    		metric_travel_time.resize(metric_name.size());
+	    		for(unsigned m = 0; m < metric_name.size(); ++m)
+	    			metric_weight.push_back(view.get<unsigned>("metric_travel_time." + std::to_string(m)));
+	    	}
+	    	clear_external_ids();
+	    	if(view.has("external_node_id")){
+	    		view.copy("external_node_id", external_node_id);
+	    		view.copy("external_arc_id", external_arc_id);
+	    		build_external_id_index();
+	    	}
+
+	    	opr_graph.nodes.clear();
+	    	opr_graph.ways.clear();
+	    	osmwayid_to_idx.build(opr_graph.ways_osm);
+	    }
+
+	    // Storage of the columns viewed by travel_time, tail and the way geometry, and of the
+	    // metrics viewed by metric_weight; empty for the columns mapped from a flat file
+	    std::vector<uint32_t> travel_time_data;
+	    std::vector<unsigned> tail_data;
+	    std::vector<unsigned> first_way_point_data;
+	    std::vector<double> way_point_latitude_data;
+	    std::vector<double> way_point_longitude_data;
+	    std::vector< std::vector<unsigned> > metric_travel_time;
+	    // Arc travel times of metric m >= 1 at [m-1]
+	    std::vector< ConstArray<unsigned> > metric_weight;
+
+	    // Flat graph file the columns are mapped from, see load_from_flat_file
+	    std::unique_ptr<GraphFileView> graph_file;
+
+	    /**
+		 * Point the columns at the vectors of the graph, after they have been changed.
+		 */
+	    virtual void bind_columns()
+	    {
+	    	first_out = rk_graph.first_out;
+	    	head = rk_graph.head;
+	    	way = rk_graph.way;
+	    	geo_distance = rk_graph.geo_distance;
+	    	latitude = rk_graph.latitude;
+	    	longitude = rk_graph.longitude;
+	    	first_modelling_node = rk_graph.first_modelling_node;
+	    	modelling_node_latitude = rk_graph.modelling_node_latitude;
+	    	modelling_node_longitude = rk_graph.modelling_node_longitude;
+	    	travel_time = travel_time_data;
+	    	tail = tail_data;
+	    	first_way_point = first_way_point_data;
+	    	way_point_latitude = way_point_latitude_data;
+	    	way_point_longitude = way_point_longitude_data;
+	    	metric_weight.assign(metric_travel_time.begin(), metric_travel_time.end());
+	    }
+
+	    /**
+		 * Drop the columns and the metrics, and release the flat file they may be mapped from.
+		 */
+	    virtual void clear_columns()
+	    {
+	    	rk_graph = RoutingKit::OSMRoutingGraph();
+	    	travel_time_data.clear();
+	    	tail_data.clear();
+	    	first_way_point_data.clear();
+	    	way_point_latitude_data.clear();
+	    	way_point_longitude_data.clear();
+	    	metric_name.clear();
+	    	metric_travel_time.clear();
+	    	bind_columns();
+	    	graph_file.reset();
+	    	arc_snapper.clear();
+	    }
+
+	    /**
+		 * Copy the columns mapped from a flat file into the vectors of the graph and release
+		 * the file, before they are changed or archived. Nothing to do for a graph in memory.
+		 */
+	    virtual void copy_mapped_columns()
+	    {
+	    	if(!graph_file)
+	    		return;
+	    	rk_graph.first_out = first_out.to_vector();
+	    	rk_graph.head = head.to_vector();
+	    	rk_graph.way = way.to_vector();
+	    	rk_graph.geo_distance = geo_distance.to_vector();
+	    	rk_graph.latitude = latitude.to_vector();
+	    	rk_graph.longitude = longitude.to_vector();
+	    	rk_graph.first_modelling_node = first_modelling_node.to_vector();
+	    	rk_graph.modelling_node_latitude = modelling_node_latitude.to_vector();
+	    	rk_graph.modelling_node_longitude = modelling_node_longitude.to_vector();
+	    	travel_time_data = travel_time.to_vector();
+	    	tail_data = tail.to_vector();
+	    	first_way_point_data = first_way_point.to_vector();
+	    	way_point_latitude_data = way_point_latitude.to_vector();
+	    	way_point_longitude_data = way_point_longitude.to_vector();
+	    	for(unsigned m = 0; m < metric_travel_time.size(); ++m)
+	    		if(metric_weight[m].data() != metric_travel_time[m].data())
+	    			metric_travel_time[m] = metric_weight[m].to_vector();
+	    	bind_columns();
+	    	graph_file.reset();
+	    }
+
+	    // Arc index of snap_positions, built on first use
+	    ArcSnapper arc_snapper;
+
 	};
 
 	/**
@@ -339,12 +977,33 @@ namespace cms {
 	class GraphCH : public Graph 
 	{ 
 	  public:
+		// Contraction hierarchy of the default metric, read through get_contraction_hierarchy:
+		// it is left empty when its columns are mapped from a flat graph file
 		RoutingKit::ContractionHierarchy ch;
 		RoutingKit::ContractionHierarchyQuery ch_query;
 
+		// Metric independent contraction (nested dissection order) shared by the metrics, and
+		// the weights of its up arcs customized for each metric
+		RoutingKit::CustomizableContractionHierarchy cch;
+		std::vector<RoutingKit::CustomizableContractionHierarchyMetric> cch_metric;
+
 		std::vector<unsigned> capacity_coverage_node;
 		std::vector<unsigned> capacity_coverage_way;
 
+		// Whether the coverage and nearest units computations print a summary line, not
+		// flushed. Their timings are otherwise only recorded by the instrumentation (see
+		// utils/instrumentation.h), nothing is written to stdout on these hot paths.
+		bool is_verbose = false;
+
+		// The nearest_unit_count units reaching each node (arc) first, see nearest_units:
+		// arrival time in milliseconds and unit id of the i-th one at [x * nearest_unit_count + i],
+		// RoutingKit::inf_weight and RoutingKit::invalid_id when fewer units reach it
+		unsigned nearest_unit_count = 0;
+		std::vector<unsigned> nearest_unit_time_node;
+		std::vector<unsigned> nearest_unit_id_node;
+		std::vector<unsigned> nearest_unit_time_way;
+		std::vector<unsigned> nearest_unit_id_way;
+
 	    /**
 		 * Returns a list of nodes ramdomly choose
 		 */
@@ -355,9 +1014,11 @@ namespace cms {
 
 			ch = RoutingKit::ContractionHierarchy::build(
 				this->node_count, 
-				this->tail, 
-				this->rk_graph.head, 
-				this->travel_time);
+				this->tail.to_vector(), 
+				this->head.to_vector(), 
+				this->travel_time.to_vector());
+			ch_view = ch;
+			release_default_metric_customization();
 
 			long long end_time = RoutingKit::get_micro_time();
 			cout_message("Contraction hierarchy built in " +  microseconds_to_readable_time_cout(end_time - start_time) + " microseconds.");
@@ -370,6 +1031,7 @@ namespace cms {
 		 */
 		void save_contraction_hierarchy(std::string ch_file, const std::string& destination_folder) {		
 			
+			copy_mapped_contraction_hierarchy();
 			ch.save_file(destination_folder+'/'+ch_file);
 			cout_message("Contraction hierarchy saved at: " + destination_folder+'/'+ch_file);		
 		}
@@ -379,47 +1041,199 @@ namespace cms {
 		 */
 		void load_contraction_hierarchy(std::string ch_file) {		
 
+			CMS_SCOPED_TIMER("graph.load_contraction_hierarchy_microseconds");
 			ch = RoutingKit::ContractionHierarchy::load_file(ch_file);
+			ch_view = ch;
+			release_default_metric_customization();
 			cout_message("Contraction hierarchy loaded from: " + ch_file);		
 
 		}
 
+	    /**
+		 * Contract the graph topology once, whatever the metric, and customize every metric
+		 * but the default one when ch, which answers its queries, is built. A metric added
+		 * afterwards with set_metric is customized at once: it only costs its customization,
+		 * not a contraction of the graph.
+		 */
+		void build_customizable_contraction_hierarchy() {
+
+			cout_message("Building the customizable contraction hierarchy");
+			long long start_time = RoutingKit::get_micro_time();
+
+			std::vector<unsigned> order = RoutingKit::compute_nested_node_dissection_order_using_inertial_flow(
+				this->node_count,
+				this->tail.to_vector(),
+				this->head.to_vector(),
+				this->latitude.to_vector(),
+				this->longitude.to_vector());
+			build_customizable_contraction_hierarchy(order);
+
+			cout_message("Customizable contraction hierarchy built in " + microseconds_to_readable_time_cout(RoutingKit::get_micro_time() - start_time));
+		}
+
+	    /**
+		 * Save the node order of the customizable contraction hierarchy, the only part of it
+		 * that does not depend on the metrics.
+		 *
+		 * @prerequisite build_customizable_contraction_hierarchy should have been executed first.
+		 */
+		void save_customizable_contraction_hierarchy(std::string cch_file, const std::string& destination_folder) {
+
+			RoutingKit::save_vector(destination_folder+'/'+cch_file, get_customizable_contraction_hierarchy_order());
+			cout_message("Customizable contraction hierarchy saved at: " + destination_folder+'/'+cch_file);
+		}
+
+	    /**
+		 * Load a node order saved by save_customizable_contraction_hierarchy. The customizable
+		 * contraction hierarchy is only rebuilt from it, and every metric customized (see
+		 * build_customizable_contraction_hierarchy), when first needed.
+		 */
+		void load_customizable_contraction_hierarchy(std::string cch_file) {
+
+			CMS_SCOPED_TIMER("graph.load_customizable_contraction_hierarchy_microseconds");
+			defer_customizable_contraction_hierarchy(RoutingKit::load_vector<unsigned>(cch_file));
+			cout_message("Customizable contraction hierarchy order loaded from: " + cch_file);
+		}
+
+		bool has_customizable_contraction_hierarchy() const {
+			return cch.node_count() != 0 || !deferred_cch_order.empty();
+		}
+
+	    /**
+		 * The customizable contraction hierarchy, built from its loaded order on first use.
+		 * Like build_arc_snapper, the first call must not run concurrently with other calls.
+		 */
+		const RoutingKit::CustomizableContractionHierarchy& get_customizable_contraction_hierarchy() {
+			if(!deferred_cch_order.empty()){
+				long long start_time = RoutingKit::get_micro_time();
+				build_customizable_contraction_hierarchy(deferred_cch_order);
+				cout_message("Customizable contraction hierarchy built from its order in " + microseconds_to_readable_time_cout(RoutingKit::get_micro_time() - start_time));
+			}
+			if(cch.node_count() == 0)
+				throw std::runtime_error("The customizable contraction hierarchy has not been built");
+			return cch;
+		}
+
+	    /**
+		 * Renumber the nodes and arcs of the graph (see Graph::renumber_nodes) and of its
+		 * hierarchies. The arcs of the contraction hierarchy being indexed by rank, only its
+		 * rank and order are remapped; the customizable contraction hierarchy, which refers to
+		 * the arcs of the graph, is rebuilt from its remapped order when next needed.
+		 */
+		void renumber_nodes(const std::vector<unsigned>& order) override {
+
+			Graph::renumber_nodes(order);
+
+			std::vector<unsigned> new_node_id = RoutingKit::invert_permutation(order);
+			if(ch.node_count() != 0){
+				for(unsigned& x : ch.order)
+					x = new_node_id[x];
+				ch.rank = RoutingKit::invert_permutation(ch.order);
+				ch_view = ch;
+			}
+			if(has_customizable_contraction_hierarchy()){
+				std::vector<unsigned> cch_order = get_customizable_contraction_hierarchy_order();
+				for(unsigned& x : cch_order)
+					x = new_node_id[x];
+				defer_customizable_contraction_hierarchy(std::move(cch_order));
+			}
+
+			capacity_coverage_node.clear();
+			capacity_coverage_way.clear();
+			nearest_unit_time_node.clear();
+			nearest_unit_id_node.clear();
+			nearest_unit_time_way.clear();
+			nearest_unit_id_way.clear();
+		}
+
+	    /**
+		 * Number the nodes by contraction hierarchy rank, the nodes met together by the
+		 * upward and downward sweeps of PHAST getting close ids.
+		 *
+		 * @prerequisite build_contraction_hierarchy or load_contraction_hierarchy should have been executed first.
+		 */
+		void renumber_nodes_by_contraction_hierarchy_rank() {
+
+			if(ch_view.node_count() != this->node_count)
+				throw std::runtime_error("The contraction hierarchy has not been built");
+			std::vector<unsigned> order = ch_view.order.to_vector();
+			renumber_nodes(order);
+		}
+
+	    /**
+		 * Customize the weights of the up arcs of the customizable contraction hierarchy for
+		 * a metric, after a change of its weights. PHAST runs directly on them (see
+		 * get_contraction_hierarchy), no contraction hierarchy is extracted.
+		 */
+		void customize_metric(unsigned metric) {
+
+			const RoutingKit::CustomizableContractionHierarchy& hierarchy = get_customizable_contraction_hierarchy();
+
+			long long start_time = RoutingKit::get_micro_time();
+
+			// The input weights are only read by customize: the metric keeps its forward and
+			// backward weights, and does not reference the copy once customized
+			std::vector<unsigned> weight = get_metric_travel_time(metric).to_vector();
+			cch_metric.resize(get_metric_count());
+			cch_metric[metric].reset(hierarchy, weight);
+			cch_metric[metric].customize();
+			cch_metric[metric].input_weight = nullptr;
+
+			cout_message("Metric " + get_metric_name(metric) + " customized in " + microseconds_to_readable_time_cout(RoutingKit::get_micro_time() - start_time));
+		}
+
+	    /**
+		 * Add or replace a named metric (see Graph::set_metric) and customize it when the
+		 * customizable contraction hierarchy has been built.
+		 */
+		unsigned set_metric(const std::string& name, std::vector<unsigned> arc_travel_time) override {
+			unsigned metric = Graph::set_metric(name, std::move(arc_travel_time));
+			if(has_customizable_contraction_hierarchy())
+				customize_metric(metric);
+			return metric;
+		}
+
+	    /**
+		 * Contraction hierarchy answering the queries of a metric: ch for the default metric
+		 * when it has been built, otherwise the up arcs of the customizable contraction
+		 * hierarchy with the customized weights of the metric.
+		 */
+		ContractionHierarchyView get_contraction_hierarchy(unsigned metric = 0) {
+			if(metric == 0 && has_default_contraction_hierarchy())
+				return ch_view;
+			if(has_customizable_contraction_hierarchy())
+				get_customizable_contraction_hierarchy();
+			if(metric >= cch_metric.size() || cch_metric[metric].cch == nullptr)
+				throw std::runtime_error("No contraction hierarchy for the metric " + get_metric_name(metric));
+			return ContractionHierarchyView(cch, cch_metric[metric]);
+		}
+
 	    /**
 		 * Mark all ways fully reachable (head to tail) from a given source node under a defined
 		 * time threshold time threshold in way_bit_vector.
 		 *
-		 * @prerequisite build_contraction_hierarchy should have been executed first.
+		 * The search stops at the threshold, so only the ways of the unit isochrone are visited.
 		 */
 		void unit_coverage(RoutingKit::BitVector& way_bit_vector, unsigned source, unsigned threshold = 300){ 
 
-			cout_message("Assess all reachable ways for a unit from the node: " + std::to_string(source) + " under " + std::to_string(threshold) + " seconds");
+			CMS_SCOPED_TIMER("coverage.unit_microseconds");
 
 			threshold = threshold * 1000;
-			RoutingKit::BitVector node_bit_vector(this->node_count);
-			std::vector<unsigned> target_list(this->rk_graph.latitude.size());
 
-			std::iota(target_list.begin(), target_list.end(), 0); 
-
-			ch_query = RoutingKit::ContractionHierarchyQuery(ch);			
-			ch_query.reset().pin_targets(target_list);
-
-			node_bit_vector.reset_all();
 			way_bit_vector.reset_all();
 
-			std::vector<unsigned> distances_to_targets = ch_query.reset_source().add_source(source).run_to_pinned_targets().get_distances_to_targets();
-			// assess for each node if it could be reach under the defined threshold		
-			for (unsigned i = 0; i < node_count; ++i)
-			{
-				if (distances_to_targets[i] < threshold)
-					node_bit_vector.set(i, 1);	
-			}
+			IsochroneQuery& query = get_isochrone_query();
+			query.reset().add_source(source).run(threshold);
 
 			// assess for each way if it could be reach under the defined threshold 
 			// (a way is covered if both extrimity node can be reach under the defined threshold)		
-			for (unsigned i = 0; i < this->rk_graph.head.size(); ++i)
+			for (unsigned x : query.get_reached_nodes())
 			{
-				if(node_bit_vector.is_set(this->rk_graph.head[i]) && node_bit_vector.is_set(this->tail[i]))
-					way_bit_vector.set(this->rk_graph.way[i], 1);
+				for (unsigned i = this->first_out[x]; i < this->first_out[x+1]; ++i)
+				{
+					if(query.is_reached(this->head[i]))
+						way_bit_vector.set(this->way[i], 1);
+				}
 			}
 
 		}
@@ -428,53 +1242,144 @@ namespace cms {
 		 * Compute for all ways the number of units able to fully cover them under a defined
 		 * time threshold time threshold in way_bit_vector.
 		 *
-		 * @prerequisite build_contraction_hierarchy should have been executed first.
+		 * Each unit search stops at the threshold and only increments the nodes it reached.
 		 */
-		void capacity_coverage(std::vector<unsigned>& source_list, unsigned threshold = 300){ 
+		void capacity_coverage(std::vector<unsigned>& source_list, unsigned threshold = 300, unsigned metric = 0){ 
 
+			CMS_SCOPED_TIMER("coverage.capacity_microseconds");
+			CMS_COUNTER_ADD("coverage.units", source_list.size());
 			long long start_time;
-			long long end_time;
 
 			threshold = threshold * 1000;
 
-			capacity_coverage_node.resize(this->node_count);
-			capacity_coverage_way.resize(this->rk_graph.head.size());
-			RoutingKit::BitVector way_bit_vector(this->osmwayid_to_idx.size());
-
-			std::vector<unsigned> target_list(this->rk_graph.latitude.size());
-
-			std::iota(target_list.begin(), target_list.end(), 0); 
+			capacity_coverage_node.assign(this->node_count, 0);
+			capacity_coverage_way.assign(this->arc_count, 0);
 
-			std::fill(capacity_coverage_node.begin(), capacity_coverage_node.end(), 0); 
-			std::fill(capacity_coverage_way.begin(), capacity_coverage_way.end(), 0); 
-
-			ch_query = RoutingKit::ContractionHierarchyQuery(ch); 
-			ch_query.reset().pin_targets(target_list);
-
-			cout_message("Start computing the coverage capacity for a " + std::to_string(threshold/1000) + " seconds coverage");
+			IsochroneQuery& query = get_isochrone_query(metric);
 
 			// Compute the graph nodes capacity coverage
 			start_time = RoutingKit::get_micro_time();
 			
 			for(auto s:source_list){
-				std::vector<unsigned> distances_to_targets = ch_query.reset_source().add_source(s).run_to_pinned_targets().get_distances_to_targets();
-				for (unsigned i = 0; i < node_count; ++i)
-				{
-					if (distances_to_targets[i] < threshold)
-						// increment the number units able to reach this node under the define threshold
-						capacity_coverage_node[i]++;
-				}
+				query.reset().add_source(s).run(threshold);
+				for (unsigned i : query.get_reached_nodes())
+					// increment the number units able to reach this node under the define threshold
+					capacity_coverage_node[i]++;
 			}
 
 			// Compute the graph ways capacity coverage
-			for (unsigned i = 0; i < this->arc_count; ++i)
-			{
-				capacity_coverage_way[i] = (capacity_coverage_node[this->rk_graph.head[i]] + capacity_coverage_node[this->tail[i]]) / 2;
-			}
+			compute_capacity_coverage_way();
+
+			report_capacity_coverage(threshold, start_time);
+
+		}
+
+	    /**
+		 * Same as capacity_coverage but spreads the units of source_list over several threads.
+		 * Each worker owns its IsochroneQuery and its own node counters, which are
+		 * summed at the end so the result is identical to the serial path.
+		 *
+		 * @param thread_count Number of workers, 0 to use all the available cores.
+		 */
+		void capacity_coverage_parallel(std::vector<unsigned>& source_list, unsigned threshold = 300, unsigned thread_count = 0, unsigned metric = 0){
+			capacity_coverage_parallel(source_list, threshold, thread_count, get_metric_travel_time(metric));
+		}
+
+	    /**
+		 * Same as capacity_coverage_parallel with the given arc travel times in milliseconds.
+		 */
+		void capacity_coverage_parallel(std::vector<unsigned>& source_list, unsigned threshold, unsigned thread_count, ConstArray<unsigned> arc_travel_time){
+
+			CMS_SCOPED_TIMER("coverage.capacity_parallel_microseconds");
+			threshold = threshold * 1000;
+
+			if(thread_count == 0)
+				thread_count = std::max(1u, std::thread::hardware_concurrency());
+			// No need of more workers than units
+			thread_count = std::max(1u, std::min(thread_count, (unsigned)source_list.size()));
 
-			cout_message("\nLa couverture maximale d'un tronçon routier est de : ");
-			cout_message(*max_element(capacity_coverage_way.begin(),capacity_coverage_way.end()) + " unité(s) (atteignable sous " + std::to_string(threshold / 1000) + " secondes à la limite de vitesse)");
-			cout_message("COUVERTURE CALCULEE EN : " + microseconds_to_readable_time_cout(RoutingKit::get_micro_time() - start_time) + "\n\n");
+			long long start_time = RoutingKit::get_micro_time();
+
+			compute_capacity_coverage_node_parallel(source_list.size(), threshold, thread_count, arc_travel_time, [&](IsochroneQuery& query, unsigned s){
+				query.add_source(source_list[s]);
+			});
+
+			compute_capacity_coverage_way();
+			report_capacity_coverage(threshold, start_time);
+
+		}
+
+	    /**
+		 * Same as capacity_coverage_parallel for units reported by GPS: each unit starts from
+		 * its position along an arc (see snap_positions), units without a valid position
+		 * cover nothing.
+		 *
+		 * @param thread_count Number of workers, 0 to use all the available cores.
+		 */
+		void capacity_coverage_of_positions(const std::vector<SnappedPosition>& positions, unsigned threshold = 300, unsigned thread_count = 0, unsigned metric = 0){
+
+			CMS_SCOPED_TIMER("coverage.capacity_positions_microseconds");
+			threshold = threshold * 1000;
+
+			if(thread_count == 0)
+				thread_count = std::max(1u, std::thread::hardware_concurrency());
+			thread_count = std::max(1u, std::min(thread_count, (unsigned)positions.size()));
+
+			long long start_time = RoutingKit::get_micro_time();
+
+			compute_capacity_coverage_node_parallel(positions.size(), threshold, thread_count, get_metric_travel_time(metric), [&](IsochroneQuery& query, unsigned s){
+				add_snapped_source(query, positions[s], metric);
+			});
+
+			compute_capacity_coverage_way();
+			report_capacity_coverage(threshold, start_time);
+
+		}
+
+	    /**
+		 * Same result as capacity_coverage but computed with PHASTQuery one-to-all sweeps:
+		 * units are processed lane_count at a time, batches being spread over thread_count
+		 * workers (0 to use all the available cores).
+		 *
+		 * @prerequisite build_contraction_hierarchy should have been executed first.
+		 */
+		template<unsigned lane_count = 16>
+		void capacity_coverage_phast(std::vector<unsigned>& source_list, unsigned threshold = 300, unsigned thread_count = 1, unsigned metric = 0){
+			capacity_coverage_phast<lane_count>(source_list, threshold, thread_count, get_contraction_hierarchy(metric));
+		}
+
+	    /**
+		 * Same as capacity_coverage_phast on a given contraction hierarchy of the graph, e.g.
+		 * the one of a LiveMetric snapshot.
+		 */
+		template<unsigned lane_count = 16>
+		void capacity_coverage_phast(std::vector<unsigned>& source_list, unsigned threshold, unsigned thread_count, const ContractionHierarchyView& metric_hierarchy){
+
+			CMS_SCOPED_TIMER("coverage.capacity_phast_microseconds");
+			CMS_COUNTER_ADD("coverage.units", source_list.size());
+			threshold = threshold * 1000;
+
+			unsigned batch_count = (source_list.size() + lane_count - 1) / lane_count;
+			if(thread_count == 0)
+				thread_count = std::max(1u, std::thread::hardware_concurrency());
+			thread_count = std::max(1u, std::min(thread_count, batch_count));
+
+			capacity_coverage_node.assign(this->node_count, 0);
+			capacity_coverage_way.assign(this->arc_count, 0);
+
+			long long start_time = RoutingKit::get_micro_time();
+
+			// Per-thread counters as narrow as the number of units allows
+			unsigned counter_width = coverage_kernels::get_counter_width(source_list.size());
+			if(counter_width == 1)
+				compute_capacity_coverage_node_phast<lane_count, uint8_t>(source_list, threshold, thread_count, metric_hierarchy);
+			else if(counter_width == 2)
+				compute_capacity_coverage_node_phast<lane_count, uint16_t>(source_list, threshold, thread_count, metric_hierarchy);
+			else
+				compute_capacity_coverage_node_phast<lane_count, unsigned>(source_list, threshold, thread_count, metric_hierarchy);
+
+			compute_capacity_coverage_way();
+			report_capacity_coverage(threshold, start_time);
 
 		}
 		
@@ -499,96 +1404,528 @@ namespace cms {
         *		},{
       	*			"type": "Feature",
       	*			...
+      	*
+      	* Each road segment is written with its own polyline (tail, modelling nodes, head) and
+      	* only once for both directions. Graphs loaded without the arc geometry fall back to
+      	* the polyline of the whole OSM way of each arc.
+      	*
+      	* Arcs are grouped by coverage value with a counting sort and features are streamed to
+      	* the file by chunks of arcs serialized on thread_count workers (0 for all the cores)
+      	* and written in order, so that only a bounded number of chunks are held in memory.
       	*
 		* @prerequisite capacity_coverage should have been processed first.
       	*/
-		void export_geojson_capacity_coverage(std::string destination_file)	{
+		void export_geojson_capacity_coverage(std::string destination_file, unsigned thread_count = 0)	{
 
-			std::unordered_multimap<unsigned,uint64_t> capacity_coverage_way_map;
-			unsigned id, number_of_units, number_of_linestrings, number_of_points, max_coverage_capacity;
+			CMS_SCOPED_TIMER("export.geojson_microseconds");
 
-			// Group ways by number of units able to reach them for the time threshold constraint
-			for (uint64_t i = 0; i < this->arc_count; ++i) {
-				capacity_coverage_way_map.insert(std::pair<unsigned,uint64_t>(capacity_coverage_way[i],i));
-			}
+			// Arcs serialized per chunk, a feature with more arcs spans several chunks
+			const unsigned arcs_per_chunk = 1024;
 
 			// Highest number of units a way could be reached for the set time threshold constraint
-			max_coverage_capacity = *max_element(capacity_coverage_way.begin(),capacity_coverage_way.end());
-
-		    rapidjson::StringBuffer s;
-		    // For pretty printing in place 
-		    // rapidjson::PrettyWriter<StringBuffer> writer(s);
-		    rapidjson::Writer<rapidjson::StringBuffer> writer(s); 		    	
-		    
-		    writer.StartObject();               // JSON root 
-		    writer.Key("type");                     // "type":"FeatureCollection",
-		    writer.String("FeatureCollection");      
-		    writer.Key("features");                 // "features":
-		    writer.StartArray();                    // [
-
-		    for (unsigned i = 0; i < max_coverage_capacity; i++) { // 
-
-		        writer.StartObject();                       // {
-		        writer.Key("type");                             // "type":"Feature",
-		        writer.String("Feature");  
-		        writer.Key("id");                               // "id":1,
-		        writer.Uint(i);
-		        writer.Key("geometry");                         // "geometry":{
-		        writer.StartObject(); 
-		        writer.Key("type");                                 // "type":"MultiLineString",
-		        writer.String("MultiLineString"); 
-		        writer.Key("coordinates");                          // "coordinates":
-		        writer.StartArray();                                // [
-
-		        auto its = capacity_coverage_way_map.equal_range(i);
-				for (auto it = its.first; it != its.second; ++it) {
+			unsigned max_coverage_capacity = capacity_coverage_way.empty() ? 0 : *max_element(capacity_coverage_way.begin(),capacity_coverage_way.end());
+
+			// With the arc geometry each road segment is exported once: the arc running against
+			// its way is skipped when the arc in the way direction exists as well
+			bool use_arc_geometry = has_arc_geometry();
+			std::vector<unsigned> exported_arcs;
+			exported_arcs.reserve(this->arc_count);
+			for (unsigned i = 0; i < this->arc_count; ++i) {
+				if (!use_arc_geometry || !has_twin_arc_along_way(i))
+					exported_arcs.push_back(i);
+			}
 
-					writer.StartArray();			// [
-					
-					for(unsigned j = 0; j < opr_graph.ways[this->osmwayid_to_idx[this->way_osmid[this->rk_graph.way[it->second]]]].size(); j++){
-						
-						writer.StartArray();			// [
-						// Set a 1.11cm accuracy
-				    	writer.SetMaxDecimalPlaces(7); 
-				    	writer.Double(opr_graph.nodes[opr_graph.ways[this->osmwayid_to_idx[this->way_osmid[this->rk_graph.way[it->second]]]][j]].lat_m);
-				    	writer.Double(opr_graph.nodes[opr_graph.ways[this->osmwayid_to_idx[this->way_osmid[this->rk_graph.way[it->second]]]][j]].lon_m);
+			CMS_COUNTER_ADD("export.geojson_arcs", exported_arcs.size());
+			// Group ways by number of units able to reach them for the time threshold constraint (counting sort)
+			std::vector<unsigned> first_arc_of_coverage(max_coverage_capacity + 2, 0);
+			for (unsigned i : exported_arcs)
+				++first_arc_of_coverage[capacity_coverage_way[i] + 1];
+			for (unsigned c = 0; c <= max_coverage_capacity; ++c)
+				first_arc_of_coverage[c + 1] += first_arc_of_coverage[c];
+			std::vector<unsigned> arcs_by_coverage(exported_arcs.size());
+			{
+				std::vector<unsigned> next_arc(first_arc_of_coverage.begin(), first_arc_of_coverage.end() - 1);
+				for (unsigned i : exported_arcs)
+					arcs_by_coverage[next_arc[capacity_coverage_way[i]]++] = i;
+			}
+
+			// One feature per coverage value, the top value included
+			struct Chunk {
+				unsigned coverage;
+				unsigned first_arc;	// range in arcs_by_coverage
+				unsigned last_arc;
+				bool starts_feature;
+				bool ends_feature;
+			};
+			std::vector<Chunk> chunks;
+			for (unsigned c = 0; c <= max_coverage_capacity; ++c) {
+				unsigned begin = first_arc_of_coverage[c], end = first_arc_of_coverage[c + 1];
+				unsigned first = begin;
+				do {
+					Chunk chunk;
+					chunk.coverage = c;
+					chunk.first_arc = first;
+					chunk.last_arc = std::min(end, first + arcs_per_chunk);
+					chunk.starts_feature = (first == begin);
+					chunk.ends_feature = (chunk.last_arc == end);
+					chunks.push_back(chunk);
+					first = chunk.last_arc;
+				} while (first < end);
+			}
 
-				    	writer.EndArray(); 	
+			auto serialize_chunk = [&](unsigned chunk_index, std::string& text){
+				const Chunk& chunk = chunks[chunk_index];
+				const std::string i = std::to_string(chunk.coverage);
 
-				    }
+				if (chunk.starts_feature)
+					text += "{\"type\":\"Feature\",\"id\":" + i + ",\"geometry\":{\"type\":\"MultiLineString\",\"coordinates\":[";
 
-				    writer.EndArray(); 					 // ]
+				StringOutputStream stream(text);
+				rapidjson::Writer<StringOutputStream> writer(stream);
+				// Set a 1.11cm accuracy
+				writer.SetMaxDecimalPlaces(7);
 
+				for (unsigned k = chunk.first_arc; k < chunk.last_arc; ++k) {
+					if (k != first_arc_of_coverage[chunk.coverage])
+						text += ',';
+					writer.Reset(stream);
+					writer.StartArray();			// [
+					unsigned arc = arcs_by_coverage[k];
+					if (use_arc_geometry) {
+						// tail, modelling nodes, head
+						write_point(writer, this->latitude[this->tail[arc]], this->longitude[this->tail[arc]]);
+						for (unsigned j = this->first_modelling_node[arc]; j < this->first_modelling_node[arc+1]; j++)
+							write_point(writer, this->modelling_node_latitude[j], this->modelling_node_longitude[j]);
+						write_point(writer, this->latitude[this->head[arc]], this->longitude[this->head[arc]]);
+					} else {
+						// whole OSM way of graphs saved without the arc geometry
+						uint64_t way_idx = this->osmwayid_to_idx.at(this->way_osmid[this->way[arc]]);
+						for(unsigned j = first_way_point[way_idx]; j < first_way_point[way_idx+1]; j++)
+							write_point(writer, way_point_latitude[j], way_point_longitude[j]);
+					}
+					writer.EndArray();					// ]
 				}
 
-		        writer.EndArray();                                // ] // end of coordinates
-		        writer.EndObject();                             // } // end of geometry
-		        writer.Key("properties");                         // "properties":{
-		        writer.StartObject(); 
-		        writer.Key("number_of_units");
-		        writer.Uint(i);
-		        writer.EndObject();                             // } // end of properties  
-		        writer.Key("title");                             // "title":"Road segments reachable by id number of units",
-		        std::string title_value = std::to_string(i) + " units are able to reach those ways under the time constraint";
-				const char * title_value_formatted = title_value.c_str();
-		        writer.String(title_value_formatted);         
-		        writer.EndObject();                         // }
-
-		    }
-		    
-		    writer.EndArray();                      // ] // end of features
-		    writer.EndObject();                     // }
+				if (chunk.ends_feature) {
+					// end of coordinates and geometry, then properties and title
+					text += "]},\"properties\":{\"number_of_units\":" + i + "},\"title\":\"" + i + " units are able to reach those ways under the time constraint\"}";
+					if (chunk.coverage < max_coverage_capacity)
+						text += ',';
+				}
+			};
 
 		    // Output in a file
 		    std::ofstream output_file_stream;
 		    output_file_stream.open (destination_file);
-		    output_file_stream << s.GetString();
+		    if (!output_file_stream)
+		    	throw std::runtime_error("Unable to open " + destination_file + " for writing");
+
+		    output_file_stream << "{\"type\":\"FeatureCollection\",\"features\":[";
+		    write_chunks_in_order(output_file_stream, chunks.size(), serialize_chunk, thread_count);
+		    output_file_stream << "]}";
 		    output_file_stream.close();
+		    if (!output_file_stream)
+		    	throw std::runtime_error("Unable to write " + destination_file);
 		
-			cout_message("Capacity coverage exported in the " + destination_file + " GeoJSON file");
+		    cout_message("Capacity coverage exported in the " + destination_file + " GeoJSON file");
+		}
+
+	    /**
+		 * Derive capacity_coverage_way from capacity_coverage_node: a way is covered by the
+		 * mean number of units reaching its two extremities.
+		 */
+		void compute_capacity_coverage_way(){
+			CMS_SCOPED_TIMER("coverage.arc_aggregation_microseconds");
+			capacity_coverage_way.resize(this->arc_count);
+			coverage_kernels::aggregate_arc_coverage(capacity_coverage_node.data(), this->head.data(), this->tail.data(), this->arc_count, capacity_coverage_way.data());
+		}
+
+	    /**
+		 * Find, for every node and arc, the k units reaching it first under threshold seconds
+		 * (see nearest_unit_time_node and the following vectors): the first arrival time, the
+		 * k-th one and the closest unit, unit i starting from source_list[i].
+		 *
+		 * Unlike the capacity coverage, which searches once per unit, a single search keeps the
+		 * k best labels of every node (see NearestUnitsQuery), so the work grows with k and not
+		 * with the number of units.
+		 */
+		void nearest_units(const std::vector<unsigned>& source_list, unsigned k = 3, unsigned threshold = 300, unsigned metric = 0){
+
+			compute_nearest_units(k, threshold, metric, [&](NearestUnitsQuery& query){
+				for(unsigned i = 0; i < source_list.size(); ++i)
+					query.add_source(source_list[i], i);
+			});
+		}
+
+	    /**
+		 * Same as nearest_units for units reported by GPS, unit i standing at positions[i]
+		 * (see snap_positions). Units without a valid position reach nothing.
+		 */
+		void nearest_units_of_positions(const std::vector<SnappedPosition>& positions, unsigned k = 3, unsigned threshold = 300, unsigned metric = 0){
+
+			compute_nearest_units(k, threshold, metric, [&](NearestUnitsQuery& query){
+				for(unsigned i = 0; i < positions.size(); ++i)
+					add_snapped_source(query, i, positions[i], metric);
+			});
+		}
+
+	    /**
+		 * Arrival time in milliseconds of the i-th unit reaching arc a, RoutingKit::inf_weight
+		 * if fewer units reach it.
+		 *
+		 * @prerequisite nearest_units should have been processed first.
+		 */
+		unsigned get_nearest_unit_time_way(unsigned a, unsigned i = 0) const {
+			return i < nearest_unit_count ? nearest_unit_time_way[(size_t)a * nearest_unit_count + i] : RoutingKit::inf_weight;
+		}
+
+		unsigned get_nearest_unit_id_way(unsigned a, unsigned i = 0) const {
+			return i < nearest_unit_count ? nearest_unit_id_way[(size_t)a * nearest_unit_count + i] : RoutingKit::invalid_id;
+		}
+
+	    /**
+		 * Derive the arc labels from the node labels: a unit reaches an arc when it reaches
+		 * the first of its two extremities. The k first units of an arc being among the k
+		 * first of one of its extremities, merging the two lists of labels is exact.
+		 */
+		void compute_nearest_units_way(){
+			CMS_SCOPED_TIMER("nearest_units.arc_aggregation_microseconds");
+			const unsigned k = nearest_unit_count;
+			nearest_unit_time_way.assign((size_t)this->arc_count * k, RoutingKit::inf_weight);
+			nearest_unit_id_way.assign((size_t)this->arc_count * k, RoutingKit::invalid_id);
+			for(unsigned a = 0; a < this->arc_count; ++a){
+				const unsigned* tail_time = nearest_unit_time_node.data() + (size_t)this->tail[a] * k;
+				const unsigned* tail_unit = nearest_unit_id_node.data() + (size_t)this->tail[a] * k;
+				const unsigned* head_time = nearest_unit_time_node.data() + (size_t)this->head[a] * k;
+				const unsigned* head_unit = nearest_unit_id_node.data() + (size_t)this->head[a] * k;
+				unsigned* time = nearest_unit_time_way.data() + (size_t)a * k;
+				unsigned* unit = nearest_unit_id_way.data() + (size_t)a * k;
+				// Merge in (arrival time, unit) order, the first label of a unit being its earliest
+				unsigned t = 0, h = 0, count = 0;
+				while(count < k && (t < k || h < k)){
+					bool from_tail = h == k || (t < k && std::make_pair(tail_time[t], tail_unit[t]) < std::make_pair(head_time[h], head_unit[h]));
+					unsigned label_time = from_tail ? tail_time[t] : head_time[h];
+					unsigned label_unit = from_tail ? tail_unit[t++] : head_unit[h++];
+					if(label_unit == RoutingKit::invalid_id)
+						break;
+					if(std::find(unit, unit + count, label_unit) != unit + count)
+						continue;
+					time[count] = label_time;
+					unit[count] = label_unit;
+					++count;
+				}
+			}
+		}
+
+	  protected:
+
+		IsochroneQuery isochrone_query;
+		NearestUnitsQuery nearest_units_query;
+
+		// Workspace of a worker of the parallel capacity coverage, kept from one call to the next
+		struct CoverageWorker {
+			IsochroneQuery query;
+			std::vector<uint8_t> coverage_node_8;
+			std::vector<uint16_t> coverage_node_16;
+			std::vector<unsigned> coverage_node_32;
+
+			std::vector<uint8_t>& get_coverage_node(uint8_t) { return coverage_node_8; }
+			std::vector<uint16_t>& get_coverage_node(uint16_t) { return coverage_node_16; }
+			std::vector<unsigned>& get_coverage_node(unsigned) { return coverage_node_32; }
+		};
+		std::vector<CoverageWorker> coverage_workers;
+
+		template<class Writer>
+		static void write_point(Writer& writer, double latitude, double longitude){
+			writer.StartArray();			// [
+			writer.Double(latitude);
+			writer.Double(longitude);
+			writer.EndArray();				// ]
+		}
+
+	    /**
+		 * Whether the arc runs against its way and the opposite arc, along the way, exists.
+		 */
+		bool has_twin_arc_along_way(unsigned arc) const {
+			if (!this->rk_graph.is_arc_antiparallel_to_way[arc])
+				return false;
+			unsigned from = this->tail[arc], to = this->head[arc];
+			for (unsigned a = this->first_out[to]; a < this->first_out[to+1]; ++a) {
+				if (this->head[a] == from && this->way[a] == this->way[arc] && !this->rk_graph.is_arc_antiparallel_to_way[a])
+					return true;
+			}
+			return false;
+		}
+
+	    /**
+		 * The flat graph file of a GraphCH also holds the contraction hierarchy (without the
+		 * shortcut unpacking data, paths can not be unpacked from a loaded hierarchy) and the
+		 * order of the customizable contraction hierarchy.
+		 */
+	    void write_flat_file_sections(GraphFileWriter& writer) override
+	    {
+	    	Graph::write_flat_file_sections(writer);
+	    	writer.add("ch.rank", ch_view.rank);
+	    	writer.add("ch.order", ch_view.order);
+	    	writer.add("ch.forward.first_out", ch_view.forward_first_out);
+	    	writer.add("ch.forward.head", ch_view.forward_head);
+	    	writer.add("ch.forward.weight", ch_view.forward_weight);
+	    	writer.add("ch.backward.first_out", ch_view.backward_first_out);
+	    	writer.add("ch.backward.head", ch_view.backward_head);
+	    	writer.add("ch.backward.weight", ch_view.backward_weight);
+	    	// The metrics are customized again when the hierarchy is first needed
+	    	if(has_customizable_contraction_hierarchy())
+	    		writer.add("cch.order", get_customizable_contraction_hierarchy_order());
+	    }
+
+	    void read_flat_file_sections(const GraphFileView& view) override
+	    {
+	    	Graph::read_flat_file_sections(view);
+	    	if(view.has("ch.rank")){
+	    		ch_view.rank = view.get<unsigned>("ch.rank");
+	    		ch_view.order = view.get<unsigned>("ch.order");
+	    		ch_view.forward_first_out = view.get<unsigned>("ch.forward.first_out");
+	    		ch_view.forward_head = view.get<unsigned>("ch.forward.head");
+	    		ch_view.forward_weight = view.get<unsigned>("ch.forward.weight");
+	    		ch_view.backward_first_out = view.get<unsigned>("ch.backward.first_out");
+	    		ch_view.backward_head = view.get<unsigned>("ch.backward.head");
+	    		ch_view.backward_weight = view.get<unsigned>("ch.backward.weight");
+	    	}
+	    	if(view.has("cch.order"))
+	    		defer_customizable_contraction_hierarchy(view.get<unsigned>("cch.order").to_vector());
+	    }
+
+	    // The default metric hierarchy, viewing ch or the sections of the mapped flat file
+	    ContractionHierarchyView ch_view;
+
+	    // Order of a customizable contraction hierarchy not built yet, see get_customizable_contraction_hierarchy
+	    std::vector<unsigned> deferred_cch_order;
+
+	    void bind_columns() override
+	    {
+	    	Graph::bind_columns();
+	    	ch_view = ch;
+	    }
+
+	    /**
+		 * Also drop the hierarchies, which belong to the dropped graph.
+		 */
+	    void clear_columns() override
+	    {
+	    	ch = RoutingKit::ContractionHierarchy();
+	    	cch = RoutingKit::CustomizableContractionHierarchy();
+	    	cch_metric.clear();
+	    	deferred_cch_order.clear();
+	    	Graph::clear_columns();
+	    }
+
+	    void copy_mapped_columns() override
+	    {
+	    	copy_mapped_contraction_hierarchy();
+	    	Graph::copy_mapped_columns();
+	    }
+
+	    // Copy the default metric hierarchy into ch when it is mapped from a flat file
+	    void copy_mapped_contraction_hierarchy()
+	    {
+	    	if(ch.node_count() != 0 || ch_view.node_count() == 0)
+	    		return;
+	    	ch.rank = ch_view.rank.to_vector();
+	    	ch.order = ch_view.order.to_vector();
+	    	ch.forward.first_out = ch_view.forward_first_out.to_vector();
+	    	ch.forward.head = ch_view.forward_head.to_vector();
+	    	ch.forward.weight = ch_view.forward_weight.to_vector();
+	    	ch.backward.first_out = ch_view.backward_first_out.to_vector();
+	    	ch.backward.head = ch_view.backward_head.to_vector();
+	    	ch.backward.weight = ch_view.backward_weight.to_vector();
+	    	ch_view = ch;
+	    }
+
+	    // Keep the order of a customizable contraction hierarchy to build it when first needed
+	    void defer_customizable_contraction_hierarchy(std::vector<unsigned> order)
+	    {
+	    	cch = RoutingKit::CustomizableContractionHierarchy();
+	    	cch_metric.clear();
+	    	deferred_cch_order = std::move(order);
+	    }
+
+	    const std::vector<unsigned>& get_customizable_contraction_hierarchy_order() const
+	    {
+	    	return deferred_cch_order.empty() ? cch.order : deferred_cch_order;
+	    }
+
+	    /**
+		 * Fill capacity_coverage_node with unit_count units spread over thread_count workers,
+		 * seed(query, s) adding the sources of unit s to a reset query. Each worker owns its
+		 * IsochroneQuery and its own node counters, which are summed at the end so the
+		 * result does not depend on the number of workers. The counters are as narrow as
+		 * unit_count allows. The workers' workspaces (coverage_workers) are kept for the
+		 * next calls, as isochrone_query is by the serial path.
+		 */
+		template<class Seed>
+		void compute_capacity_coverage_node_parallel(unsigned unit_count, unsigned threshold, unsigned thread_count, ConstArray<unsigned> weight, const Seed& seed){
+
+			CMS_SCOPED_TIMER("coverage.node_accumulation_microseconds");
+			CMS_COUNTER_ADD("coverage.units", unit_count);
+
+			capacity_coverage_node.assign(this->node_count, 0);
+			capacity_coverage_way.assign(this->arc_count, 0);
+
+			unsigned counter_width = coverage_kernels::get_counter_width(unit_count);
+			if(counter_width == 1)
+				accumulate_capacity_coverage_node_parallel<uint8_t>(unit_count, threshold, thread_count, weight, seed);
+			else if(counter_width == 2)
+				accumulate_capacity_coverage_node_parallel<uint16_t>(unit_count, threshold, thread_count, weight, seed);
+			else
+				accumulate_capacity_coverage_node_parallel<unsigned>(unit_count, threshold, thread_count, weight, seed);
+		}
+
+		template<class Counter, class Seed>
+		void accumulate_capacity_coverage_node_parallel(unsigned unit_count, unsigned threshold, unsigned thread_count, ConstArray<unsigned> weight, const Seed& seed){
+
+			// Units are handed out one by one so that workers stay busy till the end
+			std::atomic<unsigned> next_unit(0);
+			if(coverage_workers.size() < thread_count)
+				coverage_workers.resize(thread_count);
+			std::vector<std::thread> workers;
+
+			for(unsigned t = 0; t < thread_count; ++t){
+				workers.emplace_back([&, t]{
+					CMS_SCOPED_TIMER("coverage.node_worker_microseconds");
+					std::vector<Counter>& local_coverage_node = coverage_workers[t].get_coverage_node(Counter());
+					local_coverage_node.assign(this->node_count, 0);
+
+					IsochroneQuery& local_query = coverage_workers[t].query.bind(this->first_out, this->head, weight);
+
+					for(unsigned s = next_unit++; s < unit_count; s = next_unit++){
+						local_query.reset();
+						seed(local_query, s);
+						local_query.run(threshold);
+						for (unsigned i : local_query.get_reached_nodes())
+							local_coverage_node[i]++;
+					}
+				});
+			}
+
+			for(auto& worker : workers)
+				worker.join();
+
+			// Merge the per-thread node counters
+			for(unsigned t = 0; t < thread_count; ++t)
+				coverage_kernels::add_counters(coverage_workers[t].get_coverage_node(Counter()).data(), this->node_count, capacity_coverage_node.data());
+		}
+
+	    /**
+		 * Fill capacity_coverage_node with the units of source_list, lane_count units per
+		 * PHAST sweep. The sweeps are counted by rank, in the order of their distances, and
+		 * the counters are only permuted to the node order once merged.
+		 */
+		template<unsigned lane_count, class Counter>
+		void compute_capacity_coverage_node_phast(const std::vector<unsigned>& source_list, unsigned threshold, unsigned thread_count, const ContractionHierarchyView& metric_hierarchy){
+
+			unsigned batch_count = (source_list.size() + lane_count - 1) / lane_count;
+			std::atomic<unsigned> next_batch(0);
+			std::vector< std::vector<Counter> > thread_coverage_rank(thread_count);
+			std::vector<std::thread> workers;
+
+			for(unsigned t = 0; t < thread_count; ++t){
+				workers.emplace_back([&, t]{
+					std::vector<Counter>& local_coverage_rank = thread_coverage_rank[t];
+					local_coverage_rank.assign(this->node_count, 0);
+
+					PHASTQuery<lane_count> local_query(metric_hierarchy);
+
+					for(unsigned b = next_batch++; b < batch_count; b = next_batch++){
+						unsigned first = b * lane_count;
+						unsigned count = std::min(lane_count, (unsigned)source_list.size() - first);
+						local_query.run(source_list.data() + first, count);
+						coverage_kernels::accumulate_lanes_below<lane_count>(local_query.get_distances_by_rank(0), this->node_count, threshold, local_coverage_rank.data());
+					}
+				});
+			}
+
+			for(auto& worker : workers)
+				worker.join();
+
+			std::vector<unsigned> coverage_rank(this->node_count, 0);
+			for(unsigned t = 0; t < thread_count; ++t)
+				coverage_kernels::add_counters(thread_coverage_rank[t].data(), this->node_count, coverage_rank.data());
+			for(unsigned r = 0; r < this->node_count; ++r)
+				capacity_coverage_node[metric_hierarchy.order[r]] = coverage_rank[r];
+		}
+
+	    /**
+		 * Search workspace reused by unit_coverage and capacity_coverage, bound to the
+		 * weights of metric.
+		 */
+		IsochroneQuery& get_isochrone_query(unsigned metric = 0){
+			return isochrone_query.bind(this->first_out, this->head, get_metric_travel_time(metric));
+		}
+
+		template<class Seed>
+		void compute_nearest_units(unsigned k, unsigned threshold, unsigned metric, const Seed& seed){
+
+			CMS_SCOPED_TIMER("nearest_units.microseconds");
+			threshold = threshold * 1000;
+
+			long long start_time = RoutingKit::get_micro_time();
+
+			NearestUnitsQuery& query = nearest_units_query.bind(this->first_out, this->head, get_metric_travel_time(metric));
+			query.reset(k);
+			seed(query);
+			query.run(threshold);
+
+			nearest_unit_count = k;
+			nearest_unit_time_node.assign((size_t)this->node_count * k, RoutingKit::inf_weight);
+			nearest_unit_id_node.assign((size_t)this->node_count * k, RoutingKit::invalid_id);
+			for(unsigned x : query.get_reached_nodes()){
+				for(unsigned i = 0; i < query.get_label_count(x); ++i){
+					nearest_unit_time_node[(size_t)x * k + i] = query.get_arrival_time(x, i);
+					nearest_unit_id_node[(size_t)x * k + i] = query.get_unit(x, i);
+				}
+			}
+			compute_nearest_units_way();
+
+			if(is_verbose){
+				unsigned reached_arc_count = 0;
+				for(unsigned a = 0; a < this->arc_count; ++a)
+					reached_arc_count += nearest_unit_time_way[(size_t)a * k] != RoutingKit::inf_weight;
+				std::cout << k << " nearest units of " << reached_arc_count << " of " << this->arc_count << " road segments reached under " << threshold / 1000 << " seconds computed in " << microseconds_to_readable_time_cout(RoutingKit::get_micro_time() - start_time) << '\n';
+			}
+		}
+
+		void build_customizable_contraction_hierarchy(std::vector<unsigned> order){
+			deferred_cch_order.clear();
+			cch = RoutingKit::CustomizableContractionHierarchy(order, this->tail.to_vector(), this->head.to_vector());
+			cch_metric.clear();
+			for(unsigned m = 0; m < get_metric_count(); ++m)
+				if(m != 0 || !has_default_contraction_hierarchy())
+					customize_metric(m);
+		}
+
+		// Whether ch answers the queries of the default metric, see get_contraction_hierarchy
+		bool has_default_contraction_hierarchy() const {
+			return ch_view.node_count() != 0 && ch_view.node_count() == this->node_count;
+		}
+
+		// Drop the customization of the default metric once ch answers its queries
+		void release_default_metric_customization(){
+			if(!cch_metric.empty())
+				cch_metric[0] = RoutingKit::CustomizableContractionHierarchyMetric();
+		}
+
+		// Summary line of a capacity coverage, only when verbose
+		void report_capacity_coverage(unsigned threshold, long long start_time){
+			if(!is_verbose)
+				return;
+			unsigned max_coverage = capacity_coverage_way.empty() ? 0 : *max_element(capacity_coverage_way.begin(),capacity_coverage_way.end());
+			std::cout << "Capacity coverage under " << threshold / 1000 << " seconds computed in " << microseconds_to_readable_time_cout(RoutingKit::get_micro_time() - start_time) << ", at most " << max_coverage << " unit(s) on a road segment" << '\n';
 		}
 
 	};
 
 }
-	    
\ No newline at end of file
+
+// Version 1 of the Graph archive adds the arc geometry, version 2 the compact node store,
+// version 3 the named metrics and version 4 the ids before renumbering
+BOOST_CLASS_VERSION(cms::Graph, 4)
@@ -0,0 +1,316 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <fstream>
+#include <stdexcept>
+
+#include "../utils/const_array.h"
+
+namespace cms {
+
+	/**
+	 * Flat graph file layout (all integers little-endian):
+	 *
+	 *   GraphFileHeader
+	 *   GraphFileSection[section_count]
+	 *   section data, each section starting on a graph_file_alignment boundary
+	 *
+	 * A section is a plain array of fixed size elements identified by its name, so that it
+	 * is read without any parsing: GraphFileView::get gives a view into the mapping and
+	 * GraphFileView::copy a bulk copy of it. Graph serves its node and arc columns as views
+	 * into the mapping, which it keeps open (see Graph::load_from_flat_file): loading does
+	 * not grow with the file size and processes loading the same file share its pages.
+	 *
+	 * Readers ignore the sections they do not know, new sections can therefore be added
+	 * without breaking older readers; a layout change of an existing section requires a new
+	 * graph_file_version.
+	 */
+	const char graph_file_magic[8] = {'C','M','S','G','R','A','P','H'};
+	const uint32_t graph_file_version = 1;
+	const uint32_t graph_file_byte_order_mark = 0x01020304;
+	const uint64_t graph_file_alignment = 64;
+
+	struct GraphFileHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t byte_order_mark;
+		uint64_t section_count;
+	};
+
+	struct GraphFileSection {
+		char name[48];
+		uint64_t offset;		// from the beginning of the file
+		uint64_t element_size;
+		uint64_t element_count;
+	};
+
+	static_assert(sizeof(GraphFileHeader) == 24, "unexpected GraphFileHeader padding");
+	static_assert(sizeof(GraphFileSection) == 72, "unexpected GraphFileSection padding");
+
+	inline void check_graph_file_host_byte_order(){
+		uint32_t probe = graph_file_byte_order_mark;
+		if(*reinterpret_cast<unsigned char*>(&probe) != 0x04)
+			throw std::runtime_error("Flat graph files are only supported on little-endian hosts");
+	}
+
+	/**
+	 * Collect sections and write them as a flat graph file.
+	 * Sections only reference the caller data, which must stay alive until write().
+	 */
+	class GraphFileWriter {
+	  public:
+
+		template<class T>
+		void add(const std::string& name, const T* data, uint64_t count){
+			if(name.size() >= sizeof(GraphFileSection().name))
+				throw std::runtime_error("Flat graph file section name too long: " + name);
+			PendingSection section;
+			section.name = name;
+			section.data = reinterpret_cast<const char*>(data);
+			section.element_size = sizeof(T);
+			section.element_count = count;
+			sections.push_back(section);
+		}
+
+		template<class T>
+		void add(const std::string& name, const std::vector<T>& data){
+			add(name, data.data(), data.size());
+		}
+
+		template<class T>
+		void add(const std::string& name, const ConstArray<T>& data){
+			add(name, data.data(), data.size());
+		}
+
+		void add(const std::string& name, const std::vector<bool>& data){
+			owned_bytes.push_back(std::vector<uint8_t>(data.begin(), data.end()));
+			add(name, owned_bytes.back());
+		}
+
+		/**
+		 * Store a list of strings as an offset section name + ".first_char" and a character
+		 * section name + ".chars".
+		 */
+		void add(const std::string& name, const std::vector<std::string>& data){
+			std::vector<uint64_t> first_char(data.size() + 1, 0);
+			std::vector<uint8_t> chars;
+			for(size_t i = 0; i < data.size(); ++i){
+				chars.insert(chars.end(), data[i].begin(), data[i].end());
+				first_char[i + 1] = chars.size();
+			}
+			owned_offsets.push_back(first_char);
+			owned_bytes.push_back(chars);
+			add(name + ".first_char", owned_offsets.back());
+			add(name + ".chars", owned_bytes.back());
+		}
+
+		void add_scalar(const std::string& name, uint64_t value){
+			owned_offsets.push_back(std::vector<uint64_t>(1, value));
+			add(name, owned_offsets.back());
+		}
+
+		void write(const std::string& filename){
+			check_graph_file_host_byte_order();
+
+			std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+			if(!out)
+				throw std::runtime_error("Unable to open " + filename + " for writing");
+
+			GraphFileHeader header;
+			memcpy(header.magic, graph_file_magic, sizeof(header.magic));
+			header.version = graph_file_version;
+			header.byte_order_mark = graph_file_byte_order_mark;
+			header.section_count = sections.size();
+
+			std::vector<GraphFileSection> table(sections.size());
+			uint64_t offset = align(sizeof(GraphFileHeader) + sections.size() * sizeof(GraphFileSection));
+			for(size_t i = 0; i < sections.size(); ++i){
+				memset(&table[i], 0, sizeof(GraphFileSection));
+				memcpy(table[i].name, sections[i].name.c_str(), sections[i].name.size());
+				table[i].offset = offset;
+				table[i].element_size = sections[i].element_size;
+				table[i].element_count = sections[i].element_count;
+				offset = align(offset + sections[i].element_size * sections[i].element_count);
+			}
+
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			out.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(GraphFileSection));
+			uint64_t position = sizeof(GraphFileHeader) + table.size() * sizeof(GraphFileSection);
+			for(size_t i = 0; i < sections.size(); ++i){
+				pad(out, position, table[i].offset);
+				uint64_t size = sections[i].element_size * sections[i].element_count;
+				out.write(sections[i].data, size);
+				position += size;
+			}
+			pad(out, position, align(position));
+
+			if(!out)
+				throw std::runtime_error("Unable to write " + filename);
+		}
+
+	  private:
+		struct PendingSection {
+			std::string name;
+			const char* data;
+			uint64_t element_size;
+			uint64_t element_count;
+		};
+
+		std::vector<PendingSection> sections;
+		// Converted data (bits, strings, scalars) kept alive until write
+		std::deque< std::vector<uint8_t> > owned_bytes;
+		std::deque< std::vector<uint64_t> > owned_offsets;
+
+		static uint64_t align(uint64_t offset){
+			return (offset + graph_file_alignment - 1) / graph_file_alignment * graph_file_alignment;
+		}
+
+		static void pad(std::ofstream& out, uint64_t& position, uint64_t target){
+			static const char zeros[graph_file_alignment] = {0};
+			out.write(zeros, target - position);
+			position = target;
+		}
+	};
+
+	/**
+	 * Memory-mapped, read-only access to a flat graph file.
+	 */
+	class GraphFileView {
+	  public:
+
+		GraphFileView() : mapping(nullptr), mapping_size(0) {}
+
+		explicit GraphFileView(const std::string& filename) : mapping(nullptr), mapping_size(0) {
+			open(filename);
+		}
+
+		~GraphFileView(){
+			close();
+		}
+
+		GraphFileView(const GraphFileView&) = delete;
+		GraphFileView& operator=(const GraphFileView&) = delete;
+
+		void open(const std::string& filename){
+			close();
+			check_graph_file_host_byte_order();
+
+			int fd = ::open(filename.c_str(), O_RDONLY);
+			if(fd < 0)
+				throw std::runtime_error("Unable to open the flat graph file " + filename);
+			struct stat file_status;
+			if(fstat(fd, &file_status) != 0){
+				::close(fd);
+				throw std::runtime_error("Unable to stat the flat graph file " + filename);
+			}
+			mapping_size = file_status.st_size;
+			if(mapping_size < sizeof(GraphFileHeader)){
+				::close(fd);
+				throw std::runtime_error(filename + " is not a flat graph file");
+			}
+			mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+			::close(fd);
+			if(mapping == MAP_FAILED){
+				mapping = nullptr;
+				throw std::runtime_error("Unable to map the flat graph file " + filename);
+			}
+
+			const GraphFileHeader* header = static_cast<const GraphFileHeader*>(mapping);
+			if(memcmp(header->magic, graph_file_magic, sizeof(graph_file_magic)) != 0){
+				close();
+				throw std::runtime_error(filename + " is not a flat graph file");
+			}
+			if(header->byte_order_mark != graph_file_byte_order_mark){
+				close();
+				throw std::runtime_error(filename + " has been written with another byte order");
+			}
+			if(header->version != graph_file_version){
+				uint32_t version = header->version;
+				close();
+				throw std::runtime_error(filename + " has the unsupported flat graph file version " + std::to_string(version));
+			}
+			if(sizeof(GraphFileHeader) + header->section_count * sizeof(GraphFileSection) > mapping_size){
+				close();
+				throw std::runtime_error(filename + " is truncated");
+			}
+			sections = reinterpret_cast<const GraphFileSection*>(header + 1);
+			section_count = header->section_count;
+			for(uint64_t i = 0; i < section_count; ++i){
+				if(sections[i].offset + sections[i].element_size * sections[i].element_count > mapping_size){
+					close();
+					throw std::runtime_error(filename + " is truncated");
+				}
+			}
+		}
+
+		void close(){
+			if(mapping != nullptr)
+				munmap(mapping, mapping_size);
+			mapping = nullptr;
+			mapping_size = 0;
+			sections = nullptr;
+			section_count = 0;
+		}
+
+		bool has(const std::string& name) const {
+			return find(name) != nullptr;
+		}
+
+		template<class T>
+		ConstArray<T> get(const std::string& name) const {
+			const GraphFileSection* section = find(name);
+			if(section == nullptr)
+				throw std::runtime_error("Missing section " + name + " in the flat graph file");
+			if(section->element_size != sizeof(T))
+				throw std::runtime_error("Unexpected element size for the section " + name + " of the flat graph file");
+			return ConstArray<T>(reinterpret_cast<const T*>(static_cast<const char*>(mapping) + section->offset), section->element_count);
+		}
+
+		template<class T>
+		void copy(const std::string& name, std::vector<T>& destination) const {
+			ConstArray<T> source = get<T>(name);
+			destination.assign(source.begin(), source.end());
+		}
+
+		void copy(const std::string& name, std::vector<bool>& destination) const {
+			ConstArray<uint8_t> source = get<uint8_t>(name);
+			destination.assign(source.begin(), source.end());
+		}
+
+		void copy(const std::string& name, std::vector<std::string>& destination) const {
+			ConstArray<uint64_t> first_char = get<uint64_t>(name + ".first_char");
+			ConstArray<char> chars = get<char>(name + ".chars");
+			destination.resize(first_char.empty() ? 0 : first_char.size() - 1);
+			for(size_t i = 0; i < destination.size(); ++i)
+				destination[i].assign(chars.data() + first_char[i], chars.data() + first_char[i + 1]);
+		}
+
+		uint64_t get_scalar(const std::string& name) const {
+			return get<uint64_t>(name)[0];
+		}
+
+	  private:
+		void* mapping;
+		uint64_t mapping_size;
+		const GraphFileSection* sections = nullptr;
+		uint64_t section_count = 0;
+
+		const GraphFileSection* find(const std::string& name) const {
+			for(uint64_t i = 0; i < section_count; ++i){
+				if(strncmp(sections[i].name, name.c_str(), sizeof(sections[i].name)) == 0)
+					return &sections[i];
+			}
+			return nullptr;
+		}
+	};
+
+}
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <routingkit/constants.h>
+
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <limits>
+
+#include "../utils/instrumentation.h"
+#include "../utils/const_array.h"
+#include "../utils/copy_on_write_array.h"
+
+namespace cms {
+
+	/**
+	 * The <code>IsochroneQuery</code> class runs a Dijkstra search on the road graph that stops
+	 * as soon as the next node to settle is at or above a distance limit.
+	 *
+	 * Its workspace (distances, heap, reached nodes) is allocated once and reused across
+	 * runs: distances are invalidated with a timestamp instead of being cleared, so the work
+	 * of a run only depends on the size of the isochrone, not on the size of the graph.
+	 *
+	 * Usage:
+	 *   query.reset().add_source(s).run(limit);
+	 *   for(unsigned v : query.get_reached_nodes()) ... query.get_distance(v) ...
+	 */
+	class IsochroneQuery {
+	  public:
+
+		IsochroneQuery() : shared_weight(nullptr), current_timestamp(0) {}
+
+		IsochroneQuery(ConstArray<unsigned> first_out, ConstArray<unsigned> head, ConstArray<unsigned> weight) : shared_weight(nullptr), current_timestamp(0) {
+			bind(first_out, head, weight);
+		}
+
+		/**
+		 * Bind the query to a graph given as a forward star (first_out, head) and arc weights.
+		 * The arrays are referenced, not copied, and must outlive the query.
+		 */
+		IsochroneQuery& bind(ConstArray<unsigned> first_out, ConstArray<unsigned> head, ConstArray<unsigned> weight) {
+			this->first_out = first_out;
+			this->head = head;
+			this->weight = weight;
+			this->shared_weight = nullptr;
+			return reset();
+		}
+
+		/**
+		 * Same as bind with arc weights whose chunks are shared with other copies, e.g. those
+		 * of a LiveMetric snapshot.
+		 */
+		IsochroneQuery& bind(ConstArray<unsigned> first_out, ConstArray<unsigned> head, const CopyOnWriteArray<unsigned>& weight) {
+			this->first_out = first_out;
+			this->head = head;
+			this->weight = ConstArray<unsigned>();
+			this->shared_weight = &weight;
+			return reset();
+		}
+
+		bool is_bound() const {
+			return !first_out.empty();
+		}
+
+		/**
+		 * Forget the sources and the result of the previous run, O(1) amortized.
+		 */
+		IsochroneQuery& reset() {
+			ensure_workspace();
+			if(current_timestamp == std::numeric_limits<unsigned>::max()){
+				std::fill(timestamp.begin(), timestamp.end(), 0);
+				std::fill(settled_timestamp.begin(), settled_timestamp.end(), 0);
+				current_timestamp = 0;
+			}
+			++current_timestamp;
+			queue.clear();
+			reached.clear();
+			return *this;
+		}
+
+		/**
+		 * Add a source node, optionally with an initial distance (e.g. the time needed to
+		 * reach the node from a position in the middle of an arc).
+		 */
+		IsochroneQuery& add_source(unsigned source, unsigned source_distance = 0) {
+			if(source_distance < tentative_distance(source)){
+				set_distance(source, source_distance);
+				queue.push_back(QueueItem(source_distance, source));
+				std::push_heap(queue.begin(), queue.end(), std::greater<QueueItem>());
+			}
+			return *this;
+		}
+
+		/**
+		 * Settle every node whose distance to the sources is strictly lower than limit.
+		 */
+		IsochroneQuery& run(unsigned limit = RoutingKit::inf_weight) {
+			if(!is_bound())
+				throw std::runtime_error("IsochroneQuery is not bound to a graph");
+
+			CMS_COUNTER_ADD("isochrone.runs", 1);
+#ifdef CMS_INSTRUMENTATION
+			unsigned first_reached = reached.size();
+#endif
+
+			if(shared_weight != nullptr)
+				settle(limit, *shared_weight);
+			else
+				settle(limit, weight);
+
+			CMS_COUNTER_ADD("isochrone.settled_nodes", reached.size() - first_reached);
+			return *this;
+		}
+
+		/**
+		 * Nodes settled by the last run, in increasing distance order.
+		 */
+		const std::vector<unsigned>& get_reached_nodes() const {
+			return reached;
+		}
+
+		bool is_reached(unsigned node) const {
+			return is_settled(node);
+		}
+
+		/**
+		 * Distance of a node settled by the last run, RoutingKit::inf_weight otherwise.
+		 */
+		unsigned get_distance(unsigned node) const {
+			return is_settled(node) ? distance[node] : RoutingKit::inf_weight;
+		}
+
+	  private:
+		typedef std::pair<unsigned, unsigned> QueueItem; // <distance, node>
+
+		ConstArray<unsigned> first_out;
+		ConstArray<unsigned> head;
+		ConstArray<unsigned> weight;
+		const CopyOnWriteArray<unsigned>* shared_weight; // instead of weight when not null
+
+		std::vector<unsigned> distance;
+		std::vector<unsigned> timestamp;
+		std::vector<unsigned> settled_timestamp;
+		unsigned current_timestamp;
+
+		std::vector<QueueItem> queue;
+		std::vector<unsigned> reached;
+
+		// Settle the nodes under limit, the arcs weighing arc_weight[a]
+		template<class Weight>
+		void settle(unsigned limit, const Weight& arc_weight) {
+			while(!queue.empty()){
+				std::pop_heap(queue.begin(), queue.end(), std::greater<QueueItem>());
+				QueueItem item = queue.back();
+				queue.pop_back();
+
+				unsigned x = item.second;
+				// Stale entry of an already improved node
+				if(item.first != distance[x] || is_settled(x))
+					continue;
+				// Every remaining node is at least as far: stop here
+				if(item.first >= limit){
+					queue.clear();
+					break;
+				}
+
+				settled_timestamp[x] = current_timestamp;
+				reached.push_back(x);
+
+				for(unsigned a = first_out[x]; a < first_out[x+1]; ++a){
+					unsigned y = head[a];
+					unsigned w = arc_weight[a];
+					if(w == RoutingKit::inf_weight)
+						continue;
+					unsigned d = item.first + w;
+					if(d < item.first) // overflow
+						continue;
+					if(d < limit && d < tentative_distance(y)){
+						set_distance(y, d);
+						queue.push_back(QueueItem(d, y));
+						std::push_heap(queue.begin(), queue.end(), std::greater<QueueItem>());
+					}
+				}
+			}
+		}
+
+		bool is_settled(unsigned node) const {
+			return settled_timestamp[node] == current_timestamp;
+		}
+
+		unsigned tentative_distance(unsigned node) const {
+			return timestamp[node] == current_timestamp ? distance[node] : RoutingKit::inf_weight;
+		}
+
+		void set_distance(unsigned node, unsigned d) {
+			distance[node] = d;
+			timestamp[node] = current_timestamp;
+		}
+
+		// (Re)allocate the workspace if the bound graph changed size
+		void ensure_workspace() {
+			if(first_out.empty())
+				return;
+			unsigned node_count = first_out.size() - 1;
+			if(distance.size() != node_count){
+				distance.assign(node_count, RoutingKit::inf_weight);
+				timestamp.assign(node_count, 0);
+				settled_timestamp.assign(node_count, 0);
+				current_timestamp = 0;
+			}
+		}
+	};
+
+}
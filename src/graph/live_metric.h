@@ -0,0 +1,258 @@
+#pragma once
+
+#include "graph.h"
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <limits>
+#include <stdexcept>
+
+namespace cms {
+
+	/**
+	 * New travel time of an arc, in milliseconds. RoutingKit::inf_weight closes the arc.
+	 */
+	struct ArcWeightUpdate {
+		unsigned arc;
+		unsigned travel_time;
+
+		ArcWeightUpdate(unsigned arc, unsigned travel_time) : arc(arc), travel_time(travel_time) {}
+	};
+
+	/**
+	 * The <code>LiveMetric</code> class applies road closures and congestion to a metric of a
+	 * GraphCH while coverage queries keep running.
+	 *
+	 * The current weights are published as an immutable Snapshot: the arc travel times and,
+	 * on request (see the constructor), the weights of the customizable contraction hierarchy
+	 * of the graph customized for them, for PHAST. A query takes a snapshot once and uses it
+	 * to the end, so it never sees half of an update.
+	 *
+	 * Updates are queued and applied by a background thread. Updates queued while a batch is
+	 * in progress are merged in the next batch. The travel times of a snapshot share their
+	 * chunks with the previous one (see CopyOnWriteArray), only the chunks holding changed
+	 * arcs are copied; likewise only the part of the customizable contraction hierarchy above
+	 * the changed arcs is customized again. The new snapshot then replaces the previous one
+	 * atomically. A snapshot stays valid as long as a query holds it.
+	 */
+	class LiveMetric {
+	  public:
+
+		struct Snapshot {
+			uint64_t version;							// number of update batches applied
+			CopyOnWriteArray<unsigned> travel_time;		// arc travel times in milliseconds
+			std::vector<unsigned> forward_weight;		// customized weights of the up arcs of the
+			std::vector<unsigned> backward_weight;		// customizable contraction hierarchy
+			ContractionHierarchyView ch;				// over them, empty unless published
+
+			Snapshot() : version(0) {}
+			Snapshot(const Snapshot&) = delete;			// ch views the weights of the snapshot
+
+			bool has_contraction_hierarchy() const { return ch.node_count() != 0; }
+		};
+
+		/**
+		 * Publish the current weights of a metric of graph. graph must outlive the live metric
+		 * and its topology must not change meanwhile.
+		 *
+		 * @param is_hierarchy_published Whether the snapshots also hold the customized weights
+		 * of the customizable contraction hierarchy of graph, for PHAST. The hierarchy is then
+		 * customized for every batch of updates; queries on the travel times alone don't need it.
+		 */
+		explicit LiveMetric(GraphCH& graph, unsigned metric = 0, bool is_hierarchy_published = false)
+			: graph(graph), metric(metric), base_travel_time(graph.get_metric_travel_time(metric).to_vector()),
+			  travel_time(base_travel_time), cch(nullptr), submitted_version(0), applied_version(0), is_stop_requested(false)
+		{
+			long long start_time = RoutingKit::get_micro_time();
+
+			std::shared_ptr<Snapshot> first(new Snapshot);
+			first->travel_time = travel_time;
+			if(is_hierarchy_published){
+				cch = &graph.get_customizable_contraction_hierarchy();
+				customized_travel_time = base_travel_time;
+				cch_metric.reset(*cch, customized_travel_time);
+				cch_metric.customize();
+				partial_customization.reset(*cch);
+				publish_hierarchy(*first);
+			}
+			std::atomic_store(&snapshot, std::shared_ptr<const Snapshot>(first));
+
+			updater = std::thread([this]{ run_updater(); });
+
+			cout_message("Live metric " + graph.get_metric_name(metric) + " ready in " + microseconds_to_readable_time_cout(RoutingKit::get_micro_time() - start_time));
+		}
+
+		~LiveMetric() {
+			{
+				std::lock_guard<std::mutex> lock(update_mutex);
+				is_stop_requested = true;
+			}
+			update_changed.notify_all();
+			updater.join();
+		}
+
+		LiveMetric(const LiveMetric&) = delete;
+		LiveMetric& operator=(const LiveMetric&) = delete;
+
+		/**
+		 * Latest published weights. Cheap, safe to call from any thread.
+		 */
+		std::shared_ptr<const Snapshot> get_snapshot() const {
+			return std::atomic_load(&snapshot);
+		}
+
+		unsigned get_metric() const {
+			return metric;
+		}
+
+		/**
+		 * Queue arc weight changes, applied in the background.
+		 *
+		 * @return Version of the first snapshot including them, see wait_for_version.
+		 */
+		uint64_t update_arcs(const std::vector<ArcWeightUpdate>& updates) {
+			for(const ArcWeightUpdate& update : updates){
+				if(update.arc >= graph.arc_count)
+					throw std::runtime_error("Invalid arc " + std::to_string(update.arc));
+			}
+			uint64_t version;
+			{
+				std::lock_guard<std::mutex> lock(update_mutex);
+				pending_updates.insert(pending_updates.end(), updates.begin(), updates.end());
+				version = ++submitted_version;
+			}
+			update_changed.notify_all();
+			return version;
+		}
+
+		/**
+		 * Close arcs (e.g. a closed bridge): they are no longer crossed by any unit.
+		 */
+		uint64_t close_arcs(const std::vector<unsigned>& arcs) {
+			std::vector<ArcWeightUpdate> updates;
+			for(unsigned a : arcs)
+				updates.emplace_back(a, RoutingKit::inf_weight);
+			return update_arcs(updates);
+		}
+
+		/**
+		 * Multiply the base travel time of arcs by factor (e.g. 3 for a jam).
+		 */
+		uint64_t slow_down_arcs(const std::vector<unsigned>& arcs, double factor) {
+			if(!(factor > 0))
+				throw std::runtime_error("The slow down factor must be positive");
+			std::vector<ArcWeightUpdate> updates;
+			for(unsigned a : arcs){
+				if(a >= graph.arc_count)
+					throw std::runtime_error("Invalid arc " + std::to_string(a));
+				double slowed = base_travel_time[a] * factor;
+				updates.emplace_back(a, slowed >= RoutingKit::inf_weight ? RoutingKit::inf_weight - 1 : (unsigned)slowed);
+			}
+			return update_arcs(updates);
+		}
+
+		/**
+		 * Give arcs back the travel time of the metric in the graph.
+		 */
+		uint64_t restore_arcs(const std::vector<unsigned>& arcs) {
+			std::vector<ArcWeightUpdate> updates;
+			for(unsigned a : arcs){
+				if(a >= graph.arc_count)
+					throw std::runtime_error("Invalid arc " + std::to_string(a));
+				updates.emplace_back(a, base_travel_time[a]);
+			}
+			return update_arcs(updates);
+		}
+
+		/**
+		 * Block until the snapshot of the given version (or a later one) is published.
+		 */
+		void wait_for_version(uint64_t version) {
+			std::unique_lock<std::mutex> lock(update_mutex);
+			version_published.wait(lock, [&]{ return applied_version >= version; });
+		}
+
+	  private:
+		const GraphCH& graph;
+		unsigned metric;
+		const std::vector<unsigned> base_travel_time;
+
+		// Weights being updated, only touched by the updater thread after construction: the
+		// travel times share their unchanged chunks with the latest snapshot, the customized
+		// ones are only kept when the hierarchy is published (cch not null)
+		CopyOnWriteArray<unsigned> travel_time;
+		const RoutingKit::CustomizableContractionHierarchy* cch;
+		std::vector<unsigned> customized_travel_time;
+		RoutingKit::CustomizableContractionHierarchyMetric cch_metric;
+		RoutingKit::CustomizableContractionHierarchyPartialCustomization partial_customization;
+
+		std::shared_ptr<const Snapshot> snapshot;
+
+		std::mutex update_mutex;
+		std::condition_variable update_changed;
+		std::condition_variable version_published;
+		std::vector<ArcWeightUpdate> pending_updates;
+		uint64_t submitted_version;
+		uint64_t applied_version;
+		bool is_stop_requested;
+		std::thread updater;
+
+		void run_updater() {
+			std::vector<ArcWeightUpdate> updates;
+			while(true){
+				uint64_t version;
+				{
+					std::unique_lock<std::mutex> lock(update_mutex);
+					update_changed.wait(lock, [&]{ return !pending_updates.empty() || is_stop_requested; });
+					if(is_stop_requested)
+						return;
+					updates.swap(pending_updates);
+					version = submitted_version;
+				}
+
+				long long start_time = RoutingKit::get_micro_time();
+
+				// Later updates of an arc override the earlier ones
+				std::shared_ptr<Snapshot> next(new Snapshot);
+				next->version = version;
+				if(cch != nullptr)
+					partial_customization.reset();
+				for(const ArcWeightUpdate& update : updates){
+					if(travel_time[update.arc] == update.travel_time)
+						continue;
+					travel_time.set(update.arc, update.travel_time);
+					if(cch != nullptr){
+						customized_travel_time[update.arc] = update.travel_time;
+						partial_customization.update_arc(update.arc);
+					}
+				}
+				next->travel_time = travel_time;
+				if(cch != nullptr){
+					partial_customization.customize(cch_metric);
+					publish_hierarchy(*next);
+				}
+
+				std::atomic_store(&snapshot, std::shared_ptr<const Snapshot>(next));
+				{
+					std::lock_guard<std::mutex> lock(update_mutex);
+					applied_version = version;
+				}
+				version_published.notify_all();
+
+				cout_message("Live metric " + graph.get_metric_name(metric) + ": " + std::to_string(updates.size()) + " arc update(s) published as version " + std::to_string(version) + " in " + microseconds_to_readable_time_cout(RoutingKit::get_micro_time() - start_time));
+				updates.clear();
+			}
+		}
+
+		// Copy the customized weights into a snapshot and view them
+		void publish_hierarchy(Snapshot& next) {
+			next.forward_weight = cch_metric.forward;
+			next.backward_weight = cch_metric.backward;
+			next.ch = ContractionHierarchyView(*cch, next.forward_weight, next.backward_weight);
+		}
+	};
+
+}
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <routingkit/constants.h>
+
+#include <vector>
+#include <tuple>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <limits>
+
+#include "../utils/instrumentation.h"
+#include "../utils/const_array.h"
+
+namespace cms {
+
+	/**
+	 * The <code>NearestUnitsQuery</code> class runs one multi-source label-setting search that
+	 * finds, for every node, the k units reaching it first: their arrival times and ids, in
+	 * increasing (arrival time, unit) order.
+	 *
+	 * A node keeps at most k labels (arrival time, unit), one per unit. The labels leave the
+	 * queue in increasing (arrival time, unit) order, and a label only spreads from a node
+	 * where it is among the k best: a unit among the k nearest of a node is among the k
+	 * nearest of every node of its shortest path to it, so the search is exact. Each node is
+	 * settled at most k times, the work grows with k and not with the number of units.
+	 *
+	 * As IsochroneQuery, its workspace is allocated once and invalidated with a timestamp.
+	 *
+	 * Usage:
+	 *   query.reset(k).add_source(s, unit).run(limit);
+	 *   for(unsigned v : query.get_reached_nodes())
+	 *     for(unsigned i = 0; i < query.get_label_count(v); ++i)
+	 *       ... query.get_arrival_time(v, i) ... query.get_unit(v, i) ...
+	 */
+	class NearestUnitsQuery {
+	  public:
+
+		NearestUnitsQuery() : label_capacity(1), current_timestamp(0) {}
+
+		NearestUnitsQuery(ConstArray<unsigned> first_out, ConstArray<unsigned> head, ConstArray<unsigned> weight) : label_capacity(1), current_timestamp(0) {
+			bind(first_out, head, weight);
+		}
+
+		/**
+		 * Bind the query to a graph given as a forward star (first_out, head) and arc weights.
+		 * The arrays are referenced, not copied, and must outlive the query.
+		 */
+		NearestUnitsQuery& bind(ConstArray<unsigned> first_out, ConstArray<unsigned> head, ConstArray<unsigned> weight) {
+			this->first_out = first_out;
+			this->head = head;
+			this->weight = weight;
+			return reset(label_capacity);
+		}
+
+		bool is_bound() const {
+			return !first_out.empty();
+		}
+
+		/**
+		 * Forget the sources and the result of the previous run, O(1) amortized unless k
+		 * changes.
+		 *
+		 * @param k Labels kept per node, at least 1.
+		 */
+		NearestUnitsQuery& reset(unsigned k) {
+			if(k == 0)
+				throw std::runtime_error("NearestUnitsQuery needs at least one label per node");
+			if(k != label_capacity){
+				label_capacity = k;
+				arrival_time.clear();
+			}
+			ensure_workspace();
+			if(current_timestamp == std::numeric_limits<unsigned>::max()){
+				std::fill(timestamp.begin(), timestamp.end(), 0);
+				current_timestamp = 0;
+			}
+			++current_timestamp;
+			queue.clear();
+			reached.clear();
+			return *this;
+		}
+
+		/**
+		 * Add a source of a unit, optionally with an initial arrival time (e.g. the time
+		 * needed to reach the node from a position in the middle of an arc). A unit may have
+		 * several sources.
+		 */
+		NearestUnitsQuery& add_source(unsigned source, unsigned unit, unsigned source_time = 0) {
+			queue.push_back(QueueItem(source_time, unit, source));
+			std::push_heap(queue.begin(), queue.end(), std::greater<QueueItem>());
+			return *this;
+		}
+
+		/**
+		 * Settle the k best labels of every node among those strictly under limit.
+		 */
+		NearestUnitsQuery& run(unsigned limit = RoutingKit::inf_weight) {
+			if(!is_bound())
+				throw std::runtime_error("NearestUnitsQuery is not bound to a graph");
+
+			CMS_COUNTER_ADD("nearest_units.runs", 1);
+#ifdef CMS_INSTRUMENTATION
+			unsigned long long settled_count = 0;
+#endif
+
+			while(!queue.empty()){
+				std::pop_heap(queue.begin(), queue.end(), std::greater<QueueItem>());
+				QueueItem item = queue.back();
+				queue.pop_back();
+
+				unsigned time = std::get<0>(item), unit = std::get<1>(item), x = std::get<2>(item);
+				// Every remaining label is at least as late: stop here
+				if(time >= limit){
+					queue.clear();
+					break;
+				}
+				// Node already full, or already reached earlier by the unit
+				if(!can_settle(x, unit))
+					continue;
+
+				settle(x, time, unit);
+#ifdef CMS_INSTRUMENTATION
+				++settled_count;
+#endif
+
+				for(unsigned a = first_out[x]; a < first_out[x+1]; ++a){
+					unsigned y = head[a];
+					unsigned w = weight[a];
+					if(w == RoutingKit::inf_weight)
+						continue;
+					unsigned t = time + w;
+					if(t < time) // overflow
+						continue;
+					if(t < limit && can_settle(y, unit)){
+						queue.push_back(QueueItem(t, unit, y));
+						std::push_heap(queue.begin(), queue.end(), std::greater<QueueItem>());
+					}
+				}
+			}
+			CMS_COUNTER_ADD("nearest_units.settled_labels", settled_count);
+			return *this;
+		}
+
+		/**
+		 * Labels kept per node, the k of reset.
+		 */
+		unsigned get_label_capacity() const {
+			return label_capacity;
+		}
+
+		/**
+		 * Nodes reached by at least one unit during the last run, in the order of their first
+		 * arrival.
+		 */
+		const std::vector<unsigned>& get_reached_nodes() const {
+			return reached;
+		}
+
+		/**
+		 * Number of units, at most k, that reached the node under the limit.
+		 */
+		unsigned get_label_count(unsigned node) const {
+			return timestamp[node] == current_timestamp ? label_count[node] : 0;
+		}
+
+		/**
+		 * Arrival time of the i-th unit reaching the node, RoutingKit::inf_weight if fewer
+		 * units reached it.
+		 */
+		unsigned get_arrival_time(unsigned node, unsigned i) const {
+			return i < get_label_count(node) ? arrival_time[(size_t)node * label_capacity + i] : RoutingKit::inf_weight;
+		}
+
+		/**
+		 * Id of the i-th unit reaching the node, RoutingKit::invalid_id if fewer units reached
+		 * it.
+		 */
+		unsigned get_unit(unsigned node, unsigned i) const {
+			return i < get_label_count(node) ? unit_id[(size_t)node * label_capacity + i] : RoutingKit::invalid_id;
+		}
+
+	  private:
+		typedef std::tuple<unsigned, unsigned, unsigned> QueueItem; // <arrival time, unit, node>
+
+		ConstArray<unsigned> first_out;
+		ConstArray<unsigned> head;
+		ConstArray<unsigned> weight;
+
+		unsigned label_capacity;
+		// Labels of node x: arrival_time/unit_id[x*k..x*k+label_count[x])
+		std::vector<unsigned> arrival_time;
+		std::vector<unsigned> unit_id;
+		std::vector<unsigned> label_count;
+		std::vector<unsigned> timestamp;
+		unsigned current_timestamp;
+
+		std::vector<QueueItem> queue;
+		std::vector<unsigned> reached;
+
+		bool can_settle(unsigned node, unsigned unit) const {
+			unsigned count = get_label_count(node);
+			if(count == label_capacity)
+				return false;
+			const unsigned* units = unit_id.data() + (size_t)node * label_capacity;
+			return std::find(units, units + count, unit) == units + count;
+		}
+
+		void settle(unsigned node, unsigned time, unsigned unit) {
+			if(timestamp[node] != current_timestamp){
+				timestamp[node] = current_timestamp;
+				label_count[node] = 0;
+				reached.push_back(node);
+			}
+			size_t i = (size_t)node * label_capacity + label_count[node]++;
+			arrival_time[i] = time;
+			unit_id[i] = unit;
+		}
+
+		// (Re)allocate the workspace if the bound graph or k changed size
+		void ensure_workspace() {
+			if(first_out.empty())
+				return;
+			unsigned node_count = first_out.size() - 1;
+			if(label_count.size() != node_count || arrival_time.size() != (size_t)node_count * label_capacity){
+				arrival_time.assign((size_t)node_count * label_capacity, RoutingKit::inf_weight);
+				unit_id.assign((size_t)node_count * label_capacity, RoutingKit::invalid_id);
+				label_count.assign(node_count, 0);
+				timestamp.assign(node_count, 0);
+				current_timestamp = 0;
+			}
+		}
+	};
+
+}
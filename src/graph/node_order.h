@@ -0,0 +1,65 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+#include "../utils/const_array.h"
+
+namespace cms {
+
+	/**
+	 * Index of the cell (x, y) along a Hilbert curve filling a 2^bits x 2^bits grid.
+	 * Consecutive indexes are neighbouring cells, and cells close on the curve are close
+	 * on the grid.
+	 */
+	inline uint64_t get_hilbert_index(uint32_t x, uint32_t y, unsigned bits) {
+		uint64_t index = 0;
+		for(uint32_t s = 1u << (bits - 1); s > 0; s >>= 1){
+			uint32_t rx = (x & s) ? 1 : 0;
+			uint32_t ry = (y & s) ? 1 : 0;
+			index += (uint64_t)s * s * ((3 * rx) ^ ry);
+			// Rotate the quadrant so that the curve stays continuous
+			if(ry == 0){
+				if(rx == 1){
+					x = s - 1 - (x & (s - 1));
+					y = s - 1 - (y & (s - 1));
+				}
+				std::swap(x, y);
+			}
+		}
+		return index;
+	}
+
+	/**
+	 * Order of the nodes along a Hilbert curve over their bounding box: order[i] is the
+	 * node placed at position i. Nodes of the same cell keep their relative order.
+	 */
+	inline std::vector<unsigned> compute_hilbert_curve_node_order(ConstArray<float> latitude, ConstArray<float> longitude) {
+		const unsigned bits = 16;
+		unsigned node_count = latitude.size();
+		std::vector<unsigned> order(node_count);
+		if(node_count == 0)
+			return order;
+
+		float min_latitude = *std::min_element(latitude.begin(), latitude.end());
+		float max_latitude = *std::max_element(latitude.begin(), latitude.end());
+		float min_longitude = *std::min_element(longitude.begin(), longitude.end());
+		float max_longitude = *std::max_element(longitude.begin(), longitude.end());
+		double cell_count = (double)((1u << bits) - 1);
+		double latitude_scale = max_latitude > min_latitude ? cell_count / (max_latitude - min_latitude) : 0;
+		double longitude_scale = max_longitude > min_longitude ? cell_count / (max_longitude - min_longitude) : 0;
+
+		std::vector<uint64_t> key(node_count);
+		for(unsigned x = 0; x < node_count; ++x){
+			uint32_t cell_x = (uint32_t)((longitude[x] - min_longitude) * longitude_scale);
+			uint32_t cell_y = (uint32_t)((latitude[x] - min_latitude) * latitude_scale);
+			key[x] = get_hilbert_index(cell_x, cell_y, bits);
+		}
+		for(unsigned x = 0; x < node_count; ++x)
+			order[x] = x;
+		std::stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b){ return key[a] < key[b]; });
+		return order;
+	}
+
+}
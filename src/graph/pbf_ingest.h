@@ -0,0 +1,298 @@
+#pragma once
+
+#include <routingkit/osm_graph_builder.h>
+#include <routingkit/osm_profile.h>
+#include <routingkit/tag_map.h>
+#include <routingkit/geo_dist.h>
+#include <routingkit/constants.h>
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <numeric>
+
+#include "../osmpbfreader/osmpbfreader.h"
+#include "../utils/utils.h"
+
+namespace cms {
+
+	/**
+	 * The <code>PBFIngest</code> class builds the car routing graph of an .osm.pbf file and
+	 * feeds an osmpbfreader::Routing visitor from a single decoding pass over the file.
+	 *
+	 * Each blob is inflated and parsed once by osmpbfreader; the callbacks are forwarded to
+	 * the Routing visitor and the car ways collected in a compact cache (node lists and
+	 * profile attributes). The node coordinates are only stored once, in the NodeStore of
+	 * the Routing visitor, which keeps the nodes of its ways and of the car ways once the
+	 * file is decoded. The routing graph is then
+	 * built from that cache following the rules of the RoutingKit graph builder:
+	 *  - a car way is a way accepted by RoutingKit::is_osm_way_used_by_cars,
+	 *  - a node is a routing node if it ends a car way or is used twice by car ways, the
+	 *    other nodes of car ways are modelling nodes,
+	 *  - routing nodes and ways are numbered by increasing OSM id,
+	 *  - an arc joins two consecutive routing nodes of a way, in the directions given by
+	 *    RoutingKit::get_osm_car_direction_category, with its geo distance and its
+	 *    modelling nodes (uncompressed geometry).
+	 * Nodes missing from the extract are dropped from the ways referencing them.
+	 */
+	class PBFIngest {
+	  public:
+
+		// Outputs of run()
+		RoutingKit::OSMRoutingGraph graph;
+		std::vector<uint32_t> way_speed;
+		std::vector<std::string> way_name;
+		std::vector<uint64_t> way_osmid;
+
+		/**
+		 * Keep the node coordinates of the decoding pass, in the store of the Routing
+		 * visitor, in temporary files of directory beyond memory_budget bytes.
+		 */
+		void use_disk_for_nodes(const std::string& directory, uint64_t memory_budget) {
+			node_swap_directory = directory;
+			node_memory_budget = memory_budget;
+		}
+
+		/**
+		 * Decode pbf_file once, forwarding every element to routing_visitor, and build graph.
+		 *
+		 * @param thread_count Threads decoding the blobs, 0 uses every core.
+		 */
+		void run(const std::string& pbf_file, osmpbfreader::Routing& routing_visitor, unsigned thread_count = 0) {
+			this->routing_visitor = &routing_visitor;
+			if(node_memory_budget > 0)
+				routing_visitor.nodes.use_disk(node_swap_directory, node_memory_budget);
+
+			long long start_time = RoutingKit::get_micro_time();
+			osmpbfreader::read_osm_pbf(pbf_file, *this, thread_count);
+			cout_message("PBF decoded in a single pass in " + microseconds_to_readable_time_cout(RoutingKit::get_micro_time() - start_time));
+
+			start_time = RoutingKit::get_micro_time();
+			keep_referenced_nodes();
+			build_graph();
+			cout_message("Routing graph built in " + microseconds_to_readable_time_cout(RoutingKit::get_micro_time() - start_time));
+
+			this->routing_visitor = nullptr;
+			clear_cache();
+		}
+
+		// osmpbfreader visitor interface, tags are read in place in the string table of the blocks
+		static const osmpbfreader::TagPolicy tag_policy = osmpbfreader::TagPolicy::view;
+
+		void node_callback(uint64_t osmid, double lon, double lat, const osmpbfreader::TagView& tags) {
+			// Stored by the visitor only, see keep_referenced_nodes
+			routing_visitor->node_callback(osmid, lon, lat, tags);
+		}
+
+		void way_callback(uint64_t osmid, const osmpbfreader::TagView& tags, const std::vector<uint64_t>& refs) {
+			routing_visitor->way_callback(osmid, tags, refs);
+
+			RoutingKit::TagMap tag_map = to_tag_map(tags);
+			if(!RoutingKit::is_osm_way_used_by_cars(osmid, tag_map, cout_message))
+				return;
+
+			CachedWay way;
+			way.osmid = osmid;
+			way.speed = RoutingKit::get_osm_way_speed(osmid, tag_map, cout_message);
+			way.name = RoutingKit::get_osm_way_name(osmid, tag_map, cout_message);
+			way.direction = RoutingKit::get_osm_car_direction_category(osmid, tag_map, cout_message);
+			way.first_ref = way_ref.size();
+			way_ref.insert(way_ref.end(), refs.begin(), refs.end());
+			way.last_ref = way_ref.size();
+			ways.push_back(way);
+		}
+
+		void relation_callback(uint64_t osmid, const osmpbfreader::TagView& tags, const osmpbfreader::References& refs) {
+			routing_visitor->relation_callback(osmid, tags, refs);
+		}
+
+	  private:
+		struct CachedWay {
+			uint64_t osmid;
+			uint32_t speed;
+			std::string name;
+			RoutingKit::OSMWayDirectionCategory direction;
+			uint64_t first_ref;	// range in way_ref
+			uint64_t last_ref;
+		};
+
+		osmpbfreader::Routing* routing_visitor = nullptr;
+
+		std::string node_swap_directory;
+		uint64_t node_memory_budget = 0;
+
+		// Decoded cache, the nodes being those of the Routing visitor
+		const osmpbfreader::NodeStore* nodes = nullptr;
+		std::vector<CachedWay> ways;
+		std::vector<uint64_t> way_ref;
+
+		static RoutingKit::TagMap to_tag_map(const osmpbfreader::TagView& tags) {
+			std::vector<const char*> key, value;
+			key.reserve(tags.size());
+			value.reserve(tags.size());
+			for(int i = 0; i < tags.size(); ++i){
+				key.push_back(tags.key(i).c_str());
+				value.push_back(tags.value(i).c_str());
+			}
+			RoutingKit::TagMap tag_map;
+			tag_map.build(key.size(), key.data(), value.data());
+			return tag_map;
+		}
+
+		void clear_cache() {
+			nodes = nullptr;
+			std::vector<CachedWay>().swap(ways);
+			std::vector<uint64_t>().swap(way_ref);
+		}
+
+		// Coordinates of the node of index i in the cache, as RoutingKit stores them
+		float node_latitude(unsigned i) const { return nodes->latitude(i); }
+		float node_longitude(unsigned i) const { return nodes->longitude(i); }
+
+		// Drop the nodes of the shared store that neither the ways of the visitor nor the car
+		// ways refer to (a car way, e.g. a ferry, may have no highway tag)
+		void keep_referenced_nodes() {
+			std::vector<uint64_t> referenced(way_ref);
+			for(const std::vector<uint64_t>& refs : routing_visitor->ways)
+				referenced.insert(referenced.end(), refs.begin(), refs.end());
+			routing_visitor->nodes.keep_only(std::move(referenced));
+			nodes = &routing_visitor->nodes;
+		}
+
+		void build_graph() {
+
+			// Routing ways by increasing OSM id
+			std::sort(ways.begin(), ways.end(), [](const CachedWay& a, const CachedWay& b){ return a.osmid < b.osmid; });
+			unsigned routing_way_count = ways.size();
+			way_speed.resize(routing_way_count);
+			way_name.resize(routing_way_count);
+			way_osmid.resize(routing_way_count);
+
+			// Replace the OSM node ids of the ways by cache indexes, dropping the missing nodes
+			for(CachedWay& way : ways){
+				uint64_t kept = way.first_ref;
+				for(uint64_t i = way.first_ref; i < way.last_ref; ++i){
+					uint64_t node = nodes->find(way_ref[i]);
+					if(node != osmpbfreader::invalid_index)
+						way_ref[kept++] = node;
+				}
+				way.last_ref = kept;
+			}
+
+			// Routing nodes: way extremities and nodes used twice
+			const uint8_t unused = 0, modelling = 1, routing = 2;
+			std::vector<uint8_t> node_kind(nodes->size(), unused);
+			for(const CachedWay& way : ways){
+				if(way.last_ref - way.first_ref < 2)
+					continue;
+				node_kind[way_ref[way.first_ref]] = routing;
+				node_kind[way_ref[way.last_ref - 1]] = routing;
+				for(uint64_t i = way.first_ref; i < way.last_ref; ++i){
+					uint8_t& kind = node_kind[way_ref[i]];
+					kind = (kind == unused) ? modelling : routing;
+				}
+			}
+
+			std::vector<unsigned> routing_node(nodes->size(), RoutingKit::invalid_id);
+			unsigned node_count = 0;
+			graph.latitude.clear();
+			graph.longitude.clear();
+			for(unsigned i = 0; i < nodes->size(); ++i){
+				if(node_kind[i] == routing){
+					routing_node[i] = node_count++;
+					graph.latitude.push_back(node_latitude(i));
+					graph.longitude.push_back(node_longitude(i));
+				}
+			}
+
+			// Arcs in way order, sorted by tail afterwards
+			struct Arc {
+				unsigned tail, head, way, geo_distance;
+				bool is_antiparallel;
+				uint64_t first_modelling, last_modelling; // range in way_ref, reversed if antiparallel
+			};
+			std::vector<Arc> arcs;
+
+			for(unsigned w = 0; w < routing_way_count; ++w){
+				const CachedWay& way = ways[w];
+				way_speed[w] = way.speed;
+				way_name[w] = way.name;
+				way_osmid[w] = way.osmid;
+
+				bool is_forward_open = way.direction == RoutingKit::OSMWayDirectionCategory::only_open_forwards || way.direction == RoutingKit::OSMWayDirectionCategory::open_in_both;
+				bool is_backward_open = way.direction == RoutingKit::OSMWayDirectionCategory::only_open_backwards || way.direction == RoutingKit::OSMWayDirectionCategory::open_in_both;
+				if(way.last_ref - way.first_ref < 2 || (!is_forward_open && !is_backward_open))
+					continue;
+
+				uint64_t segment_start = way.first_ref;
+				double distance = 0;
+				for(uint64_t i = way.first_ref + 1; i < way.last_ref; ++i){
+					unsigned previous = way_ref[i-1], current = way_ref[i];
+					distance += RoutingKit::geo_dist(node_latitude(previous), node_longitude(previous), node_latitude(current), node_longitude(current));
+					if(node_kind[current] != routing)
+						continue;
+
+					Arc arc;
+					arc.way = w;
+					arc.geo_distance = (unsigned)distance;
+					arc.first_modelling = segment_start + 1;
+					arc.last_modelling = i;
+					unsigned from = routing_node[way_ref[segment_start]], to = routing_node[current];
+					if(is_forward_open){
+						arc.tail = from;
+						arc.head = to;
+						arc.is_antiparallel = false;
+						arcs.push_back(arc);
+					}
+					if(is_backward_open){
+						arc.tail = to;
+						arc.head = from;
+						arc.is_antiparallel = true;
+						arcs.push_back(arc);
+					}
+					segment_start = i;
+					distance = 0;
+				}
+			}
+
+			// Stable counting sort of the arcs by tail
+			graph.first_out.assign(node_count + 1, 0);
+			for(const Arc& arc : arcs)
+				++graph.first_out[arc.tail + 1];
+			for(unsigned x = 0; x < node_count; ++x)
+				graph.first_out[x + 1] += graph.first_out[x];
+			std::vector<unsigned> sorted_arc(arcs.size());
+			{
+				std::vector<unsigned> next_arc(graph.first_out.begin(), graph.first_out.end() - 1);
+				for(unsigned a = 0; a < arcs.size(); ++a)
+					sorted_arc[next_arc[arcs[a].tail]++] = a;
+			}
+
+			unsigned arc_count = arcs.size();
+			graph.head.resize(arc_count);
+			graph.way.resize(arc_count);
+			graph.geo_distance.resize(arc_count);
+			graph.is_arc_antiparallel_to_way.resize(arc_count);
+			graph.first_modelling_node.assign(1, 0);
+			graph.modelling_node_latitude.clear();
+			graph.modelling_node_longitude.clear();
+			graph.forbidden_turn_from_arc.clear();
+			graph.forbidden_turn_to_arc.clear();
+
+			for(unsigned i = 0; i < arc_count; ++i){
+				const Arc& arc = arcs[sorted_arc[i]];
+				graph.head[i] = arc.head;
+				graph.way[i] = arc.way;
+				graph.geo_distance[i] = arc.geo_distance;
+				graph.is_arc_antiparallel_to_way[i] = arc.is_antiparallel;
+				for(uint64_t k = 0; k < arc.last_modelling - arc.first_modelling; ++k){
+					uint64_t j = arc.is_antiparallel ? arc.last_modelling - 1 - k : arc.first_modelling + k;
+					graph.modelling_node_latitude.push_back(node_latitude(way_ref[j]));
+					graph.modelling_node_longitude.push_back(node_longitude(way_ref[j]));
+				}
+				graph.first_modelling_node.push_back(graph.modelling_node_latitude.size());
+			}
+		}
+	};
+
+}
@@ -0,0 +1,263 @@
+#pragma once
+
+#include <routingkit/contraction_hierarchy.h>
+#include <routingkit/customizable_contraction_hierarchy.h>
+#include <routingkit/constants.h>
+
+#include <vector>
+#include <queue>
+#include <functional>
+#include <algorithm>
+#include <stdexcept>
+
+#include "../utils/instrumentation.h"
+#include "../utils/const_array.h"
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+namespace cms {
+
+	/**
+	 * Read-only view on the upward and downward graphs of a contraction hierarchy, indexed
+	 * by rank: the forward side holds the arcs x -> y and the backward side the arcs y -> x,
+	 * y being ranked above x. The columns are those of a RoutingKit::ContractionHierarchy,
+	 * the sections of a mapped flat graph file, or the shared up arcs of a customizable
+	 * contraction hierarchy with the weights of one of its metrics, and must outlive the view.
+	 */
+	struct ContractionHierarchyView {
+		ConstArray<unsigned> rank;
+		ConstArray<unsigned> order;
+		ConstArray<unsigned> forward_first_out;
+		ConstArray<unsigned> forward_head;
+		ConstArray<unsigned> forward_weight;
+		ConstArray<unsigned> backward_first_out;
+		ConstArray<unsigned> backward_head;
+		ConstArray<unsigned> backward_weight;
+
+		ContractionHierarchyView() {}
+
+		ContractionHierarchyView(const RoutingKit::ContractionHierarchy& ch)
+			: rank(ch.rank), order(ch.order),
+			  forward_first_out(ch.forward.first_out), forward_head(ch.forward.head), forward_weight(ch.forward.weight),
+			  backward_first_out(ch.backward.first_out), backward_head(ch.backward.head), backward_weight(ch.backward.weight) {}
+
+		/**
+		 * A customized metric of a customizable contraction hierarchy: both sides are the up
+		 * arcs of the hierarchy, weighted x -> y by the forward weights of the metric and
+		 * y -> x by its backward weights. Arcs absent from the metric weigh inf_weight.
+		 */
+		ContractionHierarchyView(const RoutingKit::CustomizableContractionHierarchy& cch, const RoutingKit::CustomizableContractionHierarchyMetric& metric)
+			: ContractionHierarchyView(cch, metric.forward, metric.backward) {}
+
+		// Same with customized weights kept apart from their metric, e.g. in a LiveMetric snapshot
+		ContractionHierarchyView(const RoutingKit::CustomizableContractionHierarchy& cch, ConstArray<unsigned> forward_weight, ConstArray<unsigned> backward_weight)
+			: rank(cch.rank), order(cch.order),
+			  forward_first_out(cch.up_first_out), forward_head(cch.up_head), forward_weight(forward_weight),
+			  backward_first_out(cch.up_first_out), backward_head(cch.up_head), backward_weight(backward_weight) {}
+
+		unsigned node_count() const {
+			return rank.size();
+		}
+	};
+
+	/**
+	 * The <code>PHASTQuery</code> class computes the distances from up to lane_count sources
+	 * to all nodes of a contraction hierarchy (PHAST: an upward search per source followed
+	 * by a single linear downward sweep in rank order).
+	 *
+	 * Distances of all sources of a sweep are interleaved per node (one lane per source) so
+	 * that every arc of the sweep relaxes all the lanes at once with SIMD min/add operations
+	 * when compiled with -mavx2 or -msse4.1, with a scalar fallback otherwise.
+	 *
+	 * Memory: node_count * lane_count * 4 bytes.
+	 */
+	template<unsigned lane_count = 8>
+	class PHASTQuery {
+	  public:
+
+		static_assert(lane_count % 4 == 0, "lane_count must be a multiple of 4");
+
+		// Unreachable nodes, kept below 2^31 so that adding an arc weight never wraps around
+		static const unsigned inf = 0x7FFFFFFF;
+
+		PHASTQuery() : source_count(0) {}
+
+		explicit PHASTQuery(const ContractionHierarchyView& ch) : source_count(0) {
+			reset(ch);
+		}
+
+		/**
+		 * Bind the query to a contraction hierarchy and allocate its workspace. The columns
+		 * of the hierarchy are referenced, not copied.
+		 */
+		PHASTQuery& reset(const ContractionHierarchyView& ch) {
+			this->ch = ch;
+			unsigned node_count = ch.node_count();
+			distance.assign((size_t)node_count * lane_count, inf);
+			upward_distance.assign(node_count, inf);
+			source_count = 0;
+			return *this;
+		}
+
+		/**
+		 * Compute the distances from sources[0..count) to all nodes, count <= lane_count.
+		 * Lanes beyond count stay unreachable.
+		 */
+		PHASTQuery& run(const unsigned* sources, unsigned count) {
+			if(ch.node_count() == 0)
+				throw std::runtime_error("PHASTQuery is not bound to a contraction hierarchy");
+			if(count > lane_count)
+				throw std::runtime_error("PHASTQuery got more sources than lanes");
+
+			CMS_SCOPED_TIMER("phast.sweep_microseconds");
+			CMS_COUNTER_ADD("phast.sources", count);
+
+			source_count = count;
+			std::fill(distance.begin(), distance.end(), inf);
+
+			for(unsigned l = 0; l < count; ++l)
+				upward_search(l, ch.rank[sources[l]]);
+
+			downward_sweep();
+			return *this;
+		}
+
+		PHASTQuery& run(const std::vector<unsigned>& sources) {
+			return run(sources.data(), sources.size());
+		}
+
+		unsigned get_source_count() const {
+			return source_count;
+		}
+
+		/**
+		 * Distance from the lane-th source to the given node (original node ID),
+		 * RoutingKit::inf_weight if unreachable.
+		 */
+		unsigned get_distance(unsigned lane, unsigned node) const {
+			unsigned d = distance[(size_t)ch.rank[node] * lane_count + lane];
+			return d >= inf ? RoutingKit::inf_weight : d;
+		}
+
+		/**
+		 * Distances of all the lanes for the node of the given rank, lane_count values.
+		 * Unreachable lanes hold PHASTQuery::inf.
+		 */
+		const unsigned* get_distances_by_rank(unsigned rank) const {
+			return &distance[(size_t)rank * lane_count];
+		}
+
+		/**
+		 * Number of sources of the last run reaching the node of the given rank
+		 * strictly under threshold.
+		 */
+		unsigned count_below_by_rank(unsigned rank, unsigned threshold) const {
+			const unsigned* d = get_distances_by_rank(rank);
+			unsigned count = 0;
+			for(unsigned l = 0; l < lane_count; ++l)
+				count += d[l] < threshold;
+			return count;
+		}
+
+	  private:
+		ContractionHierarchyView ch;
+		unsigned source_count;
+
+		std::vector<unsigned> distance; // [rank * lane_count + lane]
+		std::vector<unsigned> upward_distance;
+		std::vector<unsigned> upward_touched;
+
+		// Weights clamped to inf, so that the sweep never deals with RoutingKit::inf_weight
+		static unsigned clamp(unsigned weight) {
+			return std::min(weight, inf);
+		}
+
+		/**
+		 * Dijkstra restricted to upward arcs from the given rank, results written in the lane.
+		 */
+		void upward_search(unsigned lane, unsigned source_rank) {
+			typedef std::pair<unsigned, unsigned> QueueItem; // <distance, rank>
+			std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem> > queue;
+
+			upward_distance[source_rank] = 0;
+			upward_touched.push_back(source_rank);
+			queue.push(QueueItem(0, source_rank));
+
+			while(!queue.empty()){
+				QueueItem item = queue.top();
+				queue.pop();
+				unsigned x = item.second;
+				if(item.first != upward_distance[x])
+					continue;
+				distance[(size_t)x * lane_count + lane] = item.first;
+				for(unsigned a = ch.forward_first_out[x]; a < ch.forward_first_out[x+1]; ++a){
+					unsigned y = ch.forward_head[a];
+					unsigned d = item.first + clamp(ch.forward_weight[a]);
+					if(d < upward_distance[y]){
+						if(upward_distance[y] == inf)
+							upward_touched.push_back(y);
+						upward_distance[y] = d;
+						queue.push(QueueItem(d, y));
+					}
+				}
+			}
+
+			for(unsigned x : upward_touched)
+				upward_distance[x] = inf;
+			upward_touched.clear();
+		}
+
+		/**
+		 * Settle every node from the highest rank to the lowest one through the backward
+		 * upward arcs, whose heads are already final.
+		 */
+		void downward_sweep() {
+			const unsigned* first_out = ch.backward_first_out.data();
+			const unsigned* head = ch.backward_head.data();
+			const unsigned* weight = ch.backward_weight.data();
+			unsigned* d = distance.data();
+
+			for(unsigned x = ch.node_count(); x-- > 0; ){
+				unsigned* dx = d + (size_t)x * lane_count;
+				for(unsigned a = first_out[x]; a < first_out[x+1]; ++a)
+					relax_lanes(dx, d + (size_t)head[a] * lane_count, clamp(weight[a]));
+			}
+		}
+
+		static void relax_lanes(unsigned* dx, const unsigned* dy, unsigned w) {
+#if defined(__AVX2__)
+			const __m256i weight = _mm256_set1_epi32((int)w);
+			for(unsigned l = 0; l + 8 <= lane_count; l += 8){
+				__m256i candidate = _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(dy + l)), weight);
+				__m256i current = _mm256_loadu_si256((const __m256i*)(dx + l));
+				_mm256_storeu_si256((__m256i*)(dx + l), _mm256_min_epu32(current, candidate));
+			}
+			if(lane_count % 8 != 0){
+				unsigned l = lane_count - 4;
+				__m128i candidate = _mm_add_epi32(_mm_loadu_si128((const __m128i*)(dy + l)), _mm_set1_epi32((int)w));
+				__m128i current = _mm_loadu_si128((const __m128i*)(dx + l));
+				_mm_storeu_si128((__m128i*)(dx + l), _mm_min_epu32(current, candidate));
+			}
+#elif defined(__SSE4_1__)
+			const __m128i weight = _mm_set1_epi32((int)w);
+			for(unsigned l = 0; l < lane_count; l += 4){
+				__m128i candidate = _mm_add_epi32(_mm_loadu_si128((const __m128i*)(dy + l)), weight);
+				__m128i current = _mm_loadu_si128((const __m128i*)(dx + l));
+				_mm_storeu_si128((__m128i*)(dx + l), _mm_min_epu32(current, candidate));
+			}
+#else
+			for(unsigned l = 0; l < lane_count; ++l){
+				unsigned candidate = dy[l] + w;
+				if(candidate < dx[l])
+					dx[l] = candidate;
+			}
+#endif
+		}
+	};
+
+	template<unsigned lane_count>
+	const unsigned PHASTQuery<lane_count>::inf;
+
+}
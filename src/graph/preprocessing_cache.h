@@ -0,0 +1,193 @@
+#pragma once
+
+#include "graph.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+
+namespace cms {
+
+	/**
+	 * The <code>PreprocessingCache</code> class keeps the preprocessed forms of .osm.pbf
+	 * files (graph.dat, ch.dat, cch.dat and graph.flat, as written by
+	 * test/pbf_to_contracted_graph.cpp) in a directory, under a key made of the hash of the
+	 * file contents, of the speed profile applied by Graph::load_from_pbf and of the formats
+	 * version.
+	 *
+	 * An unchanged file is thus never preprocessed twice, whatever its name or date, and a
+	 * change of the profile or of a file format invalidates the entries by itself. Entries
+	 * are built in a temporary directory and renamed once complete, so that an interrupted
+	 * build never leaves a partial entry behind.
+	 */
+	class PreprocessingCache {
+	  public:
+
+		explicit PreprocessingCache(const std::string& cache_directory) : cache_directory(cache_directory) {
+			mkdir(cache_directory.c_str(), 0777);
+		}
+
+		/**
+		 * Key of the entry of pbf_file: 16 hexadecimal digits.
+		 */
+		std::string get_key(const std::string& pbf_file) const {
+			uint64_t h = hash_file(pbf_file);
+			std::string profile = get_profile();
+			h = hash_bytes(profile.data(), profile.size(), h);
+			std::string version = get_format_version();
+			h = hash_bytes(version.data(), version.size(), h);
+			char key[17];
+			snprintf(key, sizeof(key), "%016llx", (unsigned long long)h);
+			return key;
+		}
+
+		std::string get_entry_directory(const std::string& key) const {
+			return cache_directory + '/' + key;
+		}
+
+		bool has_entry(const std::string& key) const {
+			struct stat status;
+			return stat((get_entry_directory(key) + "/graph.flat").c_str(), &status) == 0;
+		}
+
+		/**
+		 * Preprocess pbf_file in the entry of key, unless the entry already exists.
+		 *
+		 * @param thread_count Threads decoding the .osm.pbf blobs, 0 uses every core.
+		 * @param node_memory_budget Bytes of memory for the node coordinates while reading the
+		 * file, see Graph::load_from_pbf. 0 keeps them in memory.
+		 * @return Whether the entry had to be built.
+		 */
+		bool build_entry(const std::string& key, const std::string& pbf_file, unsigned thread_count = 0, uint64_t node_memory_budget = 0) {
+
+			if(has_entry(key))
+				return false;
+
+			std::string entry_directory = get_entry_directory(key);
+			std::string build_directory = entry_directory + ".build-" + std::to_string(getpid()) + "-" + std::to_string(RoutingKit::get_micro_time());
+			if(mkdir(build_directory.c_str(), 0777) != 0)
+				throw std::runtime_error("Unable to create " + build_directory);
+
+			try{
+				GraphCH graph;
+				graph.load_from_pbf(pbf_file, thread_count, node_memory_budget, cache_directory);
+				graph.renumber_nodes_along_hilbert_curve();
+				graph.save_graph_to_a_binary_file("graph.dat", build_directory);
+				graph.build_contraction_hierarchy();
+				graph.save_contraction_hierarchy("ch.dat", build_directory);
+				graph.build_customizable_contraction_hierarchy();
+				graph.save_customizable_contraction_hierarchy("cch.dat", build_directory);
+				graph.save_graph_to_a_flat_file("graph.flat", build_directory);
+			}catch(...){
+				remove_directory(build_directory);
+				throw;
+			}
+
+			// Another process may have built the same entry meanwhile, both are identical
+			if(rename(build_directory.c_str(), entry_directory.c_str()) != 0)
+				remove_directory(build_directory);
+			return true;
+		}
+
+		/**
+		 * 64 bits hash of the contents of a file, read through a memory mapping.
+		 */
+		static uint64_t hash_file(const std::string& file) {
+			int fd = open(file.c_str(), O_RDONLY);
+			if(fd < 0)
+				throw std::runtime_error("Unable to open " + file);
+			struct stat status;
+			if(fstat(fd, &status) != 0){
+				::close(fd);
+				throw std::runtime_error("Unable to stat " + file);
+			}
+			uint64_t size = status.st_size;
+			if(size == 0){
+				::close(fd);
+				return hash_bytes(nullptr, 0, 0);
+			}
+			void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			::close(fd);
+			if(data == MAP_FAILED)
+				throw std::runtime_error("Unable to map " + file);
+			madvise(data, size, MADV_SEQUENTIAL);
+			uint64_t h = hash_bytes(data, size, 0);
+			munmap(data, size);
+			return h;
+		}
+
+		/**
+		 * 64 bits hash of size bytes, not cryptographic: four independent multiply-rotate
+		 * lanes over 8 bytes words, then a final avalanche.
+		 */
+		static uint64_t hash_bytes(const void* data, uint64_t size, uint64_t seed) {
+			const uint64_t prime_1 = 0x9E3779B185EBCA87ULL, prime_2 = 0xC2B2AE3D27D4EB4FULL;
+			const unsigned char* bytes = static_cast<const unsigned char*>(data);
+			uint64_t lane[4] = {seed + prime_1, seed ^ prime_2, seed - prime_1, ~seed};
+
+			uint64_t i = 0;
+			for(; i + 32 <= size; i += 32){
+				for(unsigned l = 0; l < 4; ++l){
+					uint64_t word;
+					memcpy(&word, bytes + i + 8 * l, 8);
+					lane[l] = rotate_left(lane[l] + word * prime_2, 31) * prime_1;
+				}
+			}
+			uint64_t h = size;
+			for(unsigned l = 0; l < 4; ++l)
+				h = (h ^ rotate_left(lane[l], 7 * l + 1)) * prime_1;
+			for(; i < size; ++i)
+				h = rotate_left(h ^ (bytes[i] * prime_2), 11) * prime_1;
+
+			h ^= h >> 33;
+			h *= prime_2;
+			h ^= h >> 29;
+			h *= prime_1;
+			h ^= h >> 32;
+			return h;
+		}
+
+	  private:
+		std::string cache_directory;
+
+		static uint64_t rotate_left(uint64_t x, unsigned r) {
+			return (x << r) | (x >> (64 - r));
+		}
+
+		/**
+		 * Speed profile of the graphs built by Graph::load_from_pbf, the RoutingKit car
+		 * profile with the way speed limits. To be changed along with it.
+		 */
+		static std::string get_profile() {
+			return "routingkit-car";
+		}
+
+		/**
+		 * Versions of the formats of the entry files, and of the entries themselves.
+		 */
+		static std::string get_format_version() {
+			return "entry-2;graph.dat-" + std::to_string(boost::serialization::version<Graph>::value) + ";graph.flat-" + std::to_string(graph_file_version);
+		}
+
+		static void remove_directory(const std::string& directory) {
+			DIR* dir = opendir(directory.c_str());
+			if(dir != nullptr){
+				for(struct dirent* entry = readdir(dir); entry != nullptr; entry = readdir(dir)){
+					std::string name = entry->d_name;
+					if(name != "." && name != "..")
+						unlink((directory + '/' + name).c_str());
+				}
+				closedir(dir);
+			}
+			rmdir(directory.c_str());
+		}
+	};
+
+}
@@ -0,0 +1,409 @@
+#pragma once
+
+#include <stdint.h>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <memory>
+#include <queue>
+#include <functional>
+
+#include <boost/serialization/vector.hpp>
+
+namespace osmpbfreader {
+
+// Returned by the searches when the id is missing
+const uint64_t invalid_index = (uint64_t)-1;
+
+// Position of searched in the sorted, duplicate free ids, invalid_index if missing.
+// OSM ids are nearly uniformly spread, a few interpolation steps narrow the range before
+// the binary search.
+inline uint64_t find_sorted_id(const std::vector<uint64_t> & ids, uint64_t searched){
+    uint64_t low = 0, high = ids.size(); // [low, high)
+    for(int step = 0; step < 4 && high - low > 64; ++step){
+        uint64_t low_id = ids[low], high_id = ids[high - 1];
+        if(searched < low_id || searched > high_id)
+            return invalid_index;
+        uint64_t probe = low + (uint64_t)((double)(searched - low_id) / (double)(high_id - low_id) * (high - 1 - low));
+        if(ids[probe] < searched)
+            low = probe + 1;
+        else if(ids[probe] > searched)
+            high = probe;
+        else
+            return probe;
+    }
+    std::vector<uint64_t>::const_iterator it = std::lower_bound(ids.begin() + low, ids.begin() + high, searched);
+    if(it == ids.begin() + high || *it != searched)
+        return invalid_index;
+    return it - ids.begin();
+}
+
+// Nodes of the extract kept as a sorted id array with parallel fixed-point coordinates
+// (1e-7 degree, the precision of OSM), 16 bytes per node.
+//
+// The store is filled in two phases: add() records every node read in the file, then
+// keep_only() drops the nodes no way refers to and sorts the survivors by id.
+//
+// After use_disk(), the first phase runs in external memory: the nodes read are spilled to
+// an anonymous temporary file as sorted runs of at most memory_budget bytes, and keep_only()
+// resolves the references with a sequential merge of the runs, in several passes when they
+// are too many for the budget. The peak memory of the first phase is then set by the
+// budget, not by the size of the extract.
+struct NodeStore {
+    std::vector<uint64_t> id;
+    std::vector<int32_t> latitude_e7;
+    std::vector<int32_t> longitude_e7;
+
+    // Spill the nodes of the first phase to a temporary file created in directory
+    void use_disk(const std::string & directory, uint64_t memory_budget){
+        std::string path = directory + "/cms_node_store_XXXXXX";
+        std::vector<char> name(path.begin(), path.end());
+        name.push_back('\0');
+        int fd = mkstemp(name.data());
+        if(fd < 0)
+            throw std::runtime_error("Unable to create a node swap file in " + directory);
+        // The file disappears with its last descriptor
+        unlink(name.data());
+        swap_fd = std::shared_ptr<int>(new int(fd), [](int* f){ ::close(*f); delete f; });
+        swap_size = 0;
+        runs.clear();
+        pending_capacity = std::max<uint64_t>(1, memory_budget / sizeof(NodeRecord));
+    }
+
+    bool is_on_disk() const { return swap_fd != nullptr; }
+
+    void add(uint64_t osmid, double lon, double lat){
+        if(is_on_disk()){
+            pending.push_back(NodeRecord{osmid, to_fixed_point(lat), to_fixed_point(lon)});
+            if(pending.size() >= pending_capacity)
+                spill_run();
+            return;
+        }
+        if(!id.empty() && osmid <= id.back())
+            is_sorted = false;
+        id.push_back(osmid);
+        latitude_e7.push_back(to_fixed_point(lat));
+        longitude_e7.push_back(to_fixed_point(lon));
+    }
+
+    // Keep the nodes listed in referenced (in any order, with duplicates), sorted by id
+    void keep_only(std::vector<uint64_t> referenced){
+        std::sort(referenced.begin(), referenced.end());
+        referenced.erase(std::unique(referenced.begin(), referenced.end()), referenced.end());
+        if(is_on_disk()){
+            merge_runs(referenced);
+            return;
+        }
+        sort_by_id();
+
+        uint64_t kept = 0;
+        for(uint64_t i = 0; i < id.size(); ++i){
+            if(std::binary_search(referenced.begin(), referenced.end(), id[i])){
+                id[kept] = id[i];
+                latitude_e7[kept] = latitude_e7[i];
+                longitude_e7[kept] = longitude_e7[i];
+                ++kept;
+            }
+        }
+        id.resize(kept);
+        latitude_e7.resize(kept);
+        longitude_e7.resize(kept);
+        id.shrink_to_fit();
+        latitude_e7.shrink_to_fit();
+        longitude_e7.shrink_to_fit();
+    }
+
+    // Index of the node, invalid_index if it is not stored
+    uint64_t find(uint64_t osmid) const {
+        return find_sorted_id(id, osmid);
+    }
+
+    // Index of the node, throws std::out_of_range if it is not stored
+    uint64_t at(uint64_t osmid) const {
+        uint64_t i = find(osmid);
+        if(i == invalid_index)
+            throw std::out_of_range("Node " + std::to_string(osmid) + " is not stored");
+        return i;
+    }
+
+    bool contains(uint64_t osmid) const { return find(osmid) != invalid_index; }
+
+    double latitude(uint64_t i) const { return latitude_e7[i] * 1e-7; }
+    double longitude(uint64_t i) const { return longitude_e7[i] * 1e-7; }
+
+    uint64_t size() const { return id.size(); }
+    bool empty() const { return id.empty(); }
+
+    void clear(){
+        id.clear();
+        latitude_e7.clear();
+        longitude_e7.clear();
+        is_sorted = true;
+        release_disk();
+    }
+
+    template<class Archive>
+    void serialize(Archive & ar, const unsigned int /*version*/){
+        ar & id;
+        ar & latitude_e7;
+        ar & longitude_e7;
+    }
+
+private:
+    struct NodeRecord {
+        uint64_t id;
+        int32_t latitude_e7;
+        int32_t longitude_e7;
+    };
+
+    // Sorted run of the swap file
+    struct Run {
+        uint64_t first_record;
+        uint64_t record_count;
+    };
+
+    bool is_sorted = true;
+
+    // External memory state of the first phase
+    std::shared_ptr<int> swap_fd;
+    uint64_t swap_size = 0; // in records
+    std::vector<Run> runs;
+    std::vector<NodeRecord> pending;
+    uint64_t pending_capacity = 0;
+
+    void release_disk(){
+        swap_fd.reset();
+        swap_size = 0;
+        runs.clear();
+        std::vector<NodeRecord>().swap(pending);
+    }
+
+    void spill_run(){
+        if(pending.empty())
+            return;
+        std::sort(pending.begin(), pending.end(), [](const NodeRecord & a, const NodeRecord & b){ return a.id < b.id; });
+        runs.push_back(Run{swap_size, pending.size()});
+        append_records(pending);
+        pending.clear();
+    }
+
+    // Write records at the end of the swap file
+    void append_records(const std::vector<NodeRecord> & records){
+        const char* data = reinterpret_cast<const char*>(records.data());
+        uint64_t size = records.size() * sizeof(NodeRecord);
+        uint64_t offset = swap_size * sizeof(NodeRecord);
+        while(size > 0){
+            ssize_t written = pwrite(*swap_fd, data, size, offset);
+            if(written <= 0)
+                throw std::runtime_error("Unable to write the node swap file");
+            data += written;
+            size -= written;
+            offset += written;
+        }
+        swap_size += records.size();
+    }
+
+    // Read up to buffer.size() records of a run, returns the number of records read
+    uint64_t read_records(uint64_t first_record, uint64_t record_count, std::vector<NodeRecord> & buffer) const {
+        record_count = std::min<uint64_t>(record_count, buffer.size());
+        char* data = reinterpret_cast<char*>(buffer.data());
+        uint64_t size = record_count * sizeof(NodeRecord);
+        uint64_t offset = first_record * sizeof(NodeRecord);
+        while(size > 0){
+            ssize_t read = pread(*swap_fd, data, size, offset);
+            if(read <= 0)
+                throw std::runtime_error("Unable to read the node swap file");
+            data += read;
+            size -= read;
+            offset += read;
+        }
+        return record_count;
+    }
+
+    // Merge the sorted runs and keep the referenced nodes. Each run is read sequentially
+    // through a buffer, the buffers of a merge sharing the memory budget: when there are too
+    // many runs for buffers of min_merge_buffer_records, groups of runs are first merged
+    // into longer runs of the referenced nodes, appended to the swap file.
+    void merge_runs(const std::vector<uint64_t> & referenced){
+        spill_run();
+        std::vector<NodeRecord>().swap(pending);
+
+        const uint64_t min_merge_buffer_records = 512;
+        // Runs merged at once, one more buffer being needed for the output of a pass
+        const uint64_t buffer_count = pending_capacity / min_merge_buffer_records;
+        const uint64_t fan_in = buffer_count > 3 ? buffer_count - 1 : 2;
+
+        while(runs.size() > fan_in){
+            std::vector<Run> merged_runs;
+            uint64_t buffer_records = std::max<uint64_t>(1, pending_capacity / (fan_in + 1));
+            std::vector<NodeRecord> output;
+            output.reserve(buffer_records);
+            for(uint64_t first = 0; first < runs.size(); first += fan_in){
+                uint64_t last = std::min<uint64_t>(first + fan_in, runs.size());
+                Run run{swap_size, 0};
+                merge_run_range(first, last, referenced, buffer_records, [&](const NodeRecord & record){
+                    output.push_back(record);
+                    if(output.size() == buffer_records){
+                        append_records(output);
+                        run.record_count += output.size();
+                        output.clear();
+                    }
+                });
+                append_records(output);
+                run.record_count += output.size();
+                output.clear();
+                merged_runs.push_back(run);
+            }
+            runs.swap(merged_runs);
+        }
+
+        id.clear();
+        latitude_e7.clear();
+        longitude_e7.clear();
+        id.reserve(referenced.size());
+        latitude_e7.reserve(referenced.size());
+        longitude_e7.reserve(referenced.size());
+
+        uint64_t buffer_records = std::max<uint64_t>(1, pending_capacity / std::max<size_t>(1, runs.size()));
+        merge_run_range(0, runs.size(), referenced, buffer_records, [&](const NodeRecord & record){
+            id.push_back(record.id);
+            latitude_e7.push_back(record.latitude_e7);
+            longitude_e7.push_back(record.longitude_e7);
+        });
+
+        id.shrink_to_fit();
+        latitude_e7.shrink_to_fit();
+        longitude_e7.shrink_to_fit();
+        is_sorted = true;
+        release_disk();
+    }
+
+    // Merge runs[first, last) through buffers of buffer_records records each and pass the
+    // referenced nodes to sink, sorted by id and once each
+    template<class Sink>
+    void merge_run_range(uint64_t first, uint64_t last, const std::vector<uint64_t> & referenced, uint64_t buffer_records, const Sink & sink) const {
+        struct RunReader {
+            uint64_t next_record;
+            uint64_t end_record;
+            std::vector<NodeRecord> buffer;
+            uint64_t position;
+            uint64_t size;
+        };
+        std::vector<RunReader> readers(last - first);
+
+        // (id, reader) of the head of each run, smallest id first
+        typedef std::pair<uint64_t, unsigned> Head;
+        std::priority_queue<Head, std::vector<Head>, std::greater<Head> > heads;
+
+        auto refill = [&](unsigned r){
+            RunReader & reader = readers[r];
+            reader.position = 0;
+            reader.size = read_records(reader.next_record, reader.end_record - reader.next_record, reader.buffer);
+            reader.next_record += reader.size;
+        };
+
+        for(unsigned r = 0; r < readers.size(); ++r){
+            const Run & run = runs[first + r];
+            readers[r].next_record = run.first_record;
+            readers[r].end_record = run.first_record + run.record_count;
+            readers[r].buffer.resize(std::min(buffer_records, run.record_count));
+            refill(r);
+            if(readers[r].size > 0)
+                heads.push(Head(readers[r].buffer[0].id, r));
+        }
+
+        uint64_t next_referenced = 0;
+        uint64_t last_id = 0;
+        bool has_last_id = false;
+        while(!heads.empty() && next_referenced < referenced.size()){
+            unsigned r = heads.top().second;
+            heads.pop();
+            RunReader & reader = readers[r];
+            const NodeRecord & record = reader.buffer[reader.position];
+
+            while(next_referenced < referenced.size() && referenced[next_referenced] < record.id)
+                ++next_referenced;
+            if(next_referenced < referenced.size() && referenced[next_referenced] == record.id && (!has_last_id || last_id != record.id)){
+                sink(record);
+                last_id = record.id;
+                has_last_id = true;
+            }
+
+            if(++reader.position == reader.size)
+                refill(r);
+            if(reader.position < reader.size)
+                heads.push(Head(reader.buffer[reader.position].id, r));
+        }
+    }
+
+    static int32_t to_fixed_point(double degree){
+        return (int32_t)std::llround(degree * 1e7);
+    }
+
+    void sort_by_id(){
+        if(is_sorted)
+            return;
+        std::vector<uint64_t> permutation(id.size());
+        std::iota(permutation.begin(), permutation.end(), 0);
+        std::sort(permutation.begin(), permutation.end(), [&](uint64_t a, uint64_t b){ return id[a] < id[b]; });
+        std::vector<uint64_t> sorted_id(id.size());
+        std::vector<int32_t> sorted_latitude(id.size()), sorted_longitude(id.size());
+        for(uint64_t i = 0; i < permutation.size(); ++i){
+            sorted_id[i] = id[permutation[i]];
+            sorted_latitude[i] = latitude_e7[permutation[i]];
+            sorted_longitude[i] = longitude_e7[permutation[i]];
+        }
+        id.swap(sorted_id);
+        latitude_e7.swap(sorted_latitude);
+        longitude_e7.swap(sorted_longitude);
+        is_sorted = true;
+    }
+};
+
+// Index of an id in a vector of ids (e.g. the OSM id of a way to its position in
+// Routing::ways_osm), stored as a sorted id array instead of a hash map.
+struct IdIndex {
+    std::vector<uint64_t> id;       // sorted
+    std::vector<uint64_t> position; // position[i] of id[i] in the indexed vector, empty if it was already sorted
+
+    void build(const std::vector<uint64_t> & values){
+        if(std::is_sorted(values.begin(), values.end())){
+            id = values;
+            position.clear();
+            return;
+        }
+        position.resize(values.size());
+        std::iota(position.begin(), position.end(), 0);
+        std::stable_sort(position.begin(), position.end(), [&](uint64_t a, uint64_t b){ return values[a] < values[b]; });
+        id.resize(values.size());
+        for(uint64_t i = 0; i < position.size(); ++i)
+            id[i] = values[position[i]];
+    }
+
+    // Position of value in the indexed vector, throws std::out_of_range if missing
+    uint64_t at(uint64_t value) const {
+        uint64_t i = find_sorted_id(id, value);
+        if(i == invalid_index)
+            throw std::out_of_range("Id " + std::to_string(value) + " is not indexed");
+        return position.empty() ? i : position[i];
+    }
+
+    uint64_t operator[](uint64_t value) const { return at(value); }
+
+    bool count(uint64_t value) const { return find_sorted_id(id, value) != invalid_index; }
+    uint64_t size() const { return id.size(); }
+    bool empty() const { return id.empty(); }
+
+    void clear(){
+        id.clear();
+        position.clear();
+    }
+};
+
+}
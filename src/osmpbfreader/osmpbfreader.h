@@ -30,20 +30,40 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <stdint.h>
 #include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <zlib.h>
 #include <string>
 #include <fstream>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <exception>
+#include <cstring>
+#include <cstdlib>
+#include <map>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <type_traits>
 // blob : binary large object
 // this describes the low-level blob storage
 #include <osmpbf/fileformat.pb.h>
 // this describes the high-level OSM objects
 #include <osmpbf/osmformat.pb.h>
+#include <google/protobuf/io/coded_stream.h>
 
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/serialization/vector.hpp>
 
+#include "node_store.h"
+
 // the maximum size of a blob header in bytes
 const int max_blob_header_size = 64 * 1024; // 64 kB
 // the maximum size of an uncompressed blob in bytes
@@ -73,7 +93,7 @@ typedef std::vector<Reference> References;
 
 // Main function
 template<typename Visitor>
-void read_osm_pbf(const std::string & filename, Visitor & visitor);
+void read_osm_pbf(const std::string & filename, Visitor & visitor, unsigned thread_count = 1, unsigned max_blobs_in_flight = 0);
 
 struct warn {
     warn() {std::cout << "\033[33m[WARN] ";}
@@ -87,37 +107,239 @@ struct info {
     ~info() {std::cout << "\033[0m" << std::endl;}
 };
 
+// Throws a std::runtime_error with the streamed message at the end of the statement, so that
+// a parse failure reaches the caller (possibly from a parsing thread) instead of exiting
 struct fatal {
-    fatal() {std::cout << "\033[31m[FATAL] ";}
-    template<typename T>fatal & operator<<(const T & t){ std::cout << t; return *this;}
-    ~fatal() {std::cout << "\033[0m" << std::endl; exit(1);}
+    std::ostringstream message;
+    fatal() {}
+    template<typename T>fatal & operator<<(const T & t){ message << t; return *this;}
+    ~fatal() noexcept(false) {
+        std::cout << "\033[31m[FATAL] " << message.str() << "\033[0m" << std::endl;
+        throw std::runtime_error(message.str());
+    }
 };
 
 
 
-template<typename T>
-Tags get_tags(T object, const OSMPBF::PrimitiveBlock &primblock){
-    Tags result;
-    for(int i = 0; i < object.keys_size(); ++i){
-        uint64_t key = object.keys(i);
-        uint64_t val = object.vals(i);
-        std::string key_string = primblock.stringtable().s(key);
-        std::string val_string = primblock.stringtable().s(val);
-        result[key_string] = val_string;
+typedef google::protobuf::RepeatedPtrField<std::string> StringTable;
+
+// Tags of an element as indexes in the string table of its block. Plain elements store keys
+// and values in two arrays (stride 1), dense nodes interleave them (stride 2).
+struct TagIndexes {
+    const uint32_t* keys;
+    const uint32_t* values;
+    int count;
+    int stride;
+};
+
+// Lightweight view on the tags of an element, valid during the callback only
+class TagView {
+public:
+    TagView(const StringTable & strings, const TagIndexes & indexes) : strings(strings), indexes(indexes) {}
+
+    int size() const { return indexes.count; }
+    uint32_t key_index(int i) const { return indexes.keys[i * indexes.stride]; }
+    uint32_t value_index(int i) const { return indexes.values[i * indexes.stride]; }
+    const std::string & key(int i) const { return strings.Get(key_index(i)); }
+    const std::string & value(int i) const { return strings.Get(value_index(i)); }
+
+    // Value of the key, nullptr if the element does not have it
+    const std::string* find(const std::string & searched_key) const {
+        for(int i = 0; i < indexes.count; ++i){
+            if(key(i) == searched_key)
+                return &value(i);
+        }
+        return nullptr;
     }
-    return result;
-}
+
+    bool has(const std::string & searched_key) const {
+        return find(searched_key) != nullptr;
+    }
+
+    Tags to_map() const {
+        Tags result;
+        for(int i = 0; i < indexes.count; ++i)
+            result[key(i)] = value(i);
+        return result;
+    }
+
+private:
+    const StringTable & strings;
+    TagIndexes indexes;
+};
+
+// What a visitor receives as tags, declared with `static const TagPolicy tag_policy = ...;`
+//  - map: a Tags map (default, the strings are copied out of the string table),
+//  - view: a TagView reading the string table of the block in place,
+//  - none: an empty Tags map, the string table is never read.
+enum class TagPolicy { map, view, none };
+
+template<typename Visitor, typename = void>
+struct visitor_tag_policy : std::integral_constant<TagPolicy, TagPolicy::map> {};
+
+template<typename Visitor>
+struct visitor_tag_policy<Visitor, decltype((void)Visitor::tag_policy, void())>
+    : std::integral_constant<TagPolicy, Visitor::tag_policy> {};
+
+// Calls the visitor with the tags of its policy
+template<typename Visitor>
+struct TagDelivery {
+    typedef std::integral_constant<TagPolicy, visitor_tag_policy<Visitor>::value> Policy;
+
+    Visitor & visitor;
+    const StringTable* strings;
+    Tags tags;
+
+    explicit TagDelivery(Visitor & visitor) : visitor(visitor), strings(nullptr) {}
+
+    void begin_block(const OSMPBF::PrimitiveBlock & primblock){ strings = &primblock.stringtable().s(); }
+    void end_block(OSMPBF::PrimitiveBlock & /*primblock*/){}
+
+    void node(uint64_t osmid, double lon, double lat, const TagIndexes & tag_indexes){
+        visitor.node_callback(osmid, lon, lat, make_tags(tag_indexes, Policy()));
+    }
+    void way(uint64_t osmid, const TagIndexes & tag_indexes, const std::vector<uint64_t> & refs){
+        visitor.way_callback(osmid, make_tags(tag_indexes, Policy()), refs);
+    }
+    void relation(uint64_t osmid, const TagIndexes & tag_indexes, const References & refs){
+        visitor.relation_callback(osmid, make_tags(tag_indexes, Policy()), refs);
+    }
+
+private:
+    const Tags & make_tags(const TagIndexes & tag_indexes, std::integral_constant<TagPolicy, TagPolicy::map>){
+        tags.clear();
+        for(int i = 0; i < tag_indexes.count; ++i)
+            tags[strings->Get(tag_indexes.keys[i * tag_indexes.stride])] = strings->Get(tag_indexes.values[i * tag_indexes.stride]);
+        return tags;
+    }
+    TagView make_tags(const TagIndexes & tag_indexes, std::integral_constant<TagPolicy, TagPolicy::view>){
+        return TagView(*strings, tag_indexes);
+    }
+    const Tags & make_tags(const TagIndexes & /*tag_indexes*/, std::integral_constant<TagPolicy, TagPolicy::none>){
+        return tags;
+    }
+};
+
+// A visitor declaring `static const bool unordered_blobs = true;` accepts to receive the
+// blobs of the file in any order when they are decoded by several threads
+template<typename Visitor, typename = void>
+struct accepts_unordered_blobs : std::false_type {};
+
+template<typename Visitor>
+struct accepts_unordered_blobs<Visitor, decltype((void)Visitor::unordered_blobs, void())>
+    : std::integral_constant<bool, Visitor::unordered_blobs> {};
+
+// Elements of one decoded blob, replayed later on the visitor. Tags are kept as string table
+// indexes and only materialized at replay, according to the visitor tag policy.
+struct DecodedBlob {
+    struct NodeElement {
+        uint64_t id;
+        double lon;
+        double lat;
+        uint32_t first_tag;
+        uint32_t tag_count;
+    };
+    struct WayElement {
+        uint64_t id;
+        uint32_t first_tag;
+        uint32_t tag_count;
+        uint64_t first_ref;
+        uint64_t ref_count;
+    };
+    struct RelationElement {
+        uint64_t id;
+        uint32_t first_tag;
+        uint32_t tag_count;
+        References refs;
+    };
+
+    StringTable strings;
+    std::vector<uint32_t> tag_indexes; // key, value pairs
+    std::vector<uint64_t> refs;
+    std::vector<NodeElement> nodes;
+    std::vector<WayElement> ways;
+    std::vector<RelationElement> relations;
+
+    void begin_block(const OSMPBF::PrimitiveBlock & /*primblock*/){}
+    // The string table is taken from the reused block message
+    void end_block(OSMPBF::PrimitiveBlock & primblock){ strings.Swap(primblock.mutable_stringtable()->mutable_s()); }
+
+    void node(uint64_t osmid, double lon, double lat, const TagIndexes & tags){
+        nodes.push_back(NodeElement{osmid, lon, lat, add_tags(tags), (uint32_t)tags.count});
+    }
+    void way(uint64_t osmid, const TagIndexes & tags, const std::vector<uint64_t> & way_refs){
+        ways.push_back(WayElement{osmid, add_tags(tags), (uint32_t)tags.count, refs.size(), way_refs.size()});
+        refs.insert(refs.end(), way_refs.begin(), way_refs.end());
+    }
+    void relation(uint64_t osmid, const TagIndexes & tags, const References & relation_refs){
+        relations.push_back(RelationElement{osmid, add_tags(tags), (uint32_t)tags.count, relation_refs});
+    }
+
+    // A block holds one kind of element in practice, sorted files keep nodes, ways then relations
+    template<typename Visitor>
+    void replay(Visitor & visitor) const {
+        TagDelivery<Visitor> delivery(visitor);
+        delivery.strings = &strings;
+        for(const NodeElement & n : nodes)
+            delivery.node(n.id, n.lon, n.lat, get_tags(n.first_tag, n.tag_count));
+        std::vector<uint64_t> way_refs;
+        for(const WayElement & w : ways){
+            way_refs.assign(refs.begin() + w.first_ref, refs.begin() + w.first_ref + w.ref_count);
+            delivery.way(w.id, get_tags(w.first_tag, w.tag_count), way_refs);
+        }
+        for(const RelationElement & r : relations)
+            delivery.relation(r.id, get_tags(r.first_tag, r.tag_count), r.refs);
+    }
+
+private:
+    uint32_t add_tags(const TagIndexes & tags){
+        uint32_t first = tag_indexes.size();
+        for(int i = 0; i < tags.count; ++i){
+            tag_indexes.push_back(tags.keys[i * tags.stride]);
+            tag_indexes.push_back(tags.values[i * tags.stride]);
+        }
+        return first;
+    }
+
+    TagIndexes get_tags(uint32_t first, uint32_t count) const {
+        return TagIndexes{tag_indexes.data() + first, tag_indexes.data() + first + 1, (int)count, 2};
+    }
+};
+
+// Fields of an OSMPBF::Blob pointing into the mapped file, decoded without copying the payload
+struct BlobView {
+    const char* raw = nullptr;
+    int raw_length = 0;
+    const char* zlib_data = nullptr;
+    int zlib_length = 0;
+    int32_t raw_size = 0;
+    bool has_raw = false;
+    bool has_zlib_data = false;
+    bool has_lzma_data = false;
+};
+
+// Messages and buffers reused from one block to the next, so that decoding a block does not
+// allocate once they have grown to the size of the largest block
+struct ParseBuffers {
+    OSMPBF::PrimitiveBlock primblock;
+    std::unique_ptr<char[]> unpack_buffer;
+    std::vector<uint64_t> refs;
+    References references;
+
+    ParseBuffers() : unpack_buffer(new char[max_uncompressed_blob_size]) {}
+};
 
 template<typename Visitor>
 struct Parser {
 
     void parse(){
-        while(!this->file.eof() && !finished) {
+        TagDelivery<Visitor> delivery(this->visitor);
+        while(!finished) {
             OSMPBF::BlobHeader header = this->read_header();
             if(!this->finished){
-                int32_t sz = this->read_blob(header);
+                const char* blob = this->read_blob(header);
                 if(header.type() == "OSMData") {
-                    this->parse_primitiveblock(sz);
+                    parse_blob(blob, header.datasize(), this->buffers, delivery);
                 }
                 else if(header.type() == "OSMHeader"){
                 }
@@ -128,90 +350,305 @@ struct Parser {
         }
     }
 
+    // Pipelined parse: a reader thread pulls the raw blobs from the file, thread_count workers
+    // inflate and decode them, and the calling thread delivers them to the visitor, in file
+    // order unless the visitor accepts unordered blobs. The visitor is never called
+    // concurrently. At most max_blobs_in_flight blobs are read but not yet delivered.
+    void parse_parallel(unsigned thread_count, unsigned max_blobs_in_flight){
+        if(thread_count == 0)
+            thread_count = std::max(1u, std::thread::hardware_concurrency());
+        if(max_blobs_in_flight == 0)
+            max_blobs_in_flight = 4 * thread_count;
+        const bool ordered = !accepts_unordered_blobs<Visitor>::value;
+
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::deque< std::pair<uint64_t, RawBlob> > raw_blobs;
+        std::map<uint64_t, DecodedBlob> decoded_blobs;
+        uint64_t read_count = 0;
+        uint64_t delivered_count = 0;
+        bool is_reading_done = false;
+        // First error of the reader, a worker or the visitor: every thread stops and it is
+        // rethrown to the caller once they are joined
+        std::exception_ptr failure;
+
+        auto stop_on_failure = [&]{
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(!failure)
+                    failure = std::current_exception();
+            }
+            changed.notify_all();
+        };
+
+        std::thread reader([&]{
+            try{
+                while(true){
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        changed.wait(lock, [&]{ return read_count - delivered_count < max_blobs_in_flight || failure; });
+                        if(failure)
+                            break;
+                    }
+                    OSMPBF::BlobHeader header = this->read_header();
+                    if(this->finished)
+                        break;
+                    RawBlob raw;
+                    raw.type = header.type();
+                    raw.data = this->read_blob(header);
+                    raw.size = header.datasize();
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        raw_blobs.push_back(std::make_pair(read_count++, raw));
+                    }
+                    changed.notify_all();
+                }
+            }catch(...){
+                stop_on_failure();
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                is_reading_done = true;
+            }
+            changed.notify_all();
+        });
+
+        std::vector<std::thread> workers;
+        for(unsigned t = 0; t < thread_count; ++t){
+            workers.emplace_back([&]{
+                ParseBuffers local_buffers;
+                while(true){
+                    std::pair<uint64_t, RawBlob> raw;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        changed.wait(lock, [&]{ return !raw_blobs.empty() || is_reading_done || failure; });
+                        if(raw_blobs.empty() || failure)
+                            break;
+                        raw = raw_blobs.front();
+                        raw_blobs.pop_front();
+                    }
+                    DecodedBlob decoded;
+                    try{
+                        if(raw.second.type == "OSMData") {
+                            parse_blob(raw.second.data, raw.second.size, local_buffers, decoded);
+                        }
+                        else if(raw.second.type != "OSMHeader"){
+                            warn() << "  unknown blob type: " << raw.second.type;
+                        }
+                    }catch(...){
+                        stop_on_failure();
+                        break;
+                    }
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        decoded_blobs[raw.first] = std::move(decoded);
+                    }
+                    changed.notify_all();
+                }
+            });
+        }
+
+        while(true){
+            DecodedBlob decoded;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&]{
+                    if(failure || (is_reading_done && delivered_count == read_count))
+                        return true;
+                    return ordered ? decoded_blobs.count(delivered_count) != 0 : !decoded_blobs.empty();
+                });
+                if(failure || (is_reading_done && delivered_count == read_count))
+                    break;
+                auto it = ordered ? decoded_blobs.find(delivered_count) : decoded_blobs.begin();
+                decoded = std::move(it->second);
+                decoded_blobs.erase(it);
+            }
+            try{
+                decoded.replay(this->visitor);
+            }catch(...){
+                stop_on_failure();
+                break;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ++delivered_count;
+            }
+            changed.notify_all();
+        }
+
+        reader.join();
+        for(auto & worker : workers)
+            worker.join();
+        if(failure)
+            std::rethrow_exception(failure);
+    }
+
+    // The file is memory-mapped: blobs are inflated or parsed straight from the mapping
     Parser(const std::string & filename, Visitor & visitor)
-        : visitor(visitor), file(filename.c_str(), std::ios::binary ), finished(false)
+        : visitor(visitor), mapping(nullptr), mapping_size(0), position(0), finished(false)
     {
-        if(!file.is_open())
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if(fd < 0)
             fatal() << "Unable to open the file " << filename;
-        buffer = new char[max_uncompressed_blob_size];
-        unpack_buffer = new char[max_uncompressed_blob_size];
+        struct stat file_status;
+        if(fstat(fd, &file_status) != 0){
+            ::close(fd);
+            fatal() << "Unable to stat the file " << filename;
+        }
+        mapping_size = file_status.st_size;
+        if(mapping_size > 0){
+            void* address = mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(address == MAP_FAILED){
+                ::close(fd);
+                fatal() << "Unable to map the file " << filename;
+            }
+            madvise(address, mapping_size, MADV_SEQUENTIAL);
+            mapping = static_cast<const char*>(address);
+        }
+        ::close(fd);
         info() << "Reading the file" << filename;
     }
 
     ~Parser(){
-        delete[] buffer;
-        delete[] unpack_buffer;
-        google::protobuf::ShutdownProtobufLibrary();
+        if(mapping != nullptr)
+            munmap(const_cast<char*>(mapping), mapping_size);
     }
 
 private:
+    // Blob of the mapped file, not yet inflated
+    struct RawBlob {
+        std::string type;
+        const char* data;
+        int32_t size;
+    };
+
     Visitor & visitor;
-    std::ifstream file;
-    char* buffer;
-    char* unpack_buffer;
+    const char* mapping;
+    uint64_t mapping_size;
+    uint64_t position;
     bool finished;
+    ParseBuffers buffers;
 
     OSMPBF::BlobHeader read_header(){
         int32_t sz;
         OSMPBF::BlobHeader result;
 
         // read the first 4 bytes of the file, this is the size of the blob-header
-        if( !file.read((char*)&sz, 4) ){
+        if(position + 4 > mapping_size){
             info() << "We finished reading the file";
             this->finished = true;
             return result;
         }
+        memcpy(&sz, mapping + position, 4);
+        position += 4;
 
         sz = ntohl(sz);// convert the size from network byte-order to host byte-order
 
         if(sz > max_blob_header_size)
             fatal() << "blob-header-size is bigger then allowed " << sz << " > " << max_blob_header_size;
 
-        this->file.read(this->buffer, sz);
-        if(!this->file.good())
+        if(sz < 0 || position + sz > mapping_size)
             fatal() << "unable to read blob-header from file";
 
-        // parse the blob-header from the read-buffer
-        if(!result.ParseFromArray(this->buffer, sz))
+        // parse the blob-header from the mapping
+        if(!result.ParseFromArray(mapping + position, sz))
             fatal() << "unable to parse blob header";
+        position += sz;
         return result;
     }
 
-    int32_t read_blob(const OSMPBF::BlobHeader & header){
-        OSMPBF::Blob blob;
+    // Returns the blob following header in the mapping
+    const char* read_blob(const OSMPBF::BlobHeader & header){
         // size of the following blob
         int32_t sz = header.datasize();
 
         if(sz > max_uncompressed_blob_size)
             fatal() << "blob-size is bigger then allowed";
 
-        if(!this->file.read(buffer, sz))
+        if(sz < 0 || position + sz > mapping_size)
             fatal() << "unable to read blob from file";
-        if(!blob.ParseFromArray(this->buffer, sz))
-            fatal() << "unable to parse blob";
 
-        // if the blob has uncompressed data
-        if(blob.has_raw()) {
-            // size of the blob-data
-            sz = blob.raw().size();
+        const char* blob = mapping + position;
+        position += sz;
+        return blob;
+    }
+
+    // Decode the fields of an OSMPBF::Blob, the payloads are left in place
+    static BlobView read_blob_view(const char* data, int32_t sz){
+        BlobView view;
+        google::protobuf::io::CodedInputStream input(reinterpret_cast<const uint8_t*>(data), sz);
+        while(uint32_t tag = input.ReadTag()){
+            uint32_t field = tag >> 3;
+            uint32_t wire_type = tag & 7;
+            bool ok = true;
+            if(wire_type == 2){
+                uint32_t length;
+                const void* payload;
+                int available;
+                ok = input.ReadVarint32(&length) && input.GetDirectBufferPointer(&payload, &available) && (uint32_t)available >= length;
+                if(ok){
+                    if(field == 1){
+                        view.has_raw = true;
+                        view.raw = static_cast<const char*>(payload);
+                        view.raw_length = length;
+                    }
+                    else if(field == 3){
+                        view.has_zlib_data = true;
+                        view.zlib_data = static_cast<const char*>(payload);
+                        view.zlib_length = length;
+                    }
+                    else if(field == 4){
+                        view.has_lzma_data = true;
+                    }
+                    ok = input.Skip(length);
+                }
+            }
+            else if(wire_type == 0){
+                uint64_t value;
+                ok = input.ReadVarint64(&value);
+                if(field == 2)
+                    view.raw_size = (int32_t)value;
+            }
+            else if(wire_type == 1){
+                ok = input.Skip(8);
+            }
+            else if(wire_type == 5){
+                ok = input.Skip(4);
+            }
+            else{
+                ok = false;
+            }
+            if(!ok)
+                fatal() << "unable to parse blob";
+        }
+        return view;
+    }
 
+    // Inflate the blob if needed and parse its primitive block
+    template<typename Sink>
+    static void parse_blob(const char* data, int32_t sz, ParseBuffers & buffers, Sink & sink){
+        BlobView blob = read_blob_view(data, sz);
+
+        // if the blob has uncompressed data, it is parsed in place
+        if(blob.has_raw) {
             // check that raw_size is set correctly
-            if(sz != blob.raw_size())
-                warn() << "  reports wrong raw_size: " << blob.raw_size() << " bytes";
+            if(blob.raw_length != blob.raw_size)
+                warn() << "  reports wrong raw_size: " << blob.raw_size << " bytes";
 
-            memcpy(unpack_buffer, blob.raw().c_str(), sz);
-            return sz;
+            parse_primitiveblock(blob.raw, blob.raw_length, buffers, sink);
+            return;
         }
 
 
-        if(blob.has_zlib_data()) {
-            sz = blob.zlib_data().size();
+        if(blob.has_zlib_data) {
+            if(blob.raw_size < 0 || blob.raw_size > max_uncompressed_blob_size)
+                fatal() << "blob-size is bigger then allowed";
 
             z_stream z;
-            z.next_in   = (unsigned char*) blob.zlib_data().c_str();
-            z.avail_in  = sz;
-            z.next_out  = (unsigned char*) unpack_buffer;
-            z.avail_out = blob.raw_size();
+            z.next_in   = (unsigned char*) blob.zlib_data;
+            z.avail_in  = blob.zlib_length;
+            z.next_out  = (unsigned char*) buffers.unpack_buffer.get();
+            z.avail_out = blob.raw_size;
             z.zalloc    = Z_NULL;
             z.zfree     = Z_NULL;
             z.opaque    = Z_NULL;
@@ -225,94 +662,130 @@ private:
             if(inflateEnd(&z) != Z_OK) {
                 fatal() << "failed to deinit zlib stream";
             }
-            return z.total_out;
+            parse_primitiveblock(buffers.unpack_buffer.get(), z.total_out, buffers, sink);
+            return;
         }
 
-        if(blob.has_lzma_data()) {
+        if(blob.has_lzma_data) {
             fatal() << "lzma-decompression is not supported";
         }
-        return 0;
     }
 
-    void parse_primitiveblock(int32_t sz) {
-        OSMPBF::PrimitiveBlock primblock;
-        if(!primblock.ParseFromArray(this->unpack_buffer, sz))
+    template<typename Sink>
+    static void parse_primitiveblock(const char* data, int32_t sz, ParseBuffers & buffers, Sink & sink) {
+        OSMPBF::PrimitiveBlock & primblock = buffers.primblock;
+        if(!primblock.ParseFromArray(data, sz))
             fatal() << "unable to parse primitive block";
 
+        const int64_t lon_offset = primblock.lon_offset();
+        const int64_t lat_offset = primblock.lat_offset();
+        const int64_t granularity = primblock.granularity();
+
+        sink.begin_block(primblock);
+
         for(int i = 0, l = primblock.primitivegroup_size(); i < l; i++) {
-            OSMPBF::PrimitiveGroup pg = primblock.primitivegroup(i);
+            const OSMPBF::PrimitiveGroup & pg = primblock.primitivegroup(i);
 
             // Simple Nodes
             for(int i = 0; i < pg.nodes_size(); ++i) {
-                OSMPBF::Node n = pg.nodes(i);
+                const OSMPBF::Node & n = pg.nodes(i);
 
-                double lon = 0.000000001 * (primblock.lon_offset() + (primblock.granularity() * n.lon())) ;
-                double lat = 0.000000001 * (primblock.lat_offset() + (primblock.granularity() * n.lat())) ;
-                visitor.node_callback(n.id(), lon, lat, get_tags(n, primblock));
+                double lon = 0.000000001 * (lon_offset + (granularity * n.lon())) ;
+                double lat = 0.000000001 * (lat_offset + (granularity * n.lat())) ;
+                sink.node(n.id(), lon, lat, get_tag_indexes(n));
             }
 
             // Dense Nodes
             if(pg.has_dense()) {
-                OSMPBF::DenseNodes dn = pg.dense();
-                uint64_t id = 0;
-                double lon = 0;
-                double lat = 0;
-
+                const OSMPBF::DenseNodes & dn = pg.dense();
+                // ids and coordinates are delta coded, summed as integers
+                int64_t id = 0;
+                int64_t lon = 0;
+                int64_t lat = 0;
+
+                // keys_vals lists the key, value pairs of each node, each list ends with a 0
+                const uint32_t* keys_vals = reinterpret_cast<const uint32_t*>(dn.keys_vals().data());
+                int keys_vals_size = dn.keys_vals_size();
                 int current_kv = 0;
 
                 for(int i = 0; i < dn.id_size(); ++i) {
                     id += dn.id(i);
-                    lon +=  0.000000001 * (primblock.lon_offset() + (primblock.granularity() * dn.lon(i)));
-                    lat +=  0.000000001 * (primblock.lat_offset() + (primblock.granularity() * dn.lat(i)));
-
-                    Tags tags;
-                    while (current_kv < dn.keys_vals_size() && dn.keys_vals(current_kv) != 0){
-                        uint64_t key = dn.keys_vals(current_kv);
-                        uint64_t val = dn.keys_vals(current_kv + 1);
-                        std::string key_string = primblock.stringtable().s(key);
-                        std::string val_string = primblock.stringtable().s(val);
+                    lon += dn.lon(i);
+                    lat += dn.lat(i);
+
+                    TagIndexes tags = {keys_vals, keys_vals, 0, 2};
+                    if(current_kv < keys_vals_size){
+                        tags.keys = keys_vals + current_kv;
+                        tags.values = tags.keys + 1;
+                    }
+                    while (current_kv < keys_vals_size && keys_vals[current_kv] != 0){
                         current_kv += 2;
-                        tags[key_string] = val_string;
+                        ++tags.count;
                     }
                     ++current_kv;
-                    visitor.node_callback(id, lon, lat, tags);
+                    sink.node(id,
+                        0.000000001 * (lon_offset + granularity * lon),
+                        0.000000001 * (lat_offset + granularity * lat),
+                        tags);
                 }
             }
 
             for(int i = 0; i < pg.ways_size(); ++i) {
-                OSMPBF::Way w = pg.ways(i);
+                const OSMPBF::Way & w = pg.ways(i);
 
                 uint64_t ref = 0;
-                std::vector<uint64_t> refs;
+                std::vector<uint64_t> & refs = buffers.refs;
+                refs.resize(w.refs_size());
                 for(int j = 0; j < w.refs_size(); ++j){
                     ref += w.refs(j);
-                    refs.push_back(ref);
+                    refs[j] = ref;
                 }
-                uint64_t id = w.id();
-                visitor.way_callback(id, get_tags(w, primblock), refs);
+                sink.way(w.id(), get_tag_indexes(w), refs);
             }
 
 
             for(int i=0; i < pg.relations_size(); ++i){
-                OSMPBF::Relation rel = pg.relations(i);
+                const OSMPBF::Relation & rel = pg.relations(i);
                 uint64_t id = 0;
-                References refs;
+                References & refs = buffers.references;
+                refs.clear();
 
                 for(int l = 0; l < rel.memids_size(); ++l){
                     id += rel.memids(l);
                     refs.push_back(Reference(rel.types(l), id, primblock.stringtable().s(rel.roles_sid(l))));
                 }
 
-                visitor.relation_callback(rel.id(), get_tags(rel, primblock), refs);
+                sink.relation(rel.id(), get_tag_indexes(rel), refs);
             }
         }
+
+        sink.end_block(primblock);
+    }
+
+    template<typename T>
+    static TagIndexes get_tag_indexes(const T & object){
+        return TagIndexes{object.keys().data(), object.vals().data(), object.keys_size(), 1};
     }
 };
 
+// Release the memory of the protobuf library once the program exits. Called by the programs
+// rather than by each Parser, as several files may be parsed, possibly at the same time.
+inline void shutdown_protobuf_library_at_exit(){
+    static std::once_flag registered;
+    std::call_once(registered, []{ atexit(google::protobuf::ShutdownProtobufLibrary); });
+}
+
+// thread_count > 1 decodes the blobs in parallel (0 uses every core), see Parser::parse_parallel
 template<typename Visitor>
-void read_osm_pbf(const std::string & filename, Visitor & visitor){
+void read_osm_pbf(const std::string & filename, Visitor & visitor, unsigned thread_count, unsigned max_blobs_in_flight){
+    if(thread_count == 0)
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    shutdown_protobuf_library_at_exit();
     Parser<Visitor> p(filename, visitor);
-    p.parse();
+    if(thread_count == 1)
+        p.parse();
+    else
+        p.parse_parallel(thread_count, max_blobs_in_flight);
 }
 
 // nous conservons chaque noeud et le nombre de fois qu'il est utilisé pour détecter les croisements
@@ -336,38 +809,58 @@ struct Node {
 
 
 struct Routing {
-    // La carte stocke l'enxsemble des noeuds lus
-    std::unordered_map<uint64_t, Node> nodes;
+    // Seul le tag highway des ways est lu, sans copier les chaînes de caractères
+    static const TagPolicy tag_policy = TagPolicy::view;
+
+    // Les noeuds lus : tous pendant la lecture, seulement ceux des ways routiers après keep_highway_nodes
+    NodeStore nodes;
+    // Nombre d'utilisations de chaque noeud de nodes, rempli par count_nodes_uses
+    std::vector<int32_t> uses;
 
     // Stocke tous les noeuds de tous les ways faisant parti du réseau routier
     std::vector< std::vector<uint64_t> > ways;
     std::vector<uint64_t> ways_osm;
 
     // Cette méthode est appelée à chaque fois qu'un noeud (Node) est lu
-    void node_callback(uint64_t osmid, double lon, double lat, const Tags &/*tags*/){
-        this->nodes[osmid] = Node(lon, lat);
+    void node_callback(uint64_t osmid, double lon, double lat, const TagView &/*tags*/){
+        this->nodes.add(osmid, lon, lat);
     }
 
     // Cette méthode est appelée chaque fois qu'un Way est lu
-    void way_callback(uint64_t osmid, const Tags &tags, const std::vector<uint64_t> &refs ){
+    void way_callback(uint64_t osmid, const TagView &tags, const std::vector<uint64_t> &refs ){
         // Si le way fait parti du réseau routier nous le conservons
         // Il existe d'autres tags correspondant au réseau routier, cependant pour simplicité, nous ne les gérons pas
         // Homework: read more properties like oneways, bicycle lanes…
-        if(tags.find("highway") != tags.end()){
+        if(tags.has("highway")){
             ways.push_back(refs);
             ways_osm.push_back(osmid);
         }
         
     }
 
+    // Une fois le fichier lu, seuls les noeuds référencés par les ways routiers sont conservés
+    void keep_highway_nodes() {
+        std::vector<uint64_t> referenced;
+        for(const std::vector<uint64_t> & refs : ways)
+            referenced.insert(referenced.end(), refs.begin(), refs.end());
+        nodes.keep_only(referenced);
+        uses.clear();
+    }
+
     // Une fois que tous les ways et nodes sont lus, we count how many times a node is used to detect intersections
+    // Les noeuds absents de l'extrait (ways coupés par sa frontière) sont ignorés
     void count_nodes_uses() {
-        for(std::vector<uint64_t> refs : ways){
+        uses.assign(nodes.size(), 0);
+        for(const std::vector<uint64_t> & refs : ways){
             for(uint64_t ref : refs){
-                nodes.at(ref).uses++;
+                uint64_t node = nodes.find(ref);
+                if(node != invalid_index)
+                    uses[node]++;
             }
             // make sure that the last node is considered as an extremity
-            nodes.at(refs.back()).uses++;
+            uint64_t last = refs.empty() ? invalid_index : nodes.find(refs.back());
+            if(last != invalid_index)
+                uses[last]++;
         }
     }
 
@@ -381,7 +874,8 @@ struct Routing {
                 for(size_t i = 1; i < refs.size(); ++i){
                     uint64_t current_ref = refs[i];
                     // If a node is used more than once, it is an intersection, hence it's a node of the road network graph
-                    if(nodes.at(current_ref).uses > 1){
+                    uint64_t node = nodes.find(current_ref);
+                    if(!uses.empty() && node != invalid_index && uses[node] > 1){
                         // Homework: measure the length of the edge
                         uint64_t target = current_ref;
                         result.push_back(std::make_pair(source, target));
@@ -394,7 +888,7 @@ struct Routing {
     }
 
     // We don't care about relations
-    void relation_callback(uint64_t /*osmid*/, const Tags &/*tags*/, const References & /*refs*/){}
+    void relation_callback(uint64_t /*osmid*/, const TagView &/*tags*/, const References & /*refs*/){}
 };
 
 
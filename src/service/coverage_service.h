@@ -0,0 +1,795 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <climits>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+#include "../graph/graph.h"
+#include "../graph/live_metric.h"
+
+namespace cms {
+
+	/**
+	 * The <code>CoverageService</code> class answers capacity coverage requests of local
+	 * clients on a Unix domain socket, the graph being loaded once for the life of the service.
+	 *
+	 * Protocol, one request per line and one JSON response per line, in request order on
+	 * each connection (a client may pipeline several requests without waiting):
+	 *
+	 *   coverage <request id> <threshold in seconds> [metric=<name>] <position> <position> ...
+	 *       a position is a node index or a "latitude,longitude" pair snapped to the
+	 *       nearest road, the unit then starts from its offset along the arc, e.g.
+	 *       "coverage 7 300 1520 42.5063,1.5218"; the travel times are
+	 *       those of the named metric of the graph, the default one when omitted. Node and
+	 *       arc indexes are those of the graph as loaded from the PBF file, whether it has
+	 *       been renumbered since or not (see Graph::renumber_nodes)
+	 *   -> {"id":7,"threshold":300,"metric":"default","version":0,"units":2,"compute_ms":1.4,"way":[osm way ids],"coverage":[units]}
+	 *      where only the ways covered by at least one unit are listed, and version is the
+	 *      live metric version used (0 for a metric without live updates)
+	 *
+	 *   update <request id> [metric=<name>] <target>=<value> <target>=<value> ...
+	 *       change the travel times of a live metric (see attach_live_metric), a target is
+	 *       "arc:<arc index>" or "way:<osm way id>" (every arc of the way) and a value a
+	 *       travel time in milliseconds, "closed", "restore" or "x<factor>" to slow down the
+	 *       travel time of the graph, e.g. "update 8 way:6166082=closed way:24915502=x3"
+	 *   -> {"id":8,"metric":"default","version":3,"arcs":4}
+	 *      the coverage requests use the new travel times once version is published
+	 *
+	 *   stats
+	 *   -> {"requests":...,"rejected":...,"queued":...,"p50_ms":...,"p99_ms":...}
+	 *
+	 *   metrics
+	 *   -> {"metrics":"<counters and histograms in the Prometheus text format>"}
+	 *   trace on|off|dump
+	 *   -> {"tracing":true|false}, or for dump the phases timed while tracing was on, in
+	 *      the Chrome trace event JSON format
+	 *      the metrics and the trace are empty unless the service is compiled with
+	 *      CMS_INSTRUMENTATION, see utils/instrumentation.h
+	 *
+	 * Errors are answered as {"id":7,"error":"..."}. Requests are computed by a pool of
+	 * workers, each with its own search workspace, and their cost only depends on the size
+	 * of the isochrones, not on the size of the graph. Admission control bounds the queue of
+	 * the service and the requests in progress of each connection: a request over a limit is
+	 * answered "busy" at once instead of delaying the other clients. Each connection has its
+	 * own writer thread, so that a client slow to read its responses only stalls itself.
+	 */
+	class CoverageService {
+	  public:
+
+		struct Options {
+			unsigned worker_count = 0;					// 0 uses every core
+			unsigned max_queued_requests = 64;			// requests waiting for a worker
+			unsigned max_requests_per_connection = 8;	// requests in progress per connection
+			unsigned max_units_per_request = 100000;
+			unsigned max_request_length = 4 << 20;		// bytes of a request line
+			unsigned max_threshold = 3600;				// seconds
+			float snap_radius = 1000;					// meters, to snap a latitude,longitude position
+			unsigned latency_window = 4096;				// latest requests used for the percentiles
+		};
+
+		explicit CoverageService(GraphCH& graph) : CoverageService(graph, Options()) {}
+
+		// The graph is only read once its arc snapping index is built
+		CoverageService(GraphCH& graph, const Options& options)
+			: graph(graph), options(options), listen_fd(-1), is_stop_requested(false),
+			  request_count(0), rejected_count(0)
+		{
+			graph.build_arc_snapper();
+			if(this->options.worker_count == 0)
+				this->options.worker_count = std::max(1u, std::thread::hardware_concurrency());
+
+			// Arcs entering each node, to find the arcs of the nodes reached by the units
+			in_first_out.assign(graph.node_count + 1, 0);
+			for(unsigned a = 0; a < graph.arc_count; ++a)
+				++in_first_out[graph.head[a] + 1];
+			for(unsigned x = 0; x < graph.node_count; ++x)
+				in_first_out[x + 1] += in_first_out[x];
+			in_arc.resize(graph.arc_count);
+			std::vector<unsigned> next_in = in_first_out;
+			for(unsigned a = 0; a < graph.arc_count; ++a)
+				in_arc[next_in[graph.head[a]]++] = a;
+		}
+
+		CoverageService(const CoverageService&) = delete;
+		CoverageService& operator=(const CoverageService&) = delete;
+
+		/**
+		 * Answer the requests of the metric of live_metric with its latest snapshot, and
+		 * accept its update requests. live_metric must outlive the service.
+		 *
+		 * @prerequisite to be called before serve.
+		 */
+		void attach_live_metric(LiveMetric& live_metric) {
+			live_metrics.resize(graph.get_metric_count(), nullptr);
+			live_metrics[live_metric.get_metric()] = &live_metric;
+
+			// Arcs of each way, for the updates given by OSM way id
+			if(way_first_arc.empty()){
+				way_first_arc.assign(graph.way_osmid.size() + 1, 0);
+				for(unsigned a = 0; a < graph.arc_count; ++a)
+					++way_first_arc[graph.way[a] + 1];
+				for(unsigned w = 0; w < graph.way_osmid.size(); ++w)
+					way_first_arc[w + 1] += way_first_arc[w];
+				way_arc.resize(graph.arc_count);
+				std::vector<unsigned> next_arc(way_first_arc.begin(), way_first_arc.end() - 1);
+				for(unsigned a = 0; a < graph.arc_count; ++a)
+					way_arc[next_arc[graph.way[a]]++] = a;
+			}
+		}
+
+		/**
+		 * Listen on socket_path and serve the clients until request_stop() is called.
+		 */
+		void serve(const std::string& socket_path) {
+			listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+			if(listen_fd < 0)
+				throw std::runtime_error("Unable to create the service socket");
+			sockaddr_un address;
+			memset(&address, 0, sizeof(address));
+			address.sun_family = AF_UNIX;
+			if(socket_path.size() >= sizeof(address.sun_path))
+				throw std::runtime_error("Socket path too long: " + socket_path);
+			strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+			unlink(socket_path.c_str());
+			if(bind(listen_fd, (sockaddr*)&address, sizeof(address)) != 0 || listen(listen_fd, 64) != 0){
+				::close(listen_fd);
+				throw std::runtime_error("Unable to listen on " + socket_path);
+			}
+
+			cout_message("Coverage service listening on " + socket_path + " with " + std::to_string(options.worker_count) + " worker(s)");
+
+			std::vector<std::thread> workers;
+			for(unsigned t = 0; t < options.worker_count; ++t)
+				workers.emplace_back([this]{ run_worker(); });
+
+			std::deque<ConnectionThreads> connections;
+			while(!is_stop_requested){
+				// Join the threads of the connections closed by their client
+				for(auto it = connections.begin(); it != connections.end();){
+					bool is_closed;
+					{
+						std::lock_guard<std::mutex> lock(it->connection->mutex);
+						is_closed = it->connection->is_closed;
+					}
+					if(is_closed){
+						it->reader.join();
+						it->writer.join();
+						it = connections.erase(it);
+					}else{
+						++it;
+					}
+				}
+
+				pollfd listen_poll = {listen_fd, POLLIN, 0};
+				if(poll(&listen_poll, 1, 200) <= 0)
+					continue;
+				int fd = accept(listen_fd, nullptr, nullptr);
+				if(fd < 0)
+					continue;
+				std::shared_ptr<Connection> connection(new Connection(fd));
+				connections.emplace_back();
+				connections.back().connection = connection;
+				connections.back().reader = std::thread([this, connection]{ read_requests(connection); });
+				connections.back().writer = std::thread([this, connection]{ write_responses(connection); });
+			}
+
+			// Stop reading, let the workers answer the queued requests, then close
+			::close(listen_fd);
+			unlink(socket_path.c_str());
+			for(auto& connection_threads : connections){
+				Connection& connection = *connection_threads.connection;
+				std::lock_guard<std::mutex> lock(connection.mutex);
+				if(!connection.is_closed)
+					shutdown(connection.fd, SHUT_RD);
+			}
+			{
+				std::lock_guard<std::mutex> lock(queue_mutex);
+				is_queue_closed = true;
+			}
+			queue_changed.notify_all();
+			for(auto& worker : workers)
+				worker.join();
+			for(auto& connection_threads : connections){
+				connection_threads.reader.join();
+				connection_threads.writer.join();
+			}
+
+			cout_message("Coverage service stopped: " + get_stats());
+		}
+
+		/**
+		 * Make serve() return, safe to call from a signal handler.
+		 */
+		void request_stop() {
+			is_stop_requested = true;
+		}
+
+		/**
+		 * Request counters and latency percentiles (from the reception of a request to its
+		 * response being ready) of the latest latency_window requests, as a JSON object.
+		 */
+		std::string get_stats() {
+			std::vector<long long> latencies;
+			{
+				std::lock_guard<std::mutex> lock(stats_mutex);
+				latencies = latency_window;
+			}
+			unsigned queued;
+			{
+				std::lock_guard<std::mutex> lock(queue_mutex);
+				queued = jobs.size();
+			}
+
+			std::string text;
+			StringOutputStream stream(text);
+			rapidjson::Writer<StringOutputStream> writer(stream);
+			writer.StartObject();
+			writer.Key("requests");
+			writer.Uint64(request_count);
+			writer.Key("rejected");
+			writer.Uint64(rejected_count);
+			writer.Key("queued");
+			writer.Uint(queued);
+			writer.Key("p50_ms");
+			writer.Double(percentile(latencies, 0.50) / 1000.0);
+			writer.Key("p99_ms");
+			writer.Double(percentile(latencies, 0.99) / 1000.0);
+			writer.EndObject();
+			return text;
+		}
+
+		/**
+		 * Answer the metrics and trace requests.
+		 */
+		std::string get_instrumentation(const std::string& request) {
+			instrumentation::Registry& registry = instrumentation::Registry::get();
+			if(request == "trace dump")
+				return registry.get_chrome_trace_json();
+
+			std::string text;
+			StringOutputStream stream(text);
+			rapidjson::Writer<StringOutputStream> writer(stream);
+			writer.StartObject();
+			if(request == "metrics"){
+				std::string metrics = registry.get_prometheus_text();
+				writer.Key("metrics");
+				writer.String(metrics.c_str(), metrics.size());
+			}else if(request == "trace on" || request == "trace off"){
+				registry.set_tracing_enabled(request == "trace on");
+				writer.Key("tracing");
+				writer.Bool(registry.is_tracing_enabled());
+			}else{
+				writer.Key("error");
+				writer.String("unknown trace command, expected on, off or dump");
+			}
+			writer.EndObject();
+			return text;
+		}
+
+		// Per worker buffers
+		struct Workspace {
+			IsochroneQuery query;
+			unsigned metric;						// metric the query is bound to
+			std::shared_ptr<const LiveMetric::Snapshot> snapshot;	// live weights the query is bound to
+			std::vector<unsigned> coverage_node;
+			std::vector<unsigned> reached_nodes;	// nodes with a non null coverage
+			std::vector<unsigned> coverage_way;
+			std::vector<unsigned> covered_ways;		// ways with a non null coverage
+			std::vector<unsigned> source_list;		// units given by node
+			std::vector<SnappedPosition> positions;	// units given by latitude,longitude
+		};
+
+		Workspace make_workspace() const {
+			Workspace workspace;
+			workspace.query.bind(graph.first_out, graph.head, graph.travel_time);
+			workspace.metric = 0;
+			workspace.coverage_node.assign(graph.node_count, 0);
+			workspace.coverage_way.assign(graph.way_osmid.size(), 0);
+			return workspace;
+		}
+
+		/**
+		 * Answer one request line, as a worker would. workspace is reused across calls.
+		 */
+		std::string answer(const std::string& request, Workspace& workspace);
+
+		/**
+		 * Queue the travel time changes of an update request line.
+		 */
+		std::string update(const std::string& request);
+
+	  private:
+		struct Connection {
+			int fd;
+			std::mutex mutex;
+			std::condition_variable changed;
+			uint64_t next_sequence = 0;				// of the next request read
+			uint64_t next_to_write = 0;				// of the next response to write
+			std::map<uint64_t, std::string> responses;	// ready, not yet written
+			unsigned in_progress = 0;
+			bool is_reading_done = false;
+			bool is_closed = false;
+
+			explicit Connection(int fd) : fd(fd) {}
+		};
+
+		struct ConnectionThreads {
+			std::shared_ptr<Connection> connection;
+			std::thread reader;
+			std::thread writer;
+		};
+
+		struct Job {
+			std::shared_ptr<Connection> connection;
+			uint64_t sequence;
+			std::string request;
+			long long received_time;
+		};
+
+		const GraphCH& graph;
+		Options options;
+		int listen_fd;
+		std::atomic<bool> is_stop_requested;
+
+		std::mutex queue_mutex;
+		std::condition_variable queue_changed;
+		std::deque<Job> jobs;
+		bool is_queue_closed = false;
+
+		std::mutex stats_mutex;
+		std::atomic<uint64_t> request_count;
+		std::atomic<uint64_t> rejected_count;
+		std::vector<long long> latency_window;
+		uint64_t latency_position = 0;
+
+		// Live metric of each metric id, if any, and arcs of each way for their updates
+		std::vector<LiveMetric*> live_metrics;
+		std::vector<unsigned> way_first_arc;
+		std::vector<unsigned> way_arc;
+		std::vector<unsigned> in_first_out;
+		std::vector<unsigned> in_arc;
+
+		static double percentile(std::vector<long long>& values, double rank) {
+			if(values.empty())
+				return 0;
+			size_t k = std::min(values.size() - 1, (size_t)(rank * values.size()));
+			std::nth_element(values.begin(), values.begin() + k, values.end());
+			return values[k];
+		}
+
+		void record_latency(long long microseconds) {
+			std::lock_guard<std::mutex> lock(stats_mutex);
+			if(latency_window.size() < options.latency_window)
+				latency_window.push_back(microseconds);
+			else
+				latency_window[latency_position++ % options.latency_window] = microseconds;
+		}
+
+		static std::string error_response(const std::string& id, const std::string& message) {
+			std::string text;
+			StringOutputStream stream(text);
+			rapidjson::Writer<StringOutputStream> writer(stream);
+			writer.StartObject();
+			writer.Key("id");
+			writer.String(id.c_str());
+			writer.Key("error");
+			writer.String(message.c_str());
+			writer.EndObject();
+			return text;
+		}
+
+		static std::string get_request_id(const std::string& request) {
+			std::istringstream stream(request);
+			std::string command, id;
+			stream >> command >> id;
+			return id;
+		}
+
+		void complete(const std::shared_ptr<Connection>& connection, uint64_t sequence, std::string response, bool was_queued) {
+			{
+				std::lock_guard<std::mutex> lock(connection->mutex);
+				connection->responses[sequence] = std::move(response);
+				if(was_queued)
+					--connection->in_progress;
+			}
+			connection->changed.notify_all();
+		}
+
+		void read_requests(std::shared_ptr<Connection> connection) {
+			std::string pending;
+			char buffer[65536];
+			while(true){
+				ssize_t size = read(connection->fd, buffer, sizeof(buffer));
+				if(size <= 0)
+					break;
+				pending.append(buffer, size);
+				size_t line_start = 0;
+				for(size_t line_end; (line_end = pending.find('\n', line_start)) != std::string::npos; line_start = line_end + 1){
+					std::string request = pending.substr(line_start, line_end - line_start);
+					if(!request.empty() && request.back() == '\r')
+						request.pop_back();
+					if(request.size() > options.max_request_length)
+						reject_too_long(connection, request);
+					else if(!request.empty())
+						admit(connection, request);
+				}
+				pending.erase(0, line_start);
+				// A line that never ends would hold the memory of the service: the
+				// connection is answered an error and no longer read
+				if(pending.size() > options.max_request_length){
+					reject_too_long(connection, pending);
+					break;
+				}
+			}
+			{
+				std::lock_guard<std::mutex> lock(connection->mutex);
+				connection->is_reading_done = true;
+			}
+			connection->changed.notify_all();
+		}
+
+		void reject_too_long(const std::shared_ptr<Connection>& connection, const std::string& request) {
+			uint64_t sequence;
+			{
+				std::lock_guard<std::mutex> lock(connection->mutex);
+				sequence = connection->next_sequence++;
+			}
+			++request_count;
+			++rejected_count;
+			complete(connection, sequence, error_response(get_request_id(request.substr(0, 256)), "request longer than " + std::to_string(options.max_request_length) + " bytes"), false);
+		}
+
+		void admit(const std::shared_ptr<Connection>& connection, const std::string& request) {
+			uint64_t sequence;
+			bool is_admitted = false;
+			{
+				std::lock_guard<std::mutex> lock(connection->mutex);
+				sequence = connection->next_sequence++;
+			}
+
+			if(request == "stats"){
+				complete(connection, sequence, get_stats(), false);
+				return;
+			}
+			if(request == "metrics" || request.compare(0, 6, "trace ") == 0){
+				complete(connection, sequence, get_instrumentation(request), false);
+				return;
+			}
+			// Updates are only queued, they are answered at once
+			if(request.compare(0, 7, "update ") == 0){
+				complete(connection, sequence, update(request), false);
+				return;
+			}
+
+			++request_count;
+			{
+				std::lock_guard<std::mutex> connection_lock(connection->mutex);
+				std::lock_guard<std::mutex> queue_lock(queue_mutex);
+				if(!is_queue_closed && jobs.size() < options.max_queued_requests && connection->in_progress < options.max_requests_per_connection){
+					jobs.push_back(Job{connection, sequence, request, RoutingKit::get_micro_time()});
+					++connection->in_progress;
+					is_admitted = true;
+				}
+			}
+			if(is_admitted){
+				queue_changed.notify_one();
+			}else{
+				++rejected_count;
+				complete(connection, sequence, error_response(get_request_id(request), "busy"), false);
+			}
+		}
+
+		void write_responses(std::shared_ptr<Connection> connection) {
+			std::string response;
+			while(true){
+				{
+					std::unique_lock<std::mutex> lock(connection->mutex);
+					connection->changed.wait(lock, [&]{
+						return connection->responses.count(connection->next_to_write) != 0
+							|| (connection->is_reading_done && connection->next_to_write == connection->next_sequence);
+					});
+					auto it = connection->responses.find(connection->next_to_write);
+					if(it == connection->responses.end())
+						break;
+					response.swap(it->second);
+					connection->responses.erase(it);
+					++connection->next_to_write;
+				}
+				response.push_back('\n');
+				size_t written = 0;
+				while(written < response.size()){
+					ssize_t size = send(connection->fd, response.data() + written, response.size() - written, MSG_NOSIGNAL);
+					if(size <= 0)
+						break;
+					written += size;
+				}
+			}
+			std::lock_guard<std::mutex> lock(connection->mutex);
+			::close(connection->fd);
+			connection->is_closed = true;
+		}
+
+		void run_worker() {
+			Workspace workspace = make_workspace();
+			while(true){
+				Job job;
+				{
+					std::unique_lock<std::mutex> lock(queue_mutex);
+					queue_changed.wait(lock, [&]{ return !jobs.empty() || is_queue_closed; });
+					if(jobs.empty())
+						break;
+					job = std::move(jobs.front());
+					jobs.pop_front();
+				}
+				CMS_HISTOGRAM_RECORD("service.queue_wait_microseconds", RoutingKit::get_micro_time() - job.received_time);
+				std::string response;
+				{
+					CMS_SCOPED_TIMER("service.request_microseconds");
+					response = answer(job.request, workspace);
+				}
+				record_latency(RoutingKit::get_micro_time() - job.received_time);
+				complete(job.connection, job.sequence, std::move(response), true);
+			}
+		}
+	};
+
+	inline std::string CoverageService::answer(const std::string& request, Workspace& workspace) {
+		long long start_time = RoutingKit::get_micro_time();
+
+		std::istringstream stream(request);
+		std::string command, id, token;
+		unsigned threshold;
+		stream >> command >> id;
+		if(command != "coverage")
+			return error_response(id, "unknown command " + command);
+		if(!(stream >> threshold))
+			return error_response(id, "missing threshold");
+		if(threshold > options.max_threshold)
+			return error_response(id, "threshold above " + std::to_string(options.max_threshold) + " seconds");
+
+		// Metric and unit positions
+		unsigned metric = 0;
+		workspace.source_list.clear();
+		workspace.positions.clear();
+		while(stream >> token){
+			if(token.compare(0, 7, "metric=") == 0){
+				try{
+					metric = graph.get_metric_id(token.substr(7));
+				}catch(std::exception& err){
+					return error_response(id, err.what());
+				}
+				continue;
+			}
+			if(workspace.source_list.size() + workspace.positions.size() == options.max_units_per_request)
+				return error_response(id, "more than " + std::to_string(options.max_units_per_request) + " units");
+			size_t comma = token.find(',');
+			char* end = nullptr;
+			if(comma == std::string::npos){
+				// Node ids of the graph before its renumbering, if any
+				unsigned long external_node = strtoul(token.c_str(), &end, 10);
+				unsigned node = external_node <= UINT_MAX ? graph.get_node_of_external_id(external_node) : RoutingKit::invalid_id;
+				if(*end != '\0' || node == RoutingKit::invalid_id)
+					return error_response(id, "invalid node " + token);
+				workspace.source_list.push_back(node);
+			}else{
+				const char* latitude_text = token.c_str();
+				const char* longitude_text = latitude_text + comma + 1;
+				float latitude = strtof(latitude_text, &end);
+				if(end == latitude_text || end != longitude_text - 1)
+					return error_response(id, "invalid position " + token);
+				float longitude = strtof(longitude_text, &end);
+				if(end == longitude_text || *end != '\0')
+					return error_response(id, "invalid position " + token);
+				SnappedPosition position = graph.snap_position(latitude, longitude, options.snap_radius);
+				if(!position.is_valid())
+					return error_response(id, "no road within " + std::to_string((int)options.snap_radius) + " meters of " + token);
+				workspace.positions.push_back(position);
+			}
+		}
+
+		// The weights of a live metric are read from its latest snapshot, held to the end of
+		// the request
+		LiveMetric* live_metric = metric < live_metrics.size() ? live_metrics[metric] : nullptr;
+		std::shared_ptr<const LiveMetric::Snapshot> snapshot;
+		if(live_metric != nullptr)
+			snapshot = live_metric->get_snapshot();
+		if(metric != workspace.metric || snapshot != workspace.snapshot){
+			if(snapshot)
+				workspace.query.bind(graph.first_out, graph.head, snapshot->travel_time);
+			else
+				workspace.query.bind(graph.first_out, graph.head, graph.get_metric_travel_time(metric));
+			workspace.metric = metric;
+			workspace.snapshot = snapshot;
+		}
+
+		// Node coverage, only the nodes reached are touched
+		auto cover_reached_nodes = [&]{
+			workspace.query.run(threshold * 1000);
+			for(unsigned x : workspace.query.get_reached_nodes()){
+				if(workspace.coverage_node[x]++ == 0)
+					workspace.reached_nodes.push_back(x);
+			}
+		};
+		for(unsigned s : workspace.source_list){
+			workspace.query.reset().add_source(s);
+			cover_reached_nodes();
+		}
+		// A unit along an arc reaches its extremities after the travel time to them
+		for(const SnappedPosition& position : workspace.positions){
+			if(snapshot)
+				graph.add_snapped_source(workspace.query.reset(), position, snapshot->travel_time);
+			else
+				graph.add_snapped_source(workspace.query.reset(), position, graph.get_metric_travel_time(metric));
+			cover_reached_nodes();
+		}
+
+		// Way coverage: the largest arc coverage of the way, an arc being covered as in
+		// GraphCH::compute_capacity_coverage_way
+		ConstArray<unsigned> first_out = graph.first_out;
+		ConstArray<unsigned> head = graph.head;
+		ConstArray<unsigned> way = graph.way;
+		auto cover_arc = [&](unsigned a){
+			unsigned coverage = (workspace.coverage_node[graph.tail[a]] + workspace.coverage_node[head[a]]) / 2;
+			if(coverage == 0)
+				return;
+			unsigned& way_coverage = workspace.coverage_way[way[a]];
+			if(way_coverage == 0)
+				workspace.covered_ways.push_back(way[a]);
+			way_coverage = std::max(way_coverage, coverage);
+		};
+		for(unsigned x : workspace.reached_nodes){
+			for(unsigned a = first_out[x]; a < first_out[x+1]; ++a)
+				cover_arc(a);
+			for(unsigned i = in_first_out[x]; i < in_first_out[x+1]; ++i)
+				cover_arc(in_arc[i]);
+		}
+		std::sort(workspace.covered_ways.begin(), workspace.covered_ways.end());
+
+		std::string text;
+		StringOutputStream output(text);
+		rapidjson::Writer<StringOutputStream> writer(output);
+		writer.StartObject();
+		writer.Key("id");
+		writer.String(id.c_str());
+		writer.Key("threshold");
+		writer.Uint(threshold);
+		writer.Key("metric");
+		writer.String(graph.get_metric_name(metric).c_str());
+		writer.Key("version");
+		writer.Uint64(snapshot ? snapshot->version : 0);
+		writer.Key("units");
+		writer.Uint(workspace.source_list.size() + workspace.positions.size());
+		writer.Key("compute_ms");
+		writer.Double((RoutingKit::get_micro_time() - start_time) / 1000.0);
+		writer.Key("way");
+		writer.StartArray();
+		for(unsigned w : workspace.covered_ways)
+			writer.Uint64(graph.way_osmid[w]);
+		writer.EndArray();
+		writer.Key("coverage");
+		writer.StartArray();
+		for(unsigned w : workspace.covered_ways)
+			writer.Uint(workspace.coverage_way[w]);
+		writer.EndArray();
+		writer.EndObject();
+
+		// Leave the workspace clean for the next request
+		for(unsigned x : workspace.reached_nodes)
+			workspace.coverage_node[x] = 0;
+		workspace.reached_nodes.clear();
+		for(unsigned w : workspace.covered_ways)
+			workspace.coverage_way[w] = 0;
+		workspace.covered_ways.clear();
+
+		return text;
+	}
+
+	inline std::string CoverageService::update(const std::string& request) {
+		std::istringstream stream(request);
+		std::string command, id, token;
+		stream >> command >> id;
+
+		unsigned metric = 0;
+		std::vector<ArcWeightUpdate> updates;
+		while(stream >> token){
+			if(token.compare(0, 7, "metric=") == 0){
+				try{
+					metric = graph.get_metric_id(token.substr(7));
+				}catch(std::exception& err){
+					return error_response(id, err.what());
+				}
+				continue;
+			}
+
+			// Arcs of the target
+			size_t equal = token.find('=');
+			if(equal == std::string::npos)
+				return error_response(id, "invalid update " + token);
+			std::string target = token.substr(0, equal), value = token.substr(equal + 1);
+			char* end = nullptr;
+			unsigned first_arc, last_arc;
+			const unsigned* arcs;
+			unsigned single_arc;
+			if(target.compare(0, 4, "arc:") == 0){
+				unsigned long external_arc = strtoul(target.c_str() + 4, &end, 10);
+				unsigned arc = external_arc <= UINT_MAX ? graph.get_arc_of_external_id(external_arc) : RoutingKit::invalid_id;
+				if(*end != '\0' || target.size() == 4 || arc == RoutingKit::invalid_id)
+					return error_response(id, "invalid arc " + target);
+				single_arc = arc;
+				arcs = &single_arc;
+				first_arc = 0;
+				last_arc = 1;
+			}else if(target.compare(0, 4, "way:") == 0){
+				unsigned long long osmid = strtoull(target.c_str() + 4, &end, 10);
+				auto it = std::lower_bound(graph.way_osmid.begin(), graph.way_osmid.end(), osmid);
+				if(*end != '\0' || it == graph.way_osmid.end() || *it != osmid || way_first_arc.empty())
+					return error_response(id, "unknown way " + target);
+				unsigned w = it - graph.way_osmid.begin();
+				arcs = way_arc.data();
+				first_arc = way_first_arc[w];
+				last_arc = way_first_arc[w + 1];
+			}else{
+				return error_response(id, "invalid update target " + target);
+			}
+
+			// New travel time
+			ConstArray<unsigned> base_travel_time = graph.get_metric_travel_time(metric);
+			for(unsigned i = first_arc; i < last_arc; ++i){
+				unsigned a = arcs[i];
+				if(value == "closed"){
+					updates.emplace_back(a, RoutingKit::inf_weight);
+				}else if(value == "restore"){
+					updates.emplace_back(a, base_travel_time[a]);
+				}else if(!value.empty() && value[0] == 'x'){
+					double factor = strtod(value.c_str() + 1, &end);
+					if(*end != '\0' || !(factor > 0))
+						return error_response(id, "invalid slow down factor " + value);
+					double slowed = base_travel_time[a] * factor;
+					updates.emplace_back(a, slowed >= RoutingKit::inf_weight ? RoutingKit::inf_weight - 1 : (unsigned)slowed);
+				}else{
+					unsigned long travel_time = strtoul(value.c_str(), &end, 10);
+					if(*end != '\0' || value.empty() || travel_time >= RoutingKit::inf_weight)
+						return error_response(id, "invalid travel time " + value);
+					updates.emplace_back(a, travel_time);
+				}
+			}
+		}
+
+		LiveMetric* live_metric = metric < live_metrics.size() ? live_metrics[metric] : nullptr;
+		if(live_metric == nullptr)
+			return error_response(id, "metric " + graph.get_metric_name(metric) + " has no live updates");
+		uint64_t version = live_metric->update_arcs(updates);
+
+		std::string text;
+		StringOutputStream output(text);
+		rapidjson::Writer<StringOutputStream> writer(output);
+		writer.StartObject();
+		writer.Key("id");
+		writer.String(id.c_str());
+		writer.Key("metric");
+		writer.String(graph.get_metric_name(metric).c_str());
+		writer.Key("version");
+		writer.Uint64(version);
+		writer.Key("arcs");
+		writer.Uint(updates.size());
+		writer.EndObject();
+		return text;
+	}
+
+}
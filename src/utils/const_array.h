@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace cms {
+
+	/**
+	 * Read-only view on a contiguous array: a vector, or a section of a mapped flat graph
+	 * file (see GraphFileView::get). The array is referenced, not copied, and must outlive
+	 * the view without being reallocated.
+	 *
+	 * A std::vector converts implicitly, so that code reading a graph column does not
+	 * depend on where the column is stored.
+	 */
+	template<class T>
+	class ConstArray {
+	  public:
+
+		typedef T value_type;
+
+		ConstArray() : pointer(nullptr), length(0) {}
+
+		ConstArray(const T* data, size_t size) : pointer(data), length(size) {}
+
+		ConstArray(const std::vector<T>& vector) : pointer(vector.data()), length(vector.size()) {}
+
+		const T* data() const { return pointer; }
+		size_t size() const { return length; }
+		bool empty() const { return length == 0; }
+
+		const T* begin() const { return pointer; }
+		const T* end() const { return pointer + length; }
+		const T& operator[](size_t i) const { return pointer[i]; }
+		const T& front() const { return pointer[0]; }
+		const T& back() const { return pointer[length - 1]; }
+
+		std::vector<T> to_vector() const { return std::vector<T>(pointer, pointer + length); }
+
+	  private:
+		const T* pointer;
+		size_t length;
+	};
+
+}
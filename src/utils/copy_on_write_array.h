@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+
+#include "const_array.h"
+
+namespace cms {
+
+	/**
+	 * Array split into fixed size chunks that are shared between its copies: copying the
+	 * array only copies the chunk pointers, and set copies a chunk the first time it is
+	 * written while another copy still holds it. A copy that is never written, e.g. a
+	 * published snapshot, therefore stays unchanged while the original is updated, and the
+	 * untouched chunks are stored once.
+	 *
+	 * Copies may be read and dropped from any thread; only one thread may write a given copy.
+	 */
+	template<class T, unsigned chunk_bits = 14>
+	class CopyOnWriteArray {
+	  public:
+
+		typedef T value_type;
+
+		static const size_t chunk_size = (size_t)1 << chunk_bits;
+
+		CopyOnWriteArray() : length(0) {}
+
+		explicit CopyOnWriteArray(ConstArray<T> values) : length(values.size()) {
+			for(size_t begin = 0; begin < length; begin += chunk_size){
+				size_t end = std::min(begin + chunk_size, length);
+				chunk.push_back(std::make_shared< std::vector<T> >(values.begin() + begin, values.begin() + end));
+			}
+		}
+
+		size_t size() const { return length; }
+		bool empty() const { return length == 0; }
+
+		const T& operator[](size_t i) const {
+			return (*chunk[i >> chunk_bits])[i & (chunk_size - 1)];
+		}
+
+		void set(size_t i, const T& value) {
+			std::shared_ptr< std::vector<T> >& c = chunk[i >> chunk_bits];
+			if(c.use_count() != 1)
+				c = std::make_shared< std::vector<T> >(*c);
+			else
+				// Order the write after the reads of the copies that released the chunk
+				std::atomic_thread_fence(std::memory_order_acquire);
+			(*c)[i & (chunk_size - 1)] = value;
+		}
+
+		std::vector<T> to_vector() const {
+			std::vector<T> values;
+			values.reserve(length);
+			for(const std::shared_ptr< std::vector<T> >& c : chunk)
+				values.insert(values.end(), c->begin(), c->end());
+			return values;
+		}
+
+	  private:
+		std::vector< std::shared_ptr< std::vector<T> > > chunk;
+		size_t length;
+	};
+
+}
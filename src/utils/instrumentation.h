@@ -0,0 +1,327 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <cctype>
+#include <algorithm>
+#include <stdexcept>
+#include <unistd.h>
+
+/**
+ * Hot path instrumentation: named counters, histograms and scoped phase timers.
+ *
+ * The macros below compile to nothing unless CMS_INSTRUMENTATION is defined (e.g. with
+ * -DCMS_INSTRUMENTATION), so an uninstrumented build pays nothing:
+ *
+ *   CMS_COUNTER_ADD("isochrone.runs", 1);
+ *   CMS_HISTOGRAM_RECORD("service.request_units", unit_count);
+ *   CMS_SCOPED_TIMER("coverage.arc_aggregation");   // until the end of the scope
+ *
+ * Names must be string literals. Each thread records in its own slots, without lock nor
+ * shared cache line, and the values of all the threads are only summed when exported with
+ * get_prometheus_text. Scoped timers feed a histogram of their duration in microseconds and,
+ * while tracing is enabled (see set_tracing_enabled), a trace event exported with
+ * get_chrome_trace_json for chrome://tracing or Perfetto.
+ */
+#ifdef CMS_INSTRUMENTATION
+#define CMS_INSTRUMENTATION_CONCAT_(a, b) a##b
+#define CMS_INSTRUMENTATION_CONCAT(a, b) CMS_INSTRUMENTATION_CONCAT_(a, b)
+#define CMS_COUNTER_ADD(name, value) do { \
+		static const unsigned cms_metric_id = ::cms::instrumentation::Registry::get().get_metric_id(name, ::cms::instrumentation::counter_kind); \
+		::cms::instrumentation::get_thread_metrics().add(cms_metric_id, value); \
+	} while(0)
+#define CMS_HISTOGRAM_RECORD(name, value) do { \
+		static const unsigned cms_metric_id = ::cms::instrumentation::Registry::get().get_metric_id(name, ::cms::instrumentation::histogram_kind); \
+		::cms::instrumentation::get_thread_metrics().record(cms_metric_id, value); \
+	} while(0)
+#define CMS_SCOPED_TIMER(name) \
+	static const unsigned CMS_INSTRUMENTATION_CONCAT(cms_timer_id_, __LINE__) = ::cms::instrumentation::Registry::get().get_metric_id(name, ::cms::instrumentation::histogram_kind); \
+	::cms::instrumentation::ScopedTimer CMS_INSTRUMENTATION_CONCAT(cms_timer_, __LINE__)(CMS_INSTRUMENTATION_CONCAT(cms_timer_id_, __LINE__))
+#else
+#define CMS_COUNTER_ADD(name, value) do {} while(0)
+#define CMS_HISTOGRAM_RECORD(name, value) do {} while(0)
+#define CMS_SCOPED_TIMER(name) do {} while(0)
+#endif
+
+namespace cms {
+namespace instrumentation {
+
+	const unsigned max_metric_count = 128;
+	// Bucket b holds the values of b significant bits, i.e. up to 2^b - 1; the last one has no bound
+	const unsigned histogram_bucket_count = 40;
+	// Trace events kept per thread, the following ones are dropped
+	const unsigned max_trace_event_count = 1 << 16;
+
+	enum MetricKind { counter_kind, histogram_kind };
+
+	inline uint64_t get_nano_time() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	struct TraceEvent {
+		unsigned metric;
+		uint64_t start_time;		// nanoseconds
+		uint64_t duration;			// nanoseconds
+	};
+
+	/**
+	 * Values recorded by one thread. Only the owner thread writes them, with relaxed atomics
+	 * so that an export may read them meanwhile; the trace events are guarded by a mutex
+	 * which the owner alone locks, except during an export.
+	 */
+	class ThreadMetrics {
+	  public:
+		unsigned thread_id;
+		std::atomic<uint64_t> value[max_metric_count];			// counter value or histogram sum
+		std::atomic<uint64_t> bucket[max_metric_count][histogram_bucket_count];
+		std::mutex trace_mutex;
+		std::vector<TraceEvent> trace;
+		uint64_t dropped_trace_event_count;
+
+		explicit ThreadMetrics(unsigned thread_id) : thread_id(thread_id), dropped_trace_event_count(0) {
+			clear();
+		}
+
+		void add(unsigned metric, uint64_t amount) {
+			value[metric].store(value[metric].load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+		}
+
+		void record(unsigned metric, uint64_t sample) {
+			unsigned b = 0;
+			for(uint64_t v = sample; v != 0 && b + 1 < histogram_bucket_count; v >>= 1)
+				++b;
+			add(metric, sample);
+			bucket[metric][b].store(bucket[metric][b].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		}
+
+		void trace_event(unsigned metric, uint64_t start_time, uint64_t duration) {
+			std::lock_guard<std::mutex> lock(trace_mutex);
+			if(trace.size() < max_trace_event_count)
+				trace.push_back(TraceEvent{metric, start_time, duration});
+			else
+				++dropped_trace_event_count;
+		}
+
+		void clear() {
+			for(unsigned m = 0; m < max_metric_count; ++m){
+				value[m].store(0, std::memory_order_relaxed);
+				for(unsigned b = 0; b < histogram_bucket_count; ++b)
+					bucket[m][b].store(0, std::memory_order_relaxed);
+			}
+			std::lock_guard<std::mutex> lock(trace_mutex);
+			trace.clear();
+			dropped_trace_event_count = 0;
+		}
+	};
+
+	/**
+	 * Process wide list of the metric names and of the threads recording them.
+	 */
+	class Registry {
+	  public:
+
+		static Registry& get() {
+			static Registry registry;
+			return registry;
+		}
+
+		/**
+		 * Identifier of the metric called name, registered on first use.
+		 */
+		unsigned get_metric_id(const char* name, MetricKind kind) {
+			std::lock_guard<std::mutex> lock(mutex);
+			for(unsigned m = 0; m < metric_name.size(); ++m){
+				if(metric_name[m] == name){
+					if(metric_kind[m] != kind)
+						throw std::runtime_error(std::string("The metric ") + name + " is used both as a counter and as a histogram");
+					return m;
+				}
+			}
+			if(metric_name.size() == max_metric_count)
+				throw std::runtime_error("Too many instrumentation metrics");
+			metric_name.push_back(name);
+			metric_kind.push_back(kind);
+			return metric_name.size() - 1;
+		}
+
+		ThreadMetrics* register_thread() {
+			std::lock_guard<std::mutex> lock(mutex);
+			threads.push_back(new ThreadMetrics(next_thread_id++));
+			return threads.back();
+		}
+
+		/**
+		 * Keep the values of an exiting thread in the totals.
+		 */
+		void unregister_thread(ThreadMetrics* metrics) {
+			std::lock_guard<std::mutex> lock(mutex);
+			merge(*metrics, retired);
+			{
+				std::lock_guard<std::mutex> trace_lock(metrics->trace_mutex);
+				std::lock_guard<std::mutex> retired_trace_lock(retired.trace_mutex);
+				for(const TraceEvent& event : metrics->trace)
+					retired.trace.push_back(event);
+				retired.dropped_trace_event_count += metrics->dropped_trace_event_count;
+			}
+			threads.erase(std::find(threads.begin(), threads.end(), metrics));
+			delete metrics;
+		}
+
+		bool is_tracing_enabled() const {
+			return is_tracing.load(std::memory_order_relaxed);
+		}
+
+		/**
+		 * Start or stop recording a trace event per scoped timer.
+		 */
+		void set_tracing_enabled(bool enabled) {
+			is_tracing.store(enabled, std::memory_order_relaxed);
+		}
+
+		/**
+		 * Forget every recorded value and trace event, the metric names are kept.
+		 */
+		void reset() {
+			std::lock_guard<std::mutex> lock(mutex);
+			for(ThreadMetrics* metrics : threads)
+				metrics->clear();
+			retired.clear();
+		}
+
+		/**
+		 * Sum of the values of all the threads, in the Prometheus text exposition format.
+		 * Counters are named cms_<name>_total and histograms cms_<name>, dots being replaced
+		 * by underscores.
+		 */
+		std::string get_prometheus_text() {
+			std::lock_guard<std::mutex> lock(mutex);
+			ThreadMetrics total(0);
+			merge(retired, total);
+			for(ThreadMetrics* metrics : threads)
+				merge(*metrics, total);
+
+			std::string text;
+			char line[256];
+			for(unsigned m = 0; m < metric_name.size(); ++m){
+				std::string name = "cms_" + metric_name[m];
+				std::replace_if(name.begin(), name.end(), [](char c){ return !isalnum(c) && c != '_'; }, '_');
+				uint64_t sum = total.value[m].load(std::memory_order_relaxed);
+				if(metric_kind[m] == counter_kind){
+					snprintf(line, sizeof(line), "# TYPE %s_total counter\n%s_total %llu\n", name.c_str(), name.c_str(), (unsigned long long)sum);
+					text += line;
+					continue;
+				}
+				snprintf(line, sizeof(line), "# TYPE %s histogram\n", name.c_str());
+				text += line;
+				uint64_t count = 0;
+				for(unsigned b = 0; b < histogram_bucket_count; ++b){
+					count += total.bucket[m][b].load(std::memory_order_relaxed);
+					if(b + 1 < histogram_bucket_count)
+						snprintf(line, sizeof(line), "%s_bucket{le=\"%llu\"} %llu\n", name.c_str(), (unsigned long long)((1ULL << b) - 1), (unsigned long long)count);
+					else
+						snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n", name.c_str(), (unsigned long long)count);
+					text += line;
+				}
+				snprintf(line, sizeof(line), "%s_sum %llu\n%s_count %llu\n", name.c_str(), (unsigned long long)sum, name.c_str(), (unsigned long long)count);
+				text += line;
+			}
+			return text;
+		}
+
+		/**
+		 * Trace events recorded while tracing was enabled, in the Chrome trace event JSON
+		 * format: one complete ("X") event per scoped timer, timestamps in microseconds.
+		 */
+		std::string get_chrome_trace_json() {
+			std::lock_guard<std::mutex> lock(mutex);
+			std::string json = "{\"traceEvents\":[";
+			bool is_first = true;
+			uint64_t dropped_count = 0;
+			char event[256];
+			auto write_events = [&](ThreadMetrics& metrics){
+				std::lock_guard<std::mutex> trace_lock(metrics.trace_mutex);
+				for(const TraceEvent& e : metrics.trace){
+					snprintf(event, sizeof(event), "%s{\"name\":\"%s\",\"cat\":\"cms\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u}",
+						is_first ? "" : ",", metric_name[e.metric].c_str(), (e.start_time - epoch) / 1000.0, e.duration / 1000.0, (int)getpid(), metrics.thread_id);
+					json += event;
+					is_first = false;
+				}
+				dropped_count += metrics.dropped_trace_event_count;
+			};
+			write_events(retired);
+			for(ThreadMetrics* metrics : threads)
+				write_events(*metrics);
+			json += "],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_events\":" + std::to_string(dropped_count) + "}}";
+			return json;
+		}
+
+		uint64_t get_epoch() const {
+			return epoch;
+		}
+
+	  private:
+		std::mutex mutex;
+		std::vector<std::string> metric_name;
+		std::vector<MetricKind> metric_kind;
+		std::vector<ThreadMetrics*> threads;
+		ThreadMetrics retired;			// values of the exited threads
+		unsigned next_thread_id;
+		std::atomic<bool> is_tracing;
+		uint64_t epoch;
+
+		Registry() : retired(0), next_thread_id(1), is_tracing(false), epoch(get_nano_time()) {}
+
+		static void merge(ThreadMetrics& from, ThreadMetrics& to) {
+			for(unsigned m = 0; m < max_metric_count; ++m){
+				to.value[m].store(to.value[m].load(std::memory_order_relaxed) + from.value[m].load(std::memory_order_relaxed), std::memory_order_relaxed);
+				for(unsigned b = 0; b < histogram_bucket_count; ++b)
+					to.bucket[m][b].store(to.bucket[m][b].load(std::memory_order_relaxed) + from.bucket[m][b].load(std::memory_order_relaxed), std::memory_order_relaxed);
+			}
+		}
+	};
+
+	/**
+	 * Metrics of the calling thread, registered on its first record and merged in the
+	 * totals when it exits.
+	 */
+	inline ThreadMetrics& get_thread_metrics() {
+		struct Slot {
+			ThreadMetrics* metrics;
+			Slot() : metrics(Registry::get().register_thread()) {}
+			~Slot() { Registry::get().unregister_thread(metrics); }
+		};
+		static thread_local Slot slot;
+		return *slot.metrics;
+	}
+
+	/**
+	 * Record the time spent in a scope, in microseconds, in a histogram.
+	 */
+	class ScopedTimer {
+	  public:
+		explicit ScopedTimer(unsigned metric) : metric(metric), start_time(get_nano_time()) {}
+
+		~ScopedTimer() {
+			uint64_t duration = get_nano_time() - start_time;
+			ThreadMetrics& metrics = get_thread_metrics();
+			metrics.record(metric, duration / 1000);
+			if(Registry::get().is_tracing_enabled())
+				metrics.trace_event(metric, start_time, duration);
+		}
+
+		ScopedTimer(const ScopedTimer&) = delete;
+		ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+	  private:
+		unsigned metric;
+		uint64_t start_time;
+	};
+
+}
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+
+namespace cms {
+
+	/**
+	 * Minimal rapidjson output stream appending to a std::string, so that a rapidjson Writer
+	 * can serialize a fragment of a document in a per-chunk buffer.
+	 */
+	struct StringOutputStream {
+		typedef char Ch;
+		std::string& text;
+
+		explicit StringOutputStream(std::string& text) : text(text) {}
+		void Put(char c) { text.push_back(c); }
+		void Flush() {}
+	};
+
+	/**
+	 * Serialize chunk_count chunks of text on thread_count workers and write them to out
+	 * in chunk order.
+	 *
+	 * serialize_chunk(i, text) appends the text of the i-th chunk to text. At most
+	 * max_chunks_in_flight serialized chunks are kept in memory while waiting to be written,
+	 * which bounds the memory of the export whatever the size of the output.
+	 *
+	 * The first exception thrown by serialize_chunk stops every worker and is rethrown once
+	 * they are joined. A failed write to out throws std::runtime_error the same way.
+	 */
+	inline void write_chunks_in_order(
+		std::ostream& out,
+		unsigned chunk_count,
+		const std::function<void(unsigned, std::string&)>& serialize_chunk,
+		unsigned thread_count = 0,
+		unsigned max_chunks_in_flight = 0)
+	{
+		if(thread_count == 0)
+			thread_count = std::max(1u, std::thread::hardware_concurrency());
+		thread_count = std::min(thread_count, std::max(1u, chunk_count));
+
+		std::string text;
+
+		if(thread_count == 1){
+			for(unsigned c = 0; c < chunk_count; ++c){
+				text.clear();
+				serialize_chunk(c, text);
+				if(!out.write(text.data(), text.size()))
+					throw std::runtime_error("Unable to write the chunk " + std::to_string(c));
+			}
+			return;
+		}
+
+		if(max_chunks_in_flight == 0)
+			max_chunks_in_flight = 4 * thread_count;
+
+		struct Slot {
+			std::string text;
+			bool is_ready = false;
+		};
+		std::vector<Slot> ring(max_chunks_in_flight);
+		unsigned written_count = 0;
+		std::atomic<unsigned> next_chunk(0);
+		std::mutex mutex;
+		std::condition_variable slot_changed;
+
+		// First failure of a worker or of the writer, every thread stops on it
+		std::exception_ptr failure;
+		bool is_stopped = false;
+		auto stop_on_failure = [&]{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if(!failure)
+					failure = std::current_exception();
+				is_stopped = true;
+			}
+			slot_changed.notify_all();
+		};
+
+		std::vector<std::thread> workers;
+		for(unsigned t = 0; t < thread_count; ++t){
+			workers.emplace_back([&]{
+				try{
+					std::string local_text;
+					for(unsigned c = next_chunk++; c < chunk_count; c = next_chunk++){
+						{
+							// Wait for the slot of this chunk to be written out
+							std::unique_lock<std::mutex> lock(mutex);
+							slot_changed.wait(lock, [&]{ return is_stopped || c < written_count + max_chunks_in_flight; });
+							if(is_stopped)
+								return;
+						}
+						local_text.clear();
+						serialize_chunk(c, local_text);
+						{
+							std::lock_guard<std::mutex> lock(mutex);
+							Slot& slot = ring[c % max_chunks_in_flight];
+							slot.text.swap(local_text);
+							slot.is_ready = true;
+						}
+						slot_changed.notify_all();
+					}
+				}catch(...){
+					stop_on_failure();
+				}
+			});
+		}
+
+		try{
+			for(unsigned c = 0; c < chunk_count; ++c){
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					Slot& slot = ring[c % max_chunks_in_flight];
+					slot_changed.wait(lock, [&]{ return is_stopped || slot.is_ready; });
+					if(is_stopped)
+						break;
+					text.swap(slot.text);
+					slot.is_ready = false;
+					written_count = c + 1;
+				}
+				slot_changed.notify_all();
+				if(!out.write(text.data(), text.size()))
+					throw std::runtime_error("Unable to write the chunk " + std::to_string(c));
+			}
+		}catch(...){
+			stop_on_failure();
+		}
+
+		for(auto& worker : workers)
+			worker.join();
+
+		if(failure)
+			std::rethrow_exception(failure);
+	}
+
+}
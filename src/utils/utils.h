@@ -1,3 +1,5 @@
+#pragma once
+
 void cout_message(const std::string&msg){
 	std::cout << msg << std::endl;
 }
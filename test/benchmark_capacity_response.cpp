@@ -7,11 +7,12 @@
  * PREREQUISITE
  * To have at least one precomputed graph in a subdirectory of the ./data/backup directory.
  * One can generate it with the ./test/pbf_to_contracted_graph.cpp script. 
+ * The graph.flat file is used when present, graph.dat and ch.dat otherwise.
  *
  * COMPILE AND EXECUTE
  *
  * # Compile:
- * g++ -Ilib/RoutingKit/include -Llib/RoutingKit/lib -std=c++11 ./test/benchmark_capacity_response.cpp -o ./bin/benchmark_capacity_response -lroutingkit -lprotobuf-lite -losmpbf -lz -lboost_serialization -lstdc++fs
+ * g++ -Ilib/RoutingKit/include -Llib/RoutingKit/lib -std=c++11 ./test/benchmark_capacity_response.cpp -o ./bin/benchmark_capacity_response -lroutingkit -lprotobuf-lite -losmpbf -lz -lboost_serialization -lstdc++fs -pthread
  * 
  * # Add needed shared libraries to the environment variable LD_LIBRARY_PATH:
  * export LD_LIBRARY_PATH=$LD_LIBRARY_PATH:./lib/RoutingKit/lib:/usr/local/lib64:/usr/local/lib
@@ -88,8 +89,16 @@ int main(int argc, char*argv[])
         cout_message("\n*** Start loading data in memory ***");
 
 
+        // A flat graph file holds both the graph and its contracted form
+        std::ifstream flat_file(path_to_data_files + "/graph.flat");
+        bool has_flat_file = flat_file.good();
+        flat_file.close();
+
         cout_message("1. Loading the road graph");
-        graph.load_from_binary(path_to_data_files + "/graph.dat");
+        if (has_flat_file)
+            graph.load_from_flat_file(path_to_data_files + "/graph.flat");
+        else
+            graph.load_from_binary(path_to_data_files + "/graph.dat");
 
         std::vector<cms::Way> ways(graph.way_osmid.size());
 
@@ -105,13 +114,15 @@ int main(int argc, char*argv[])
         cout_message(" - GPS geometries (polyline) recovered\n");  
 
 
-        cout_message("2. Loading the contracted form of the road graph");
-        graph.load_contraction_hierarchy(path_to_data_files + "/ch.dat");
+        if (!has_flat_file) {
+            cout_message("2. Loading the contracted form of the road graph");
+            graph.load_contraction_hierarchy(path_to_data_files + "/ch.dat");
+        }
 
         cout_message("*** Loading completed ***");
 
-        // Build the index to quickly map latitudes and longitudes
-        RoutingKit::GeoPositionToNode map_geo_position(graph.latitude, graph.longitude);
+        // Print the summary of each computation
+        graph.is_verbose = true;
 
 
         while(true){
@@ -140,15 +151,54 @@ int main(int argc, char*argv[])
                 stream >> threshold;
             }
 
-            std::vector<unsigned> source_list(source_count);
+            // default number of threads on which units are spread (0 = all available cores)
+            unsigned thread_count = 0;
+            cout_message("Number of threads used to compute the coverage [default = " + std::to_string(thread_count) + " (all cores)]: ");
 
-            // Random selection of nodes as starting points for the units available
+            std::string input_thread_count;
+            std::getline( std::cin, input_thread_count );
+            if ( !input_thread_count.empty() ) {
+                std::istringstream stream( input_thread_count );
+                stream >> thread_count;
+            }
+
+            // Random GPS fixes of the units available, along the roads with about ten meters of noise
             cout_message("Random selection of positions of " + std::to_string(source_count) + " intervention units");
-            for(unsigned i=0; i<source_count; ++i)
-            	source_list[i] = rand() % graph.ch.node_count();
+            std::vector<float> fix_latitude(source_count), fix_longitude(source_count);
+            for(unsigned i=0; i<source_count; ++i){
+                unsigned arc = rand() % graph.arc_count;
+                float share = (float)rand() / RAND_MAX;
+                unsigned from = graph.tail[arc], to = graph.head[arc];
+                fix_latitude[i] = graph.latitude[from] + share * (graph.latitude[to] - graph.latitude[from]) + ((float)rand() / RAND_MAX - 0.5f) * 0.0002f;
+                fix_longitude[i] = graph.longitude[from] + share * (graph.longitude[to] - graph.longitude[from]) + ((float)rand() / RAND_MAX - 0.5f) * 0.0002f;
+            }
+
+            // Snap the fixes to the road graph
+            long long snap_start_time = RoutingKit::get_micro_time();
+            std::vector<cms::SnappedPosition> positions;
+            graph.snap_positions(fix_latitude, fix_longitude, positions);
+            cout_message(std::to_string(source_count) + " GPS fixes snapped in " + microseconds_to_readable_time_cout(RoutingKit::get_micro_time() - snap_start_time));
 
             // Compute the capacity coverage
-            graph.capacity_coverage(source_list, threshold);
+            graph.capacity_coverage_of_positions(positions, threshold, thread_count);
+
+            // First arrival on every road segment, from a single search keeping the 3 nearest units
+            graph.nearest_units_of_positions(positions, 3, threshold);
+
+            // Response of the ways: the best capacity of their arcs and the first arrival on one of them
+            for (cms::Way& way : ways) {
+                way.response_capacity = 0;
+                way.immediate_response = RoutingKit::inf_weight;
+            }
+            for (unsigned int i = 0; i < graph.way.size(); i++ ) {
+                cms::Way& way = ways[graph.way[i]];
+                way.response_capacity = std::max(way.response_capacity, graph.capacity_coverage_way[i]);
+                unsigned first_arrival = graph.get_nearest_unit_time_way(i);
+                if (first_arrival != RoutingKit::inf_weight)
+                    way.immediate_response = std::min(way.immediate_response, first_arrival / 1000);
+            }
+            unsigned reached_way_count = std::count_if(ways.begin(), ways.end(), [](const cms::Way& way){ return way.immediate_response != RoutingKit::inf_weight; });
+            cout_message(std::to_string(reached_way_count) + " of " + std::to_string(ways.size()) + " road segments reached by a first unit under " + std::to_string(threshold) + " seconds");
 
             cout_message("*** Start exporting the capacity coverage in a GeoJSON file ***");
 
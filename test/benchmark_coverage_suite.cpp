@@ -0,0 +1,442 @@
+/**
+ * This script benchmarks the capacity coverage without any interaction, so that its results
+ * can be compared between commits and machines.
+ *
+ * For every region, fleet size and threshold of the sweep, units are drawn along the roads
+ * with a seeded random generator, then each phase is timed separately over the repetitions:
+ *  - snap: snapping of the GPS fixes of the units to the arcs,
+ *  - search: isochrone searches of the units,
+ *  - accumulate: increment of the node counters with the nodes reached,
+ *  - aggregate: derivation of the arc coverage from the node coverage,
+ *  - export: GeoJSON export of the arc coverage.
+ * The phases run on one thread so that each time is attributed to its phase.
+ *
+ * Each production coverage path of GraphCH is then timed end to end on the same units, the
+ * units given by node starting from the head of their snapped arc:
+ *  - parallel: capacity_coverage_parallel,
+ *  - positions: capacity_coverage_of_positions,
+ *  - phast: capacity_coverage_phast, reported as {"skipped":true} when the graph has no
+ *    contraction hierarchy for the metric.
+ * They run on the given number of threads and get a checksum of their own, parallel and
+ * phast having the same units should have the same one.
+ *
+ * The results are written as JSON: min, median, p95, p99 and mean time of each phase in
+ * microseconds, the throughput, and a checksum of the coverage which only changes when the
+ * results do.
+ *
+ * PARAMETERS
+ * Read from an optional config file of "key = value" lines ("#" starts a comment), then
+ * from the command line as key=value arguments overriding the config file:
+ *  - data_directory: directory of the preprocessed regions [./data/backup]
+ *  - regions: comma separated regions, all the subdirectories of data_directory if empty []
+ *  - fleet_sizes: comma separated numbers of units [10,70,200]
+ *  - thresholds: comma separated thresholds in seconds [300,600]
+ *  - metric: name of the metric used [default]
+ *  - threads: threads of the production coverage paths, 0 for all the cores [0]
+ *  - repetitions: timed repetitions per configuration [20]
+ *  - warmup: untimed repetitions per configuration [2]
+ *  - seed: seed of the random generator [1]
+ *  - export: 1 to time the GeoJSON export, 0 to skip it [1]
+ *  - export_file: GeoJSON file overwritten by the export phase [/tmp/benchmark_coverage.json]
+ *  - output: JSON results file, - for the standard output [./benchmark_coverage_results.json]
+ *
+ * PREREQUISITE
+ * To have at least one precomputed graph in a subdirectory of the data directory: graph.flat,
+ * or graph.dat with the optional ch.dat and cch.dat next to it.
+ * One can generate it with the ./test/pbf_to_contracted_graph.cpp script.
+ *
+ * COMPILE AND EXECUTE
+ *
+ * # Compile:
+ * g++ -Ilib/RoutingKit/include -Llib/RoutingKit/lib -std=c++11 -O3 ./test/benchmark_coverage_suite.cpp -o ./bin/benchmark_coverage_suite -lroutingkit -lprotobuf-lite -losmpbf -lz -lboost_serialization -pthread
+ *
+ * # Add needed shared libraries to the environment variable LD_LIBRARY_PATH:
+ * export LD_LIBRARY_PATH=$LD_LIBRARY_PATH:./lib/RoutingKit/lib:/usr/local/lib64:/usr/local/lib
+ *
+ * # Launch the generated executable, with an optional config file first:
+ * ./bin/benchmark_coverage_suite [config file] [key=value] ...
+ * ./bin/benchmark_coverage_suite regions=andorra fleet_sizes=70 thresholds=300 seed=7 output=-
+ */
+
+#include <dirent.h>
+#include <chrono>
+#include <random>
+#include <map>
+#include "../src/graph/graph.h"
+
+typedef std::map<std::string, std::string> Parameters;
+
+const char* phase_names[] = {"snap", "search", "accumulate", "aggregate", "export"};
+const unsigned phase_count = 5;
+
+const char* path_names[] = {"parallel", "positions", "phast"};
+const unsigned path_count = 3;
+
+/**
+ * Read the "key = value" lines of a config file into parameters.
+ */
+void read_config_file(const std::string& file, Parameters& parameters)
+{
+	std::ifstream input(file);
+	if (!input)
+		throw std::runtime_error("Unable to open the config file " + file);
+	std::string line;
+	while (std::getline(input, line)) {
+		line = line.substr(0, line.find('#'));
+		std::string::size_type equal = line.find('=');
+		if (equal == std::string::npos)
+			continue;
+		auto trim = [](std::string text) {
+			text.erase(0, text.find_first_not_of(" \t\r"));
+			text.erase(text.find_last_not_of(" \t\r") + 1);
+			return text;
+		};
+		parameters[trim(line.substr(0, equal))] = trim(line.substr(equal + 1));
+	}
+}
+
+std::vector<std::string> split_list(const std::string& list)
+{
+	std::vector<std::string> items;
+	std::istringstream stream(list);
+	std::string item;
+	while (std::getline(stream, item, ','))
+		if (!item.empty())
+			items.push_back(item);
+	return items;
+}
+
+std::vector<unsigned> split_unsigned_list(const std::string& list)
+{
+	std::vector<unsigned> values;
+	for (const std::string& item : split_list(list))
+		values.push_back(std::stoul(item));
+	return values;
+}
+
+/**
+ * Sorted subdirectories of a directory.
+ */
+std::vector<std::string> list_directories(const std::string& directory)
+{
+	std::vector<std::string> names;
+	DIR* dir = opendir(directory.c_str());
+	if (dir == nullptr)
+		throw std::runtime_error("Unable to open the directory " + directory);
+	for (struct dirent* entry = readdir(dir); entry != nullptr; entry = readdir(dir)) {
+		std::string name = entry->d_name;
+		if (entry->d_type == DT_DIR && name != "." && name != "..")
+			names.push_back(name);
+	}
+	closedir(dir);
+	std::sort(names.begin(), names.end());
+	return names;
+}
+
+long long get_nano_time()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Nearest rank percentile of sorted values.
+ */
+double get_percentile(const std::vector<double>& sorted_values, double percentile)
+{
+	unsigned rank = (unsigned)std::ceil(percentile / 100 * sorted_values.size());
+	return sorted_values[std::max(1u, rank) - 1];
+}
+
+template<class Writer>
+void write_statistics(Writer& writer, std::vector<double> values)
+{
+	std::sort(values.begin(), values.end());
+	writer.StartObject();
+	writer.Key("min_us");
+	writer.Double(values.front());
+	writer.Key("median_us");
+	writer.Double(get_percentile(values, 50));
+	writer.Key("p95_us");
+	writer.Double(get_percentile(values, 95));
+	writer.Key("p99_us");
+	writer.Double(get_percentile(values, 99));
+	writer.Key("mean_us");
+	writer.Double(std::accumulate(values.begin(), values.end(), 0.0) / values.size());
+	writer.EndObject();
+}
+
+double get_median(std::vector<double> values)
+{
+	std::sort(values.begin(), values.end());
+	return get_percentile(values, 50);
+}
+
+int main(int argc, char*argv[])
+{
+	try{
+
+		Parameters parameters = {
+			{"data_directory", "./data/backup"}, {"regions", ""}, {"fleet_sizes", "10,70,200"},
+			{"thresholds", "300,600"}, {"metric", "default"}, {"threads", "0"}, {"repetitions", "20"}, {"warmup", "2"},
+			{"seed", "1"}, {"export", "1"}, {"export_file", "/tmp/benchmark_coverage.json"},
+			{"output", "./benchmark_coverage_results.json"}
+		};
+		for (int i = 1; i < argc; ++i) {
+			std::string argument = argv[i];
+			std::string::size_type equal = argument.find('=');
+			if (equal == std::string::npos)
+				read_config_file(argument, parameters);
+		}
+		for (int i = 1; i < argc; ++i) {
+			std::string argument = argv[i];
+			std::string::size_type equal = argument.find('=');
+			if (equal != std::string::npos) {
+				if (parameters.count(argument.substr(0, equal)) == 0)
+					throw std::runtime_error("Unknown parameter " + argument.substr(0, equal));
+				parameters[argument.substr(0, equal)] = argument.substr(equal + 1);
+			}
+		}
+
+		std::string data_directory = parameters["data_directory"];
+		std::vector<std::string> regions = split_list(parameters["regions"]);
+		if (regions.empty())
+			regions = list_directories(data_directory);
+		std::vector<unsigned> fleet_sizes = split_unsigned_list(parameters["fleet_sizes"]);
+		std::vector<unsigned> thresholds = split_unsigned_list(parameters["thresholds"]);
+		unsigned thread_count = std::stoul(parameters["threads"]);
+		unsigned repetitions = std::stoul(parameters["repetitions"]);
+		unsigned warmup = std::stoul(parameters["warmup"]);
+		unsigned seed = std::stoul(parameters["seed"]);
+		bool is_export_timed = parameters["export"] != "0";
+		if (regions.empty() || fleet_sizes.empty() || thresholds.empty() || repetitions == 0)
+			throw std::runtime_error("Nothing to benchmark");
+
+		rapidjson::StringBuffer buffer;
+		rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+		writer.StartObject();
+		writer.Key("benchmark");
+		writer.String("capacity_coverage");
+		writer.Key("parameters");
+		writer.StartObject();
+		for (const auto& parameter : parameters) {
+			writer.Key(parameter.first.c_str());
+			writer.String(parameter.second.c_str());
+		}
+		writer.EndObject();
+		writer.Key("compiler");
+		writer.String(__VERSION__);
+		writer.Key("hardware_threads");
+		writer.Uint(std::thread::hardware_concurrency());
+		writer.Key("runs");
+		writer.StartArray();
+
+		for (const std::string& region : regions) {
+
+			std::string path_to_data_files = data_directory + "/" + region;
+			cms::GraphCH graph;
+			std::ifstream flat_file(path_to_data_files + "/graph.flat");
+			if (flat_file.good())
+				graph.load_from_flat_file(path_to_data_files + "/graph.flat");
+			else {
+				graph.load_from_binary(path_to_data_files + "/graph.dat");
+				std::ifstream ch_file(path_to_data_files + "/ch.dat");
+				if (ch_file.good())
+					graph.load_contraction_hierarchy(path_to_data_files + "/ch.dat");
+				std::ifstream cch_file(path_to_data_files + "/cch.dat");
+				if (cch_file.good())
+					graph.load_customizable_contraction_hierarchy(path_to_data_files + "/cch.dat");
+			}
+			flat_file.close();
+
+			unsigned metric = graph.get_metric_id(parameters["metric"]);
+			cms::ConstArray<unsigned> travel_time = graph.get_metric_travel_time(metric);
+			cms::IsochroneQuery query(graph.first_out, graph.head, travel_time);
+
+			bool has_metric_hierarchy = true;
+			try {
+				graph.get_contraction_hierarchy(metric);
+			} catch (std::runtime_error&) {
+				has_metric_hierarchy = false;
+			}
+
+			for (unsigned fleet_size : fleet_sizes) {
+				for (unsigned threshold : thresholds) {
+
+					cout_message("Benchmarking " + region + " with " + std::to_string(fleet_size) + " units under " + std::to_string(threshold) + " seconds");
+
+					std::vector< std::vector<double> > phase_time(phase_count);
+					uint64_t reached_node_count = 0;
+					uint64_t coverage_checksum = 0;
+					std::vector< std::vector<double> > path_time(path_count);
+					std::vector<uint64_t> path_checksum(path_count, 0);
+
+					// The same seed gives the same units in every configuration of a region
+					std::mt19937 generator(seed);
+					std::uniform_int_distribution<unsigned> random_arc(0, graph.arc_count - 1);
+					std::uniform_real_distribution<float> random_share(0, 1), random_noise(-0.0001f, 0.0001f);
+
+					for (unsigned repetition = 0; repetition < warmup + repetitions; ++repetition) {
+
+						// GPS fixes along the roads with about ten meters of noise
+						std::vector<float> fix_latitude(fleet_size), fix_longitude(fleet_size);
+						for (unsigned i = 0; i < fleet_size; ++i) {
+							unsigned arc = random_arc(generator);
+							float share = random_share(generator);
+							unsigned from = graph.tail[arc], to = graph.head[arc];
+							fix_latitude[i] = graph.latitude[from] + share * (graph.latitude[to] - graph.latitude[from]) + random_noise(generator);
+							fix_longitude[i] = graph.longitude[from] + share * (graph.longitude[to] - graph.longitude[from]) + random_noise(generator);
+						}
+
+						long long time[phase_count] = {0, 0, 0, 0, 0};
+
+						long long start_time = get_nano_time();
+						std::vector<cms::SnappedPosition> positions;
+						graph.snap_positions(fix_latitude, fix_longitude, positions, 100, 1);
+						time[0] = get_nano_time() - start_time;
+
+						graph.capacity_coverage_node.assign(graph.node_count, 0);
+						graph.capacity_coverage_way.assign(graph.arc_count, 0);
+						for (const cms::SnappedPosition& position : positions) {
+							if (!position.is_valid())
+								continue;
+							start_time = get_nano_time();
+							query.reset();
+							graph.add_snapped_source(query, position, metric);
+							query.run(threshold * 1000);
+							long long search_end_time = get_nano_time();
+							const std::vector<unsigned>& reached_nodes = query.get_reached_nodes();
+							for (unsigned x : reached_nodes)
+								graph.capacity_coverage_node[x]++;
+							time[2] += get_nano_time() - search_end_time;
+							time[1] += search_end_time - start_time;
+							if (repetition >= warmup)
+								reached_node_count += reached_nodes.size();
+						}
+
+						start_time = get_nano_time();
+						graph.compute_capacity_coverage_way();
+						time[3] = get_nano_time() - start_time;
+
+						if (is_export_timed) {
+							start_time = get_nano_time();
+							graph.export_geojson_capacity_coverage(parameters["export_file"], 1);
+							time[4] = get_nano_time() - start_time;
+						}
+
+						if (repetition >= warmup) {
+							for (unsigned p = 0; p < phase_count; ++p)
+								phase_time[p].push_back(time[p] / 1000.0);
+							for (unsigned a = 0; a < graph.arc_count; ++a)
+								coverage_checksum = coverage_checksum * 31 + graph.capacity_coverage_way[a];
+						}
+
+						std::vector<unsigned> source_list;
+						for (const cms::SnappedPosition& position : positions)
+							if (position.is_valid())
+								source_list.push_back(graph.head[position.arc]);
+
+						for (unsigned p = 0; p < path_count; ++p) {
+							if (p == 2 && !has_metric_hierarchy)
+								continue;
+							start_time = get_nano_time();
+							if (p == 0)
+								graph.capacity_coverage_parallel(source_list, threshold, thread_count, metric);
+							else if (p == 1)
+								graph.capacity_coverage_of_positions(positions, threshold, thread_count, metric);
+							else
+								graph.capacity_coverage_phast(source_list, threshold, thread_count, metric);
+							long long path_end_time = get_nano_time();
+							if (repetition < warmup)
+								continue;
+							path_time[p].push_back((path_end_time - start_time) / 1000.0);
+							for (unsigned a = 0; a < graph.arc_count; ++a)
+								path_checksum[p] = path_checksum[p] * 31 + graph.capacity_coverage_way[a];
+						}
+					}
+
+					std::vector<double> total_time(repetitions, 0);
+					for (unsigned p = 0; p < phase_count; ++p)
+						for (unsigned r = 0; r < repetitions; ++r)
+							total_time[r] += phase_time[p][r];
+
+					writer.StartObject();
+					writer.Key("region");
+					writer.String(region.c_str());
+					writer.Key("nodes");
+					writer.Uint(graph.node_count);
+					writer.Key("arcs");
+					writer.Uint(graph.arc_count);
+					writer.Key("fleet_size");
+					writer.Uint(fleet_size);
+					writer.Key("threshold");
+					writer.Uint(threshold);
+					writer.Key("reached_nodes_per_unit");
+					writer.Double((double)reached_node_count / ((uint64_t)repetitions * std::max(1u, fleet_size)));
+					writer.Key("coverage_checksum");
+					writer.String(std::to_string(coverage_checksum).c_str());
+					writer.Key("phases");
+					writer.StartObject();
+					for (unsigned p = 0; p < phase_count; ++p) {
+						if (p == 4 && !is_export_timed)
+							continue;
+						writer.Key(phase_names[p]);
+						write_statistics(writer, phase_time[p]);
+					}
+					writer.Key("total");
+					write_statistics(writer, total_time);
+					writer.EndObject();
+					writer.Key("paths");
+					writer.StartObject();
+					for (unsigned p = 0; p < path_count; ++p) {
+						writer.Key(path_names[p]);
+						writer.StartObject();
+						if (path_time[p].empty()) {
+							writer.Key("skipped");
+							writer.Bool(true);
+							writer.EndObject();
+							continue;
+						}
+						writer.Key("coverage_checksum");
+						writer.String(std::to_string(path_checksum[p]).c_str());
+						writer.Key("time");
+						write_statistics(writer, path_time[p]);
+						writer.Key("units_per_second");
+						writer.Double(fleet_size / std::max(1e-3, get_median(path_time[p])) * 1e6);
+						writer.EndObject();
+					}
+					writer.EndObject();
+					// Throughputs of the median repetition
+					writer.Key("throughput");
+					writer.StartObject();
+					writer.Key("units_per_second");
+					writer.Double(fleet_size / std::max(1e-3, get_median(phase_time[1]) + get_median(phase_time[2])) * 1e6);
+					writer.Key("arcs_aggregated_per_second");
+					writer.Double(graph.arc_count / std::max(1e-3, get_median(phase_time[3])) * 1e6);
+					writer.Key("coverages_per_second");
+					writer.Double(1e6 / std::max(1e-3, get_median(total_time)));
+					writer.EndObject();
+					writer.EndObject();
+				}
+			}
+		}
+
+		writer.EndArray();
+		writer.EndObject();
+
+		if (parameters["output"] == "-") {
+			std::cout << buffer.GetString() << std::endl;
+		} else {
+			std::ofstream output(parameters["output"]);
+			output << buffer.GetString() << std::endl;
+			if (!output)
+				throw std::runtime_error("Unable to write " + parameters["output"]);
+			cout_message("Benchmark results written in " + parameters["output"]);
+		}
+
+	}catch(std::exception&err){
+		std::cerr << "Stopped on exception : " << err.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
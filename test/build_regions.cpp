@@ -0,0 +1,218 @@
+/**
+ * This script preprocesses a list of OpenStreetMap PBF files, as ./test/pbf_to_contracted_graph.cpp
+ * does for one file, through a content-addressed cache: a file whose contents, speed profile
+ * and formats are unchanged since a previous run is not preprocessed again.
+ *
+ * The files are processed concurrently, the largest first, as long as their estimated memory
+ * fits in the memory budget. A file too large for the budget is processed alone, its node
+ * coordinates being spilled to the cache directory.
+ *
+ * Each region directory of the destination folder gets links to the files of its cache entry
+ * (graph.dat, ch.dat, cch.dat and graph.flat).
+ *
+ * COMPILE AND EXECUTE
+ *
+ * # Compile:
+ * g++ -Ilib/RoutingKit/include -Llib/RoutingKit/lib -std=c++11 -O3 ./test/build_regions.cpp -o ./bin/build_regions -lroutingkit -lprotobuf-lite -losmpbf -lz -lboost_serialization -pthread
+ *
+ * # Add needed shared libraries to the environment variable LD_LIBRARY_PATH:
+ * export LD_LIBRARY_PATH=$LD_LIBRARY_PATH:./lib/RoutingKit/lib:/usr/local/lib64:/usr/local/lib
+ *
+ * # Launch the generated executable:
+ * # <cache directory> <destination folder> <memory budget in MB> <concurrent jobs, 0 = all cores> <pbf file> <pbf file> ...
+ * ./bin/build_regions ./data/cache ./data/backup 16000 0 ./data/pbf/andorra-latest.osm.pbf ./data/pbf/france-latest.osm.pbf
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+
+#include <set>
+#include <mutex>
+#include <condition_variable>
+
+#include "../src/graph/preprocessing_cache.h"
+
+// Peak memory of a preprocessing job per byte of PBF file, a rough upper estimate
+const uint64_t memory_per_pbf_byte = 12;
+
+struct Region {
+	std::string pbf_file;
+	std::string name;
+	uint64_t pbf_size;
+	std::string key;
+	bool is_cached;
+};
+
+/**
+ * Name of the region of a PBF file, e.g. andorra for ./data/pbf/andorra-latest.osm.pbf
+ */
+std::string get_region_name(const std::string& pbf_file)
+{
+	std::string name = pbf_file.substr(pbf_file.find_last_of('/') + 1);
+	name = name.substr(0, name.find(".osm.pbf"));
+	std::string::size_type found = name.find("-latest");
+	if (found != std::string::npos)
+		name.erase(found, 7);
+	return name;
+}
+
+/**
+ * Point the files of the region directory to the cache entry.
+ */
+void link_region_to_entry(const std::string& region_directory, const std::string& entry_directory)
+{
+	mkdir(region_directory.c_str(), 0777);
+
+	char absolute_entry[PATH_MAX];
+	if (realpath(entry_directory.c_str(), absolute_entry) == nullptr)
+		throw std::runtime_error("Unable to resolve " + entry_directory);
+
+	for (const char* file : {"graph.dat", "ch.dat", "cch.dat", "graph.flat"}) {
+		std::string link = region_directory + '/' + file;
+		unlink(link.c_str());
+		if (symlink((std::string(absolute_entry) + '/' + file).c_str(), link.c_str()) != 0)
+			throw std::runtime_error("Unable to link " + link);
+	}
+}
+
+int main(int argc, char*argv[])
+{
+	try{
+
+		if (argc < 6) {
+			std::cerr << "Usage: " << argv[0] << " <cache directory> <destination folder> <memory budget in MB> <concurrent jobs> <pbf file> ..." << std::endl;
+			return 1;
+		}
+
+		long long start_time = RoutingKit::get_micro_time();
+
+		cms::PreprocessingCache cache(argv[1]);
+		std::string destination_folder = argv[2];
+		uint64_t memory_budget = std::stoull(argv[3]) << 20;
+		unsigned job_count = std::stoul(argv[4]);
+		if (job_count == 0)
+			job_count = std::max(1u, std::thread::hardware_concurrency());
+
+		std::vector<Region> regions;
+		for (int i = 5; i < argc; ++i) {
+			Region region;
+			region.pbf_file = argv[i];
+			region.name = get_region_name(region.pbf_file);
+			struct stat status;
+			if (stat(region.pbf_file.c_str(), &status) != 0)
+				throw std::runtime_error("Unable to stat " + region.pbf_file);
+			region.pbf_size = status.st_size;
+			regions.push_back(region);
+		}
+		mkdir(destination_folder.c_str(), 0777);
+
+		// Hash the files, the reading being shared by job_count threads
+		std::atomic<unsigned> next_region(0);
+		std::vector<std::thread> hashers;
+		for (unsigned t = 0; t < std::min(job_count, (unsigned)regions.size()); ++t) {
+			hashers.emplace_back([&]{
+				for (unsigned r = next_region++; r < regions.size(); r = next_region++) {
+					regions[r].key = cache.get_key(regions[r].pbf_file);
+					regions[r].is_cached = cache.has_entry(regions[r].key);
+				}
+			});
+		}
+		for (auto& hasher : hashers)
+			hasher.join();
+
+		// Jobs of the regions missing from the cache, the largest first. Files with the same
+		// contents share one job.
+		std::vector<unsigned> jobs;
+		std::set<std::string> job_keys;
+		for (unsigned r = 0; r < regions.size(); ++r) {
+			if (regions[r].is_cached)
+				cout_message("[" + regions[r].name + "] up to date (" + regions[r].key + ")");
+			else if (job_keys.insert(regions[r].key).second)
+				jobs.push_back(r);
+		}
+		std::sort(jobs.begin(), jobs.end(), [&](unsigned a, unsigned b){ return regions[a].pbf_size > regions[b].pbf_size; });
+		cout_message(std::to_string(regions.size()) + " region(s), " + std::to_string(jobs.size()) + " to preprocess");
+
+		// Start the largest pending job fitting in the free memory, or the largest one when
+		// nothing runs
+		std::mutex scheduler_mutex;
+		std::condition_variable scheduler_changed;
+		std::vector<bool> is_started(jobs.size(), false);
+		unsigned started_count = 0, running_count = 0;
+		uint64_t memory_in_use = 0;
+		std::exception_ptr failure;
+
+		std::vector<std::thread> workers;
+		for (unsigned t = 0; t < std::min(job_count, (unsigned)jobs.size()); ++t) {
+			workers.emplace_back([&]{
+				while (true) {
+					unsigned job = 0;
+					uint64_t job_memory = 0;
+					{
+						std::unique_lock<std::mutex> lock(scheduler_mutex);
+						bool has_job = false;
+						scheduler_changed.wait(lock, [&]{
+							if (started_count == jobs.size() || failure)
+								return true;
+							for (unsigned j = 0; j < jobs.size(); ++j) {
+								if (is_started[j])
+									continue;
+								uint64_t estimate = std::min(memory_budget, regions[jobs[j]].pbf_size * memory_per_pbf_byte);
+								if (running_count == 0 || memory_in_use + estimate <= memory_budget) {
+									job = j;
+									job_memory = estimate;
+									has_job = true;
+									return true;
+								}
+							}
+							return false;
+						});
+						if (!has_job)
+							break;
+						is_started[job] = true;
+						++started_count;
+						++running_count;
+						memory_in_use += job_memory;
+					}
+
+					const Region& region = regions[jobs[job]];
+					try{
+						long long job_start_time = RoutingKit::get_micro_time();
+						// A file too large for the budget keeps its node coordinates on disk
+						bool is_over_budget = region.pbf_size * memory_per_pbf_byte > memory_budget;
+						// A job alone in the pipeline decodes on every core
+						unsigned decode_thread_count = (job_count == 1) ? 0 : 1;
+						cache.build_entry(region.key, region.pbf_file, decode_thread_count, is_over_budget ? memory_budget / 4 : 0);
+						cout_message("[" + region.name + "] preprocessed in " + microseconds_to_readable_time_cout(RoutingKit::get_micro_time() - job_start_time) + " (" + region.key + ")");
+					}catch(...){
+						std::lock_guard<std::mutex> lock(scheduler_mutex);
+						if (!failure)
+							failure = std::current_exception();
+					}
+
+					{
+						std::lock_guard<std::mutex> lock(scheduler_mutex);
+						--running_count;
+						memory_in_use -= job_memory;
+					}
+					scheduler_changed.notify_all();
+				}
+			});
+		}
+		for (auto& worker : workers)
+			worker.join();
+		if (failure)
+			std::rethrow_exception(failure);
+
+		for (const Region& region : regions)
+			link_region_to_entry(destination_folder + '/' + region.name, cache.get_entry_directory(region.key));
+
+		cout_message("All regions ready in " + microseconds_to_readable_time_cout(RoutingKit::get_micro_time() - start_time));
+
+	}catch(std::exception&err){
+		std::cerr << "Stopped on exception : " << err.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
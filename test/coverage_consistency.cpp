@@ -0,0 +1,207 @@
+/**
+ * This script checks that the alternative ways of computing the capacity coverage give the
+ * same results as GraphCH::capacity_coverage, on random units of a preprocessed region:
+ *  - tracker: CapacityCoverageTracker, while units are added, moved and removed one at a
+ *    time and the threshold changes,
+ *  - histogram: CoverageHistogram, for thresholds that are multiples of its bucket width,
+ *    and its rejection of thresholds above its range,
+ *  - scenarios: CoverageScenarios, for a single scenario and for the availability
+ *    scenarios of a fleet, with each metric of the graph.
+ * Every check prints OK or FAILED, the script exits with 1 if one of them failed.
+ *
+ * PREREQUISITE
+ * To have a precomputed graph in a directory, graph.flat or graph.dat and ch.dat, as
+ * generated by the ./test/pbf_to_contracted_graph.cpp script.
+ *
+ * COMPILE AND EXECUTE
+ *
+ * # Compile:
+ * g++ -Ilib/RoutingKit/include -Llib/RoutingKit/lib -std=c++11 -O3 ./test/coverage_consistency.cpp -o ./bin/coverage_consistency -lroutingkit -lprotobuf-lite -losmpbf -lz -lboost_serialization -pthread
+ *
+ * # Add needed shared libraries to the environment variable LD_LIBRARY_PATH:
+ * export LD_LIBRARY_PATH=$LD_LIBRARY_PATH:./lib/RoutingKit/lib:/usr/local/lib64:/usr/local/lib
+ *
+ * # Launch the generated executable: <graph directory> [fleet size] [threshold in seconds] [seed]
+ * ./bin/coverage_consistency ./data/backup/andorra 70 300 1
+ */
+
+#include <random>
+#include "../src/graph/graph.h"
+#include "../src/graph/capacity_coverage_tracker.h"
+#include "../src/graph/coverage_histogram.h"
+#include "../src/graph/coverage_scenarios.h"
+
+cms::GraphCH graph;
+unsigned failure_count = 0;
+
+/**
+ * Print the outcome of a check and count the failures.
+ */
+void check(const std::string& name, bool is_passed)
+{
+	cout_message((is_passed ? "OK      " : "FAILED  ") + name);
+	if (!is_passed)
+		failure_count++;
+}
+
+/**
+ * Coverage of source_list by GraphCH::capacity_coverage, the coverage held by the graph
+ * being left as it was.
+ */
+void get_reference_coverage(std::vector<unsigned> source_list, unsigned threshold, std::vector<unsigned>& coverage_node, std::vector<unsigned>& coverage_way, unsigned metric = 0)
+{
+	std::swap(coverage_node, graph.capacity_coverage_node);
+	std::swap(coverage_way, graph.capacity_coverage_way);
+	graph.capacity_coverage(source_list, threshold, metric);
+	std::swap(coverage_node, graph.capacity_coverage_node);
+	std::swap(coverage_way, graph.capacity_coverage_way);
+}
+
+bool is_graph_coverage_equal(const std::vector<unsigned>& source_list, unsigned threshold)
+{
+	std::vector<unsigned> coverage_node, coverage_way;
+	get_reference_coverage(source_list, threshold, coverage_node, coverage_way);
+	return coverage_node == graph.capacity_coverage_node && coverage_way == graph.capacity_coverage_way;
+}
+
+/**
+ * Follow the units with a CapacityCoverageTracker, comparing after each kind of change.
+ */
+void check_tracker(std::vector<unsigned> unit_node, unsigned threshold, std::mt19937& generator)
+{
+	std::uniform_int_distribution<unsigned> random_node(0, graph.node_count - 1);
+	cms::CapacityCoverageTracker tracker(graph, threshold);
+
+	for (unsigned u = 0; u < unit_node.size(); ++u)
+		tracker.add_unit(u, unit_node[u]);
+	check("tracker: " + std::to_string(unit_node.size()) + " units added", is_graph_coverage_equal(unit_node, threshold));
+
+	for (unsigned u = 0; u < unit_node.size(); u += 2) {
+		unit_node[u] = random_node(generator);
+		tracker.move_unit(u, unit_node[u]);
+	}
+	check("tracker: half of the units moved", is_graph_coverage_equal(unit_node, threshold));
+
+	std::vector<unsigned> remaining_node;
+	for (unsigned u = 0; u < unit_node.size(); ++u) {
+		if (u % 3 == 0)
+			tracker.remove_unit(u);
+		else
+			remaining_node.push_back(unit_node[u]);
+	}
+	check("tracker: a third of the units removed", is_graph_coverage_equal(remaining_node, threshold));
+
+	tracker.set_threshold(threshold * 2);
+	check("tracker: threshold doubled", is_graph_coverage_equal(remaining_node, threshold * 2));
+
+	bool is_rejected = false;
+	try {
+		tracker.add_unit(unit_node.size(), graph.node_count);
+	} catch (std::runtime_error&) {
+		is_rejected = true;
+	}
+	check("tracker: invalid node rejected", is_rejected && !tracker.has_unit(unit_node.size()));
+}
+
+/**
+ * Answer every multiple of a minute up to twice threshold from a single CoverageHistogram.
+ */
+void check_histogram(const std::vector<unsigned>& unit_node, unsigned threshold)
+{
+	unsigned bucket_width = 60;
+	unsigned max_threshold = (threshold * 2 + bucket_width - 1) / bucket_width * bucket_width;
+	cms::CoverageHistogram histogram(graph, bucket_width, max_threshold);
+	histogram.compute(unit_node);
+
+	bool is_equal = true;
+	for (unsigned t = 0; t <= max_threshold; t += bucket_width) {
+		histogram.capacity_coverage(t);
+		is_equal = is_equal && is_graph_coverage_equal(unit_node, t);
+	}
+	check("histogram: every multiple of " + std::to_string(bucket_width) + " seconds up to " + std::to_string(max_threshold), is_equal);
+
+	bool is_rejected = false;
+	try {
+		histogram.capacity_coverage(max_threshold + 1);
+	} catch (std::runtime_error&) {
+		is_rejected = true;
+	}
+	check("histogram: threshold above its range rejected", is_rejected);
+}
+
+/**
+ * Evaluate scenarios drawn from the units with CoverageScenarios under each metric: the
+ * minimum over a scenario holding every unit is its coverage, and the mean over several
+ * scenarios the mean of their coverages.
+ */
+void check_scenarios(const std::vector<unsigned>& unit_node, unsigned threshold)
+{
+	for (unsigned metric = 0; metric < graph.get_metric_count(); ++metric) {
+		std::string name = "scenarios (" + graph.get_metric_name(metric) + "): ";
+		cms::CoverageScenarios scenarios(graph, threshold, 0, metric);
+		scenarios.set_candidate_positions(unit_node);
+
+		std::vector<unsigned> coverage_node, coverage_way;
+		std::vector< std::vector<unsigned> > whole_fleet(1);
+		for (unsigned p = 0; p < unit_node.size(); ++p)
+			whole_fleet[0].push_back(p);
+		scenarios.evaluate(whole_fleet);
+		get_reference_coverage(unit_node, threshold, coverage_node, coverage_way, metric);
+		check(name + "scenario of the whole fleet", scenarios.coverage_min == coverage_way);
+
+		std::vector< std::vector<unsigned> > availability = cms::CoverageScenarios::draw_availability_scenarios(unit_node.size(), 10, 0.8, 1);
+		scenarios.evaluate(availability);
+		std::vector<double> coverage_sum(graph.arc_count, 0);
+		for (const std::vector<unsigned>& scenario : availability) {
+			std::vector<unsigned> source_list;
+			for (unsigned p : scenario)
+				source_list.push_back(unit_node[p]);
+			get_reference_coverage(source_list, threshold, coverage_node, coverage_way, metric);
+			for (unsigned a = 0; a < graph.arc_count; ++a)
+				coverage_sum[a] += coverage_way[a];
+		}
+		bool is_equal = true;
+		for (unsigned a = 0; a < graph.arc_count; ++a)
+			is_equal = is_equal && std::abs(scenarios.coverage_mean[a] - coverage_sum[a] / availability.size()) < 1e-3;
+		check(name + "mean of " + std::to_string(availability.size()) + " availability scenarios", is_equal);
+	}
+}
+
+int main(int argc, char*argv[])
+{
+	try{
+
+		if (argc < 2) {
+			std::cerr << "Usage: " << argv[0] << " <graph directory> [fleet size] [threshold in seconds] [seed]" << std::endl;
+			return 1;
+		}
+		std::string path_to_data_files = std::string(argv[1]);
+		unsigned fleet_size = (argc > 2) ? std::stoul(argv[2]) : 70;
+		unsigned threshold = (argc > 3) ? std::stoul(argv[3]) : 300;
+		unsigned seed = (argc > 4) ? std::stoul(argv[4]) : 1;
+
+		std::ifstream flat_file(path_to_data_files + "/graph.flat");
+		if (flat_file.good())
+			graph.load_from_flat_file(path_to_data_files + "/graph.flat");
+		else
+			graph.load_from_binary(path_to_data_files + "/graph.dat");
+		flat_file.close();
+
+		std::mt19937 generator(seed);
+		std::uniform_int_distribution<unsigned> random_node(0, graph.node_count - 1);
+		std::vector<unsigned> unit_node(fleet_size);
+		for (unsigned& node : unit_node)
+			node = random_node(generator);
+
+		check_tracker(unit_node, threshold, generator);
+		check_histogram(unit_node, threshold);
+		check_scenarios(unit_node, threshold);
+
+		cout_message(failure_count == 0 ? "All the coverages agree" : std::to_string(failure_count) + " checks failed");
+		return failure_count == 0 ? 0 : 1;
+
+	}catch(std::exception&err){
+		std::cerr << "Stopped on exception : " << err.what() << std::endl;
+		return 1;
+	}
+}
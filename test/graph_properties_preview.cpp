@@ -5,7 +5,7 @@
  * COMPILE AND EXECUTE
  *
  * # Compile:
- * g++ -Ilib/RoutingKit/include -Llib/RoutingKit/lib -std=c++11 ./test/graph_properties_preview.cpp -o ./bin/graph_properties_preview -lroutingkit -lprotobuf-lite -losmpbf -lz -lboost_serialization
+ * g++ -Ilib/RoutingKit/include -Llib/RoutingKit/lib -std=c++11 ./test/graph_properties_preview.cpp -o ./bin/graph_properties_preview -lroutingkit -lprotobuf-lite -losmpbf -lz -lboost_serialization -pthread
  * 
  * # Add needed shared libraries to the environment variable LD_LIBRARY_PATH:
  * export LD_LIBRARY_PATH=$LD_LIBRARY_PATH:./lib/RoutingKit/lib:/usr/local/lib64:/usr/local/lib
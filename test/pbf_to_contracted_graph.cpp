@@ -5,7 +5,7 @@
  * COMPILE AND EXECUTE
  *
  * # Compile:
- * g++ -Ilib/RoutingKit/include -Llib/RoutingKit/lib -std=c++11 ./test/pbf_to_contracted_graph.cpp -o ./bin/pbf_to_contracted_graph -lroutingkit -lprotobuf-lite -losmpbf -lz -lboost_serialization
+ * g++ -Ilib/RoutingKit/include -Llib/RoutingKit/lib -std=c++11 ./test/pbf_to_contracted_graph.cpp -o ./bin/pbf_to_contracted_graph -lroutingkit -lprotobuf-lite -losmpbf -lz -lboost_serialization -pthread
  * 
  * # Add needed shared libraries to the environment variable LD_LIBRARY_PATH:
  * export LD_LIBRARY_PATH=$LD_LIBRARY_PATH:./lib/RoutingKit/lib:/usr/local/lib64:/usr/local/lib
@@ -58,12 +58,19 @@ int main(int argc, char*argv[])
 
 		// Load the file in Graph instance
 		graph.load_from_pbf(pbf_file);
+		// Number the nodes close on the map close to each other, for the locality of the searches
+		graph.renumber_nodes_along_hilbert_curve();
 		// Save graph properties
 		graph.save_graph_to_a_binary_file("graph.dat",destination_subfolder);
 		// Build the contracted graph
 		graph.build_contraction_hierarchy();
 		// Save the contracted form of the Graph
 		graph.save_contraction_hierarchy("ch.dat",destination_subfolder);
+		// Build the metric independent contraction, further speed profiles only need a customization
+		graph.build_customizable_contraction_hierarchy();
+		graph.save_customizable_contraction_hierarchy("cch.dat",destination_subfolder);
+		// Save the graph and its contracted form in a single flat file, loaded without parsing
+		graph.save_graph_to_a_flat_file("graph.flat",destination_subfolder);
 
 	}catch(std::exception&err){
 		std::cerr << "Stopped on exception : " << err.what() << std::endl;